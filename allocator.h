@@ -1,7 +1,208 @@
 #pragma once
 
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "support.h"
+
 class MallocAllocator {
  public:
   void *allocate(size_t size, size_t) { return malloc(size); }
   void deallocate(void *ptr, size_t) { free(ptr); }
 };
+
+// Arena allocators declare `static const bool is_arena = true`. They free all
+// their memory at once, so containers can skip deallocating the memory they got
+// from an arena piece by piece. Arenas also provide reset() and shared(), which
+// tells whether other handles to the arena exist.
+template <class A>
+std::integral_constant<bool, A::is_arena> is_arena_allocator_test(int);
+template <class A>
+std::false_type is_arena_allocator_test(...);
+
+template <class Allocator>
+struct is_arena_allocator : decltype(is_arena_allocator_test<Allocator>(0)) {};
+
+// Allocates by bumping a pointer through a chain of chunks. Memory is given
+// back all at once by reset() or release(), which makes it a good fit for
+// containers that live as long as a request or a batch job. deallocate() only
+// reclaims the most recent allocation.
+//
+// The allocator is a handle to the arena: copies (e.g. the one a container
+// stores) share the chunks and the arena is released with the last handle.
+// Arenas aren't thread-safe.
+class BumpArenaAllocator {
+ private:
+  struct Chunk {
+    Chunk *next;
+    size_t size;  // Including this header
+
+    char *begin() { return reinterpret_cast<char *>(this) + headerSize(); }
+    char *end() { return reinterpret_cast<char *>(this) + size; }
+  };
+
+  struct Arena {
+    size_t refcount;
+    size_t chunk_size;
+    // Chunks in allocation order. The chunks after current are free.
+    Chunk *first;
+    Chunk *current;
+    // Free space in the current chunk.
+    char *ptr;
+    char *end;
+    size_t allocated_bytes;
+  };
+
+  // Chunks grow geometrically up to this size.
+  static const size_t max_chunk_size = 1024 * 1024;
+
+  Arena *_arena;
+
+ public:
+  static const bool is_arena = true;
+
+  explicit BumpArenaAllocator(size_t chunk_size = 4096) : _arena(new Arena) {
+    assert(chunk_size > headerSize());
+    _arena->refcount = 1;
+    _arena->chunk_size = chunk_size;
+    _arena->first = nullptr;
+    _arena->current = nullptr;
+    _arena->ptr = nullptr;
+    _arena->end = nullptr;
+    _arena->allocated_bytes = 0;
+  }
+
+  BumpArenaAllocator(const BumpArenaAllocator &other) : _arena(other._arena) {
+    _arena->refcount++;
+  }
+
+  BumpArenaAllocator &operator=(const BumpArenaAllocator &other) {
+    other._arena->refcount++;
+    unref();
+    _arena = other._arena;
+    return *this;
+  }
+
+  ~BumpArenaAllocator() { unref(); }
+
+  void *allocate(size_t size, size_t alignment) {
+    assert(alignment > 0 && (alignment & (alignment - 1)) == 0);
+    size_t adjustment = alignmentAdjustment(_arena->ptr, alignment);
+    if (UNLIKELY(size + adjustment > (size_t)(_arena->end - _arena->ptr))) {
+      if (!nextChunk(size + alignment - 1)) {
+        return nullptr;
+      }
+      adjustment = alignmentAdjustment(_arena->ptr, alignment);
+    }
+    char *ptr = _arena->ptr + adjustment;
+    _arena->ptr = ptr + size;
+    _arena->allocated_bytes += size;
+    return ptr;
+  }
+
+  void deallocate(void *ptr, size_t size) {
+    if (static_cast<char *>(ptr) + size == _arena->ptr) {
+      _arena->ptr = static_cast<char *>(ptr);
+    }
+    _arena->allocated_bytes -= size;
+  }
+
+  // Makes all the memory of the arena available again. The chunks are kept
+  // to serve the allocations that follow.
+  void reset() {
+    _arena->current = _arena->first;
+    _arena->ptr = _arena->first ? _arena->first->begin() : nullptr;
+    _arena->end = _arena->first ? _arena->first->end() : nullptr;
+    _arena->allocated_bytes = 0;
+  }
+
+  // Frees all the chunks of the arena.
+  void release() {
+    Chunk *chunk = _arena->first;
+    while (chunk) {
+      Chunk *next = chunk->next;
+      free(chunk);
+      chunk = next;
+    }
+    _arena->first = nullptr;
+    reset();
+  }
+
+  // Whether other copies of the allocator use the same arena.
+  bool shared() const { return _arena->refcount > 1; }
+
+  // Bytes allocated and not deallocated since the last reset.
+  size_t allocatedBytes() const { return _arena->allocated_bytes; }
+
+  // Bytes taken by the chunks of the arena.
+  size_t reservedBytes() const {
+    size_t reserved = 0;
+    for (Chunk *chunk = _arena->first; chunk; chunk = chunk->next) {
+      reserved += chunk->size;
+    }
+    return reserved;
+  }
+
+ private:
+  static constexpr size_t headerSize() {
+    return (sizeof(Chunk) + alignof(std::max_align_t) - 1) / alignof(std::max_align_t) *
+           alignof(std::max_align_t);
+  }
+
+  static size_t alignmentAdjustment(const char *ptr, size_t alignment) {
+    return (alignment - ((uintptr_t)ptr & (alignment - 1))) & (alignment - 1);
+  }
+
+  void unref() {
+    if (--_arena->refcount == 0) {
+      release();
+      delete _arena;
+    }
+  }
+
+  // Makes the chunk after the current one, which should have space for at least
+  // size bytes, the current chunk.
+  bool nextChunk(size_t size);
+};
+
+inline bool BumpArenaAllocator::nextChunk(size_t size) {
+  Chunk *current = _arena->current;
+  Chunk *next = current ? current->next : _arena->first;
+  // Chunks kept by reset() that are too small for this allocation stay unused
+  // until the next reset.
+  while (next && (size_t)(next->end() - next->begin()) < size) {
+    current = next;
+    next = next->next;
+  }
+
+  if (next == nullptr) {
+    size_t chunk_size = current ? current->size * 2 : _arena->chunk_size;
+    if (chunk_size > max_chunk_size) {
+      chunk_size = max_chunk_size;
+    }
+    if (chunk_size < headerSize() + size) {
+      chunk_size = headerSize() + size;
+    }
+    next = static_cast<Chunk *>(malloc(chunk_size));
+    if (next == nullptr) {
+      return false;
+    }
+    next->next = nullptr;
+    next->size = chunk_size;
+    if (current) {
+      current->next = next;
+    } else {
+      _arena->first = next;
+    }
+  }
+
+  _arena->current = next;
+  _arena->ptr = next->begin();
+  _arena->end = next->end();
+  return true;
+}
@@ -0,0 +1,135 @@
+#include <cstring>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#define GTEST
+#define HAMT_IMPLEMENTATION
+#include "allocator.h"
+#include "hash_array_mapped_trie.h"
+
+using foc::HashArrayMappedTrie;
+
+TEST(BumpArenaAllocatorTest, AllocateTest) {
+  BumpArenaAllocator arena(256);
+  EXPECT_EQ(arena.reservedBytes(), 0);
+
+  char *a = static_cast<char *>(arena.allocate(3, 1));
+  char *b = static_cast<char *>(arena.allocate(8, 8));
+  EXPECT_EQ((uintptr_t)b % 8, 0);
+  EXPECT_GE(b, a + 3);
+  char *c = static_cast<char *>(arena.allocate(16, 64));
+  EXPECT_EQ((uintptr_t)c % 64, 0);
+  EXPECT_EQ(arena.allocatedBytes(), 27);
+
+  // The last allocation can be given back.
+  arena.deallocate(c, 16);
+  EXPECT_EQ(arena.allocate(16, 64), c);
+
+  // Chunks are chained when they run out of space.
+  size_t reserved = arena.reservedBytes();
+  for (int i = 0; i < 100; i++) {
+    memset(arena.allocate(100, 8), i, 100);
+  }
+  EXPECT_GT(arena.reservedBytes(), reserved);
+  // Allocations larger than a chunk get a chunk of their own.
+  memset(arena.allocate(1 << 20, 16), 0, 1 << 20);
+}
+
+TEST(BumpArenaAllocatorTest, ResetTest) {
+  BumpArenaAllocator arena(1024);
+  void *first = arena.allocate(10, 8);
+  for (int i = 0; i < 1000; i++) {
+    arena.allocate(64, 8);
+  }
+  size_t reserved = arena.reservedBytes();
+
+  // The chunks are reused after a reset.
+  arena.reset();
+  EXPECT_EQ(arena.allocatedBytes(), 0);
+  EXPECT_EQ(arena.allocate(10, 8), first);
+  for (int i = 0; i < 1000; i++) {
+    arena.allocate(64, 8);
+  }
+  EXPECT_EQ(arena.reservedBytes(), reserved);
+
+  arena.release();
+  EXPECT_EQ(arena.reservedBytes(), 0);
+  EXPECT_NE(arena.allocate(10, 8), nullptr);
+}
+
+TEST(BumpArenaAllocatorTest, HAMTTest) {
+  using HAMT = HashArrayMappedTrie<int64_t, int64_t, std::hash<int64_t>, std::equal_to<int64_t>,
+                                   BumpArenaAllocator>;
+  BumpArenaAllocator arena;
+  {
+    // The HAMT shares the arena with its copy of the allocator.
+    HAMT hamt(1, std::hash<int64_t>(), std::equal_to<int64_t>(), arena);
+    for (int64_t i = 0; i < 10000; i++) {
+      hamt.insert(std::make_pair(i, i));
+    }
+    for (int64_t i = 0; i < 10000; i += 2) {
+      hamt.erase(i);
+    }
+    for (int64_t i = 0; i < 10000; i++) {
+      EXPECT_EQ(hamt.find(i) != nullptr, i % 2 == 1);
+    }
+    EXPECT_GT(arena.allocatedBytes(), 0);
+  }
+  // The entries are trivially destructible, so destroying the HAMT doesn't
+  // visit the trie and the memory stays allocated until the arena is reset.
+  EXPECT_GT(arena.allocatedBytes(), 0);
+  arena.reset();
+  EXPECT_EQ(arena.allocatedBytes(), 0);
+}
+
+TEST(BumpArenaAllocatorTest, HAMTClearTest) {
+  using HAMT = HashArrayMappedTrie<int64_t, int64_t, std::hash<int64_t>, std::equal_to<int64_t>,
+                                   BumpArenaAllocator>;
+  EXPECT_TRUE(is_arena_allocator<BumpArenaAllocator>::value);
+  EXPECT_FALSE(is_arena_allocator<MallocAllocator>::value);
+
+  // A HAMT that owns its arena resets it on clear().
+  HAMT hamt;
+  for (int64_t i = 0; i < 10000; i++) {
+    hamt.insert(std::make_pair(i, i));
+  }
+  EXPECT_GT(hamt.get_allocator().allocatedBytes(), 0);
+  hamt.clear();
+  EXPECT_EQ(hamt.get_allocator().allocatedBytes(), 0);
+  EXPECT_TRUE(hamt.empty());
+  for (int64_t i = 0; i < 100; i++) {
+    hamt.insert(std::make_pair(i, -i));
+  }
+  for (int64_t i = 0; i < 100; i++) {
+    EXPECT_EQ(*hamt.find(i), -i);
+  }
+
+  // An arena used by other HAMTs is left alone.
+  BumpArenaAllocator arena;
+  HAMT a(1, std::hash<int64_t>(), std::equal_to<int64_t>(), arena);
+  HAMT b(1, std::hash<int64_t>(), std::equal_to<int64_t>(), arena);
+  for (int64_t i = 0; i < 1000; i++) {
+    a.insert(std::make_pair(i, i));
+    b.insert(std::make_pair(i, i));
+  }
+  a.clear();
+  EXPECT_GT(arena.allocatedBytes(), 0);
+  for (int64_t i = 0; i < 1000; i++) {
+    EXPECT_EQ(*b.find(i), i);
+  }
+}
+
+TEST(BumpArenaAllocatorTest, HAMTWithStringsTest) {
+  // Entries that aren't trivially destructible are still destroyed.
+  using HAMT = HashArrayMappedTrie<std::string, std::string, std::hash<std::string>,
+                                   std::equal_to<std::string>, BumpArenaAllocator>;
+  HAMT hamt;
+  for (int i = 0; i < 1000; i++) {
+    hamt.insert(std::make_pair(std::to_string(i), std::string(100, 'x')));
+  }
+  hamt.clear();
+  for (int i = 0; i < 1000; i++) {
+    hamt.insert(std::make_pair(std::to_string(i), std::string(100, 'y')));
+  }
+}
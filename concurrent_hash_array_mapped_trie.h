@@ -0,0 +1,1759 @@
+// Concurrent Hash Array Mapped Trie
+//
+// A lock-free HAMT in the style of the Ctrie [1]. Every trie is reached through
+// an indirection node (INode) that holds an atomic pointer to the current
+// contents of the trie (a CNode). CNodes are never modified after they are
+// published: updates build a new CNode and install it with a CAS on the INode,
+// so lookups never block and updates in different tries don't contend.
+//
+// The keys whose hashes share all the slices are kept in a list node (LNode)
+// at detail::hamt_collision_level instead of a CNode, and found by comparing
+// keys.
+//
+// Erased entries can leave tries with a single entry behind. Those are
+// replaced by tomb nodes (TNode) and folded into their parents by the next
+// operation that finds them, which keeps the trie compact.
+//
+// Snapshots
+// ---------
+//
+// snapshot() and readOnlySnapshot() take a consistent snapshot in O(1) while
+// other threads keep updating the trie. Every INode belongs to a generation and
+// taking a snapshot gives the root of the trie a new generation. Updates copy
+// the INodes of older generations in their path before modifying them, so the
+// tries are copied lazily, one path at a time, after the snapshot.
+//
+// The main node of an INode is replaced with a GCAS (generation compare and
+// swap): the new main node is only committed if the generation of the root
+// didn't change since the update started, and the root is replaced with an
+// RDCSS (restricted double compare single swap) that only succeeds if the main
+// node of the root didn't change either.
+//
+// [1] "Concurrent Tries with Efficient Non-Blocking Snapshots". Aleksandar
+//     Prokopec, Nathan G. Bronson, Phil Bagwell and Martin Odersky. 2012.
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <new>
+#include <utility>
+
+#include "allocator.h"
+#include "epoch_reclaimer.h"
+#include "hash_array_mapped_trie.h"
+#include "support.h"
+
+namespace foc {
+
+namespace detail {
+
+enum class CtrieNodeKind : uint8_t { INode, SNode, CNode, LNode, TNode, FailedNode, Descriptor };
+
+template <class Entry>
+struct CtrieNode {
+  const CtrieNodeKind kind;
+  // Generation of the trie the node was created for.
+  const uint32_t gen;
+  // Number of nodes (and tries) pointing to the node. Only writers update it.
+  std::atomic<uint32_t> refcount;
+  CtrieNode *retired_next;
+
+  CtrieNode(CtrieNodeKind k, uint32_t g) : kind(k), gen(g), refcount(1), retired_next(nullptr) {}
+};
+
+// Base of the nodes an INode can point to (CNode, LNode, TNode and FailedNode).
+template <class Entry>
+struct CtrieMainNode : CtrieNode<Entry> {
+  // The main node replaced by a GCAS that is not committed yet, or a FailedNode
+  // if the GCAS was aborted. Null once the node is committed.
+  std::atomic<CtrieMainNode *> prev;
+
+  CtrieMainNode(CtrieNodeKind k, uint32_t g) : CtrieNode<Entry>(k, g), prev(nullptr) {}
+};
+
+// Holds an entry. Immutable.
+template <class Entry>
+struct CtrieSNode : CtrieNode<Entry> {
+  Entry entry;
+
+  CtrieSNode(const Entry &e, uint32_t g) : CtrieNode<Entry>(CtrieNodeKind::SNode, g), entry(e) {}
+};
+
+// Indirection node.
+template <class Entry>
+struct CtrieINode : CtrieNode<Entry> {
+  std::atomic<CtrieMainNode<Entry> *> main;
+
+  CtrieINode(CtrieMainNode<Entry> *m, uint32_t g)
+      : CtrieNode<Entry>(CtrieNodeKind::INode, g), main(m) {}
+
+  // The committed main node. Unlike the GCAS commit protocol, this never
+  // writes: a main node that is not committed yet is skipped in favour of the
+  // one it's replacing.
+  const CtrieMainNode<Entry> *committed() const {
+    const CtrieMainNode<Entry> *m = main.load(std::memory_order_acquire);
+    const CtrieMainNode<Entry> *p = m->prev.load(std::memory_order_acquire);
+    if (p == nullptr) {
+      return m;
+    }
+    if (p->kind == CtrieNodeKind::FailedNode) {
+      return p->prev.load(std::memory_order_acquire);
+    }
+    return p;
+  }
+};
+
+// Tomb of a trie that was left with a single entry. Immutable.
+template <class Entry>
+struct CtrieTNode : CtrieMainNode<Entry> {
+  CtrieSNode<Entry> *sn;
+
+  CtrieTNode(CtrieSNode<Entry> *s, uint32_t g)
+      : CtrieMainNode<Entry>(CtrieNodeKind::TNode, g), sn(s) {}
+};
+
+// Marks an aborted GCAS. prev is the main node to restore.
+template <class Entry>
+struct CtrieFailedNode : CtrieMainNode<Entry> {
+  explicit CtrieFailedNode(CtrieMainNode<Entry> *restore)
+      : CtrieMainNode<Entry>(CtrieNodeKind::FailedNode, 0) {
+    this->prev.store(restore, std::memory_order_relaxed);
+  }
+};
+
+// The contents of a trie: a bitmap and an array of SNodes and INodes in
+// logical order. Immutable once committed.
+template <class Entry>
+struct CtrieCNode : CtrieMainNode<Entry> {
+  uint32_t bitmap;
+  // The array extends past the end of the struct (see allocationSize()).
+  CtrieNode<Entry> *array[1];
+
+  CtrieCNode(uint32_t b, uint32_t g) : CtrieMainNode<Entry>(CtrieNodeKind::CNode, g), bitmap(b) {}
+
+  uint32_t size() const { return __builtin_popcount(bitmap); }
+
+  static size_t allocationSize(uint32_t size) {
+    return sizeof(CtrieCNode) + (size > 1 ? size - 1 : 0) * sizeof(CtrieNode<Entry> *);
+  }
+};
+
+// The contents of a trie at detail::hamt_collision_level: the SNodes of the
+// keys whose hashes share all the slices, in no particular order. Immutable
+// once committed.
+template <class Entry>
+struct CtrieLNode : CtrieMainNode<Entry> {
+  uint32_t size;
+  // The array extends past the end of the struct (see allocationSize()).
+  CtrieSNode<Entry> *array[1];
+
+  CtrieLNode(uint32_t s, uint32_t g) : CtrieMainNode<Entry>(CtrieNodeKind::LNode, g), size(s) {}
+
+  static size_t allocationSize(uint32_t size) {
+    return sizeof(CtrieLNode) + (size > 1 ? size - 1 : 0) * sizeof(CtrieSNode<Entry> *);
+  }
+};
+
+// Replaces the root while an RDCSS is in progress.
+template <class Entry>
+struct CtrieDescriptor : CtrieNode<Entry> {
+  enum State : uint8_t { Pending, Committed, Aborted };
+
+  CtrieINode<Entry> *old_root;
+  CtrieMainNode<Entry> *expected_main;
+  CtrieINode<Entry> *new_root;
+  std::atomic<uint8_t> state;
+
+  CtrieDescriptor(CtrieINode<Entry> *o, CtrieMainNode<Entry> *e, CtrieINode<Entry> *n)
+      : CtrieNode<Entry>(CtrieNodeKind::Descriptor, 0),
+        old_root(o),
+        expected_main(e),
+        new_root(n),
+        state(Pending) {}
+};
+
+}  // namespace detail
+
+// Iterates over the entries of a ConcurrentHashArrayMappedTrie.
+//
+// Iterating a read-only snapshot visits exactly the entries in the snapshot.
+// Iterating a trie that is being updated visits every entry that is in the trie
+// for the whole iteration and may or may not visit the others.
+//
+// Iterators don't pin the trie themselves (see pin()).
+template <class Entry>
+class ConcurrentHAMTConstForwardIterator {
+ private:
+  using Node = detail::CtrieNode<Entry>;
+  using MainNode = detail::CtrieMainNode<Entry>;
+  using SNode = detail::CtrieSNode<Entry>;
+  using INode = detail::CtrieINode<Entry>;
+  using TNode = detail::CtrieTNode<Entry>;
+  using CNode = detail::CtrieCNode<Entry>;
+  using LNode = detail::CtrieLNode<Entry>;
+  using NodeKind = detail::CtrieNodeKind;
+
+  struct Cursor {
+    const MainNode *main;
+    uint32_t index;
+  };
+
+  Cursor _stack[detail::hamt_max_depth];
+  // Number of cursors in the stack. The end() iterator has an empty stack.
+  uint32_t _depth;
+
+ public:
+  // clang-format off
+  typedef std::forward_iterator_tag  iterator_category;
+  typedef Entry                      value_type;
+  typedef ptrdiff_t                  difference_type;
+  typedef const Entry&               reference;
+  typedef const Entry*               pointer;
+  // clang-format on
+
+  ConcurrentHAMTConstForwardIterator() noexcept : _depth(0) {}
+  // Allows comparisons with nullptr as a synonym of end().
+  ConcurrentHAMTConstForwardIterator(std::nullptr_t) noexcept : _depth(0) {}
+
+  ConcurrentHAMTConstForwardIterator(const ConcurrentHAMTConstForwardIterator &it) noexcept
+      : _depth(it._depth) {
+    for (uint32_t i = 0; i < _depth; i++) {
+      _stack[i] = it._stack[i];
+    }
+  }
+
+  ConcurrentHAMTConstForwardIterator &operator=(
+      const ConcurrentHAMTConstForwardIterator &it) noexcept {
+    _depth = it._depth;
+    for (uint32_t i = 0; i < _depth; i++) {
+      _stack[i] = it._stack[i];
+    }
+    return *this;
+  }
+
+  reference operator*() const noexcept { return node()->entry; }
+  pointer operator->() const noexcept { return &node()->entry; }
+
+  ConcurrentHAMTConstForwardIterator &operator++() {
+    assert(_depth > 0 && "Can't increment the end() iterator");
+    _stack[_depth - 1].index++;
+    seekEntry();
+    return *this;
+  }
+
+  ConcurrentHAMTConstForwardIterator operator++(int) {
+    ConcurrentHAMTConstForwardIterator _this(*this);
+    ++(*this);
+    return _this;
+  }
+
+  friend bool operator==(const ConcurrentHAMTConstForwardIterator &x,
+                         const ConcurrentHAMTConstForwardIterator &y) {
+    return x.node() == y.node();
+  }
+
+  friend bool operator!=(const ConcurrentHAMTConstForwardIterator &x,
+                         const ConcurrentHAMTConstForwardIterator &y) {
+    return x.node() != y.node();
+  }
+
+ private:
+  explicit ConcurrentHAMTConstForwardIterator(const INode *root) noexcept : _depth(0) {
+    if (root) {
+      push(root);
+      seekEntry();
+    }
+  }
+
+  static uint32_t size(const MainNode *main) {
+    if (main->kind == NodeKind::TNode) {
+      return 1;
+    }
+    if (main->kind == NodeKind::LNode) {
+      return static_cast<const LNode *>(main)->size;
+    }
+    return static_cast<const CNode *>(main)->size();
+  }
+
+  const SNode *node() const {
+    if (_depth == 0) {
+      return nullptr;
+    }
+    const Cursor &cursor = _stack[_depth - 1];
+    if (cursor.main->kind == NodeKind::TNode) {
+      return static_cast<const TNode *>(cursor.main)->sn;
+    }
+    if (cursor.main->kind == NodeKind::LNode) {
+      return static_cast<const LNode *>(cursor.main)->array[cursor.index];
+    }
+    return static_cast<const SNode *>(static_cast<const CNode *>(cursor.main)->array[cursor.index]);
+  }
+
+  void push(const INode *in) {
+    assert(_depth < detail::hamt_max_depth);
+    _stack[_depth++] = Cursor{in->committed(), 0};
+  }
+
+  // Moves the cursors forward until the top of the stack points to an entry
+  // or the stack is empty (end of the traversal).
+  void seekEntry() {
+    while (_depth > 0) {
+      Cursor &cursor = _stack[_depth - 1];
+      if (cursor.index == size(cursor.main)) {
+        if (--_depth > 0) {
+          _stack[_depth - 1].index++;
+        }
+      } else if (cursor.main->kind == NodeKind::CNode &&
+                 static_cast<const CNode *>(cursor.main)->array[cursor.index]->kind ==
+                     NodeKind::INode) {
+        push(static_cast<const INode *>(
+            static_cast<const CNode *>(cursor.main)->array[cursor.index]));
+      } else {
+        return;
+      }
+    }
+  }
+
+  template <class, class, class, class, class>
+  friend class ConcurrentHashArrayMappedTrie;
+};
+
+template <class Key,
+          class T,
+          class Hash = std::hash<Key>,
+          class KeyEqual = std::equal_to<Key>,
+          class Allocator = MallocAllocator>
+class ConcurrentHashArrayMappedTrie {
+  // clang-format off
+ PUBLIC_IN_GTEST:
+  using Entry = std::pair<Key, T>;
+  // clang-format on
+  using Node = detail::CtrieNode<Entry>;
+  using MainNode = detail::CtrieMainNode<Entry>;
+  using SNode = detail::CtrieSNode<Entry>;
+  using INode = detail::CtrieINode<Entry>;
+  using TNode = detail::CtrieTNode<Entry>;
+  using CNode = detail::CtrieCNode<Entry>;
+  using LNode = detail::CtrieLNode<Entry>;
+  using FailedNode = detail::CtrieFailedNode<Entry>;
+  using Descriptor = detail::CtrieDescriptor<Entry>;
+  using NodeKind = detail::CtrieNodeKind;
+
+  struct NodeDeleter {
+    Allocator allocator;
+
+    void operator()(Node *node) { freeNode(allocator, node); }
+  };
+
+  using Reclaimer = EpochReclaimer<Node, NodeDeleter, Allocator>;
+  using Guard = typename Reclaimer::Guard;
+
+  // State shared by a trie and all its snapshots.
+  struct Domain {
+    std::atomic<uint32_t> refcount;
+    std::atomic<uint32_t> next_gen;
+    // Reclaims the nodes released by the tries of the domain.
+    Reclaimer reclaimer;
+
+    explicit Domain(const Allocator &a) : refcount(1), next_gen(1), reclaimer(NodeDeleter{a}, a) {}
+  };
+
+  enum class Status { Inserted, Replaced, Erased, NotFound, Restart, Failed };
+
+  // Outcome of a GCAS or an RDCSS. An aborted operation published the new node
+  // for a while, so it can only be retired (not freed right away).
+  enum class CASResult { Committed, Failed, Aborted };
+
+ public:
+  // clang-format off
+  typedef Key                                               key_type;
+  typedef T                                                 mapped_type;
+  typedef Hash                                              hasher;
+  typedef KeyEqual                                          key_equal;
+  typedef Allocator                                         allocator_type;
+  typedef std::pair<const Key, T>                           value_type;
+  typedef size_t                                            size_type;
+  typedef ConcurrentHAMTConstForwardIterator<Entry>         iterator;
+  typedef ConcurrentHAMTConstForwardIterator<Entry>         const_iterator;
+  typedef typename Reclaimer::Guard                         guard_type;
+  // clang-format on
+
+ PUBLIC_IN_GTEST:
+  // The root INode, or a Descriptor while an RDCSS is in progress.
+  std::atomic<Node *> _root;
+  Domain *_domain;
+  std::atomic<size_type> _count;
+  uint64_t _seed;
+  bool _read_only;
+  Hash _hasher;
+  KeyEqual _key_equal;
+  // Used concurrently by all the threads updating the trie and its snapshots.
+  Allocator _allocator;
+
+ public:
+  // If the root of the trie can't be allocated, the trie stays empty and every
+  // insert fails.
+  explicit ConcurrentHashArrayMappedTrie(const hasher &hf = hasher(),
+                                         const key_equal &eql = key_equal(),
+                                         const allocator_type &a = allocator_type());
+
+  // A moved-from trie can only be destroyed.
+  ConcurrentHashArrayMappedTrie(ConcurrentHashArrayMappedTrie &&other);
+
+  ConcurrentHashArrayMappedTrie(const ConcurrentHashArrayMappedTrie &) = delete;
+  ConcurrentHashArrayMappedTrie &operator=(const ConcurrentHashArrayMappedTrie &) = delete;
+
+  // Should not run concurrently with any other operation on this trie. Other
+  // snapshots of the trie can still be used.
+  ~ConcurrentHashArrayMappedTrie();
+
+  allocator_type get_allocator() const { return _allocator; }
+
+  // Approximate while other threads are updating the trie. The size of a
+  // snapshot starts as the approximate size of the trie when it was taken.
+  size_type size() const { return _count.load(std::memory_order_relaxed); }
+  bool empty() const { return size() == 0; }
+
+  bool readOnly() const { return _read_only; }
+
+  // The nodes unlinked by other threads aren't reclaimed while the guard is
+  // alive. Operations pin the trie themselves, iterators need a guard.
+  guard_type pin() const { return _domain ? _domain->reclaimer.pin() : guard_type(); }
+
+  const_iterator begin() const { return const_iterator(committedRoot()); }
+  const_iterator end() const { return const_iterator(); }
+  const_iterator cbegin() const { return begin(); }
+  const_iterator cend() const { return end(); }
+
+  // Copies the value of key into *value. Lock-free and never writes to the trie.
+  bool find(const Key &key, T *value) const;
+
+  // Inserts entry or replaces the value of an existing key. Returns false if the
+  // entry can't be inserted because memory ran out.
+  bool insert(const value_type &entry);
+
+  // Returns the number of erased entries.
+  size_type erase(const Key &key);
+
+  // Returns an independent copy of the trie in O(1). Both can be updated and
+  // copy the nodes they share the first time they update them. If the new roots
+  // can't be allocated, sets *succeeded to false and returns an empty trie
+  // without a root, like the constructor does.
+  ConcurrentHashArrayMappedTrie snapshot(bool *succeeded = nullptr);
+
+  // Returns a copy of the trie in O(1) that can't be updated. Updates on this
+  // trie don't copy the nodes of a read-only snapshot any sooner than they would
+  // do for a snapshot(). Fails like snapshot().
+  ConcurrentHashArrayMappedTrie readOnlySnapshot(bool *succeeded = nullptr);
+
+ private:
+  // Creates a snapshot of other with the given root, or a trie without a root
+  // if root is null.
+  ConcurrentHashArrayMappedTrie(const ConcurrentHashArrayMappedTrie &other,
+                                INode *root,
+                                bool read_only);
+
+  // RDCSS {{{
+
+  // Reads the root completing (or aborting) any RDCSS in progress.
+  INode *readRoot(const Guard &guard, bool abort = false);
+  // Reads the root without helping the RDCSS in progress.
+  const INode *committedRoot() const;
+  // Installs desc, which belongs to the caller until then.
+  CASResult rdcssRoot(const Guard &guard, Descriptor *desc);
+  void rdcssComplete(const Guard &guard, bool abort);
+
+  // }}}
+
+  // GCAS {{{
+
+  CASResult gcas(const Guard &guard, INode *in, MainNode *old_main, MainNode *new_main);
+  MainNode *gcasCommit(const Guard &guard, INode *in, MainNode *m);
+  // Reads the main node of in completing (or aborting) a GCAS in progress.
+  MainNode *gcasRead(const Guard &guard, INode *in) {
+    MainNode *m = in->main.load(std::memory_order_acquire);
+    if (m->prev.load(std::memory_order_acquire) == nullptr) {
+      return m;
+    }
+    return gcasCommit(guard, in, m);
+  }
+
+  // }}}
+
+  Status insertEntry(const Guard &guard,
+                     INode *in,
+                     const Entry &entry,
+                     uint64_t hash,
+                     uint32_t hash_offset,
+                     uint32_t level,
+                     INode *parent,
+                     uint32_t start_gen);
+
+  Status eraseEntry(const Guard &guard,
+                    INode *in,
+                    const Key &key,
+                    uint64_t hash,
+                    uint32_t hash_offset,
+                    uint32_t level,
+                    INode *parent,
+                    uint32_t start_gen);
+
+  // Replaces the main node old_main of in with new_main. Releases old_main once
+  // committed and disposes of new_main otherwise.
+  CASResult replaceMain(const Guard &guard, INode *in, MainNode *old_main, MainNode *new_main);
+
+  // Copies cn, which belongs to in, into the generation gen. The sub-tries of
+  // other generations are replaced by copies pointing to the same main nodes.
+  // Returns Inserted once the copy is installed.
+  Status renew(const Guard &guard, INode *in, CNode *cn, uint32_t gen);
+
+  // Builds the contents of a new trie at depth level containing x and y: an
+  // LNode at detail::hamt_collision_level and a CNode above it.
+  MainNode *dual(SNode *x,
+                 uint64_t x_hash,
+                 SNode *y,
+                 uint64_t y_hash,
+                 uint32_t hash_offset,
+                 uint32_t level,
+                 uint32_t gen);
+
+  // Folds the tombs found in the trie into it.
+  void clean(const Guard &guard, INode *in, uint32_t level);
+  // Folds the tomb of in (a sub-trie of parent) into parent.
+  void cleanParent(const Guard &guard,
+                   INode *parent,
+                   INode *in,
+                   uint32_t flag,
+                   uint32_t level,
+                   uint32_t start_gen);
+
+  // Copy of cn with the tombs of its sub-tries replaced by their entries. Holds
+  // a reference to all its branches, or is null if it's stale (see
+  // shareBranches()) or can't be allocated.
+  CNode *compressed(const Guard &guard, CNode *cn, uint32_t gen);
+  // Turns cn into a tomb (freeing cn) if it's not the root and only has an entry
+  // left.
+  MainNode *contracted(CNode *cn, uint32_t level);
+  // Turns ln into a tomb (freeing ln) if it only has an entry left.
+  MainNode *contracted(LNode *ln);
+
+  // The copies don't hold references to the branches they share with the
+  // original yet (see shareBranches()).
+  CNode *inserted(const CNode *cn, uint32_t pos, uint32_t flag, Node *branch, uint32_t gen);
+  CNode *updated(const CNode *cn, uint32_t pos, Node *branch, uint32_t gen);
+  CNode *removed(const CNode *cn, uint32_t pos, uint32_t flag, uint32_t gen);
+  // Copy of ln with sn at pos, which can be ln->size to append it.
+  LNode *updated(const LNode *ln, uint32_t pos, SNode *sn, uint32_t gen);
+  LNode *removed(const LNode *ln, uint32_t pos, uint32_t gen);
+  // Position of key in ln, or ln->size if it's not there.
+  uint32_t findColliding(const LNode *ln, const Key &key) const {
+    uint32_t pos = 0;
+    while (pos < ln->size && !_key_equal(ln->array[pos]->entry.first, key)) {
+      pos++;
+    }
+    return pos;
+  }
+
+  SNode *newSNode(const Entry &entry, uint32_t gen);
+  INode *newINode(MainNode *main, uint32_t gen);
+  TNode *newTNode(SNode *sn, uint32_t gen);
+  CNode *newCNode(uint32_t bitmap, uint32_t gen);
+  LNode *newLNode(uint32_t size, uint32_t gen);
+  FailedNode *newFailedNode(MainNode *restore);
+  Descriptor *newDescriptor(INode *old_root, MainNode *expected_main, INode *new_root);
+
+  // Memory management {{{
+  //
+  // Snapshots share nodes between generations, so the nodes are reference
+  // counted by the nodes (and tries) pointing to them. Writers take a
+  // reference to the nodes they copy into a new node and release the main node
+  // they replace, readers never touch the counts. A node released for the last
+  // time releases its own references and goes through the epoch reclaimer of
+  // the domain. Nodes that were never published are freed right away.
+  //
+  // A writer can copy a main node that another thread is replacing and
+  // releasing. The references to the nodes it reads from the trie are taken
+  // with tryAcquire(), which fails once a node lost its last reference. The
+  // copy is stale then and the writer starts over, so a released node is never
+  // referenced again.
+
+  // Destroys and deallocates a single node.
+  static void freeNode(Allocator &allocator, Node *node);
+  void freeNode(Node *node) { freeNode(_allocator, node); }
+  // Frees a trie created by dual() that was never published.
+  void freeDual(MainNode *main);
+
+  // Takes another reference to a node the caller holds a reference to.
+  static void acquire(Node *node) { node->refcount.fetch_add(1, std::memory_order_relaxed); }
+  // Takes a reference to node unless it was already released for the last time.
+  static bool tryAcquire(Node *node);
+  // Takes a reference to the branches of copy, a copy of a main node read from
+  // the trie, except fresh (a new node copy already owns). Returns false without
+  // holding any new reference if one of them was already released.
+  bool shareBranches(const Guard &guard, MainNode *copy, const Node *fresh);
+  // Drops a reference to node. The last one retires node.
+  void release(const Guard &guard, Node *node);
+  // Drops the references node holds to other nodes.
+  void releaseChildren(const Guard &guard, Node *node);
+  // Takes care of node, which was only reachable from a proposed main node:
+  // freed if the proposal was never published and retired if it was aborted.
+  void dispose(const Guard &guard, CASResult result, Node *node);
+
+  // Reclaims node once the threads pinned at this point unpin.
+  void retireNow(const Guard &guard, Node *node) { _domain->reclaimer.retire(guard, node); }
+  // Drops the reference of this trie to the domain.
+  void releaseDomain();
+
+  // }}}
+
+  uint64_t hash64(const Key &key) const {
+    return detail::hamt_mix_hash(_seed ^ static_cast<uint64_t>(_hasher(key)));
+  }
+};
+
+// ConcurrentHashArrayMappedTrie {{{
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::ConcurrentHashArrayMappedTrie(
+    const hasher &hf, const key_equal &eql, const allocator_type &a)
+    : _count(0), _read_only(false), _hasher(hf), _key_equal(eql), _allocator(a) {
+  _seed = FOC_GET_HASH_SEED;
+  void *ptr = _allocator.allocate(sizeof(Domain), alignof(Domain));
+  _domain = ptr ? new (ptr) Domain(_allocator) : nullptr;
+  CNode *cn = _domain ? newCNode(0, 0) : nullptr;
+  INode *root = cn ? newINode(cn, 0) : nullptr;
+  if (root == nullptr) {
+    if (cn) {
+      freeNode(cn);
+    }
+    if (_domain) {
+      _domain->~Domain();
+      _allocator.deallocate(_domain, sizeof(Domain));
+      _domain = nullptr;
+    }
+  }
+  _root.store(root, std::memory_order_relaxed);
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::ConcurrentHashArrayMappedTrie(
+    ConcurrentHashArrayMappedTrie &&other)
+    : _root(other._root.load(std::memory_order_relaxed)),
+      _domain(other._domain),
+      _count(other._count.load(std::memory_order_relaxed)),
+      _seed(other._seed),
+      _read_only(other._read_only),
+      _hasher(std::move(other._hasher)),
+      _key_equal(std::move(other._key_equal)),
+      _allocator(std::move(other._allocator)) {
+  other._root.store(nullptr, std::memory_order_relaxed);
+  other._domain = nullptr;
+  other._count.store(0, std::memory_order_relaxed);
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::ConcurrentHashArrayMappedTrie(
+    const ConcurrentHashArrayMappedTrie &other, INode *root, bool read_only)
+    : _root(root),
+      _domain(root ? other._domain : nullptr),
+      _count(root ? other._count.load(std::memory_order_relaxed) : 0),
+      _seed(other._seed),
+      _read_only(read_only),
+      _hasher(other._hasher),
+      _key_equal(other._key_equal),
+      _allocator(other._allocator) {
+  if (_domain) {
+    _domain->refcount.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::~ConcurrentHashArrayMappedTrie() {
+  if (_domain) {
+    {
+      Guard guard = pin();
+      release(guard, _root.load(std::memory_order_acquire));
+    }
+    releaseDomain();
+  }
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+bool ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::find(const Key &key,
+                                                                           T *value) const {
+  Guard guard = pin();
+  const INode *in = committedRoot();
+  if (in == nullptr) {
+    return false;
+  }
+  uint64_t hash = hash64(key);
+  uint32_t hash_offset = 0;
+
+  for (;;) {
+    const MainNode *main = in->committed();
+    const SNode *sn;
+    if (main->kind == NodeKind::TNode) {
+      // The entry of a tomb is still in the map until it's moved to the parent.
+      sn = static_cast<const TNode *>(main)->sn;
+    } else if (UNLIKELY(main->kind == NodeKind::LNode)) {
+      const LNode *ln = static_cast<const LNode *>(main);
+      uint32_t pos = findColliding(ln, key);
+      if (pos == ln->size) {
+        return false;
+      }
+      sn = ln->array[pos];
+    } else {
+      const CNode *cn = static_cast<const CNode *>(main);
+      uint32_t flag = 0x1U << ((hash >> hash_offset) & 0x1f);
+      if (!(cn->bitmap & flag)) {
+        return false;
+      }
+      const Node *branch = cn->array[__builtin_popcount(cn->bitmap & (flag - 1))];
+      if (branch->kind == NodeKind::INode) {
+        in = static_cast<const INode *>(branch);
+        hash_offset += 5;
+        continue;
+      }
+      sn = static_cast<const SNode *>(branch);
+    }
+
+    if (_key_equal(sn->entry.first, key)) {
+      *value = sn->entry.second;
+      return true;
+    }
+    return false;
+  }
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+bool ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::insert(
+    const value_type &entry) {
+  assert(!_read_only && "Can't update a read-only snapshot");
+  if (_read_only || _domain == nullptr) {
+    return false;
+  }
+  Entry new_entry(entry);
+  uint64_t hash = hash64(new_entry.first);
+  Guard guard = pin();
+  Status status;
+  do {
+    INode *root = readRoot(guard);
+    status = insertEntry(guard, root, new_entry, hash, 0, 0, nullptr, root->gen);
+  } while (status == Status::Restart);
+
+  if (status == Status::Inserted) {
+    _count.fetch_add(1, std::memory_order_relaxed);
+  }
+  return status != Status::Failed;
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+typename ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::size_type
+ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::erase(const Key &key) {
+  assert(!_read_only && "Can't update a read-only snapshot");
+  if (_read_only || _domain == nullptr) {
+    return 0;
+  }
+  uint64_t hash = hash64(key);
+  Guard guard = pin();
+  Status status;
+  do {
+    INode *root = readRoot(guard);
+    status = eraseEntry(guard, root, key, hash, 0, 0, nullptr, root->gen);
+  } while (status == Status::Restart);
+
+  if (status == Status::Erased) {
+    _count.fetch_sub(1, std::memory_order_relaxed);
+    return 1;
+  }
+  return 0;
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>
+ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::snapshot(bool *succeeded) {
+  if (succeeded) {
+    *succeeded = false;
+  }
+  if (_domain == nullptr) {
+    return ConcurrentHashArrayMappedTrie(*this, nullptr, false);
+  }
+  Guard guard = pin();
+  for (;;) {
+    INode *root = readRoot(guard);
+    MainNode *main = gcasRead(guard, root);
+    if (!tryAcquire(main)) {
+      // Replaced since it was read.
+      continue;
+    }
+    INode *snapshot_root =
+        newINode(main, _domain->next_gen.fetch_add(1, std::memory_order_relaxed));
+    if (snapshot_root == nullptr) {
+      release(guard, main);
+      return ConcurrentHashArrayMappedTrie(*this, nullptr, false);
+    }
+    if (_read_only) {
+      // The root of a read-only trie never changes.
+      if (succeeded) {
+        *succeeded = true;
+      }
+      return ConcurrentHashArrayMappedTrie(*this, snapshot_root, false);
+    }
+
+    INode *new_root = newINode(main, _domain->next_gen.fetch_add(1, std::memory_order_relaxed));
+    Descriptor *desc = new_root ? newDescriptor(root, main, new_root) : nullptr;
+    if (desc == nullptr) {
+      if (new_root) {
+        freeNode(new_root);
+      }
+      dispose(guard, CASResult::Failed, snapshot_root);
+      return ConcurrentHashArrayMappedTrie(*this, nullptr, false);
+    }
+    acquire(main);
+    CASResult result = rdcssRoot(guard, desc);
+    if (result == CASResult::Committed) {
+      release(guard, root);
+      if (succeeded) {
+        *succeeded = true;
+      }
+      return ConcurrentHashArrayMappedTrie(*this, snapshot_root, false);
+    }
+    dispose(guard, CASResult::Failed, snapshot_root);
+    dispose(guard, result, new_root);
+  }
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>
+ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::readOnlySnapshot(
+    bool *succeeded) {
+  if (succeeded) {
+    *succeeded = false;
+  }
+  if (_domain == nullptr) {
+    return ConcurrentHashArrayMappedTrie(*this, nullptr, true);
+  }
+  Guard guard = pin();
+  if (_read_only) {
+    // This trie holds a reference to its root, which never changes.
+    INode *root = readRoot(guard);
+    acquire(root);
+    if (succeeded) {
+      *succeeded = true;
+    }
+    return ConcurrentHashArrayMappedTrie(*this, root, true);
+  }
+  for (;;) {
+    INode *root = readRoot(guard);
+    MainNode *main = gcasRead(guard, root);
+    if (!tryAcquire(main)) {
+      continue;
+    }
+    // The current root becomes the root of the snapshot. Updates from now on go
+    // through a root of a new generation.
+    INode *new_root = newINode(main, _domain->next_gen.fetch_add(1, std::memory_order_relaxed));
+    Descriptor *desc = new_root ? newDescriptor(root, main, new_root) : nullptr;
+    if (desc == nullptr) {
+      if (new_root) {
+        freeNode(new_root);
+      }
+      release(guard, main);
+      return ConcurrentHashArrayMappedTrie(*this, nullptr, true);
+    }
+    CASResult result = rdcssRoot(guard, desc);
+    if (result == CASResult::Committed) {
+      if (succeeded) {
+        *succeeded = true;
+      }
+      return ConcurrentHashArrayMappedTrie(*this, root, true);
+    }
+    dispose(guard, result, new_root);
+  }
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+typename ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::INode *
+ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::readRoot(const Guard &guard,
+                                                                          bool abort) {
+  for (;;) {
+    Node *root = _root.load(std::memory_order_acquire);
+    if (root->kind == NodeKind::INode) {
+      return static_cast<INode *>(root);
+    }
+    rdcssComplete(guard, abort);
+  }
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+const typename ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::INode *
+ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::committedRoot() const {
+  // The root of an RDCSS in progress is still the old root unless the RDCSS was
+  // already decided to commit.
+  const Node *root = _root.load(std::memory_order_acquire);
+  if (root == nullptr || root->kind == NodeKind::INode) {
+    return static_cast<const INode *>(root);
+  }
+  const Descriptor *desc = static_cast<const Descriptor *>(root);
+  if (desc->state.load(std::memory_order_acquire) == Descriptor::Committed) {
+    return desc->new_root;
+  }
+  return desc->old_root;
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+typename ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::CASResult
+ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::rdcssRoot(const Guard &guard,
+                                                                           Descriptor *desc) {
+  Node *expected = desc->old_root;
+  if (!_root.compare_exchange_strong(
+          expected, desc, std::memory_order_acq_rel, std::memory_order_acquire)) {
+    freeNode(desc);
+    return CASResult::Failed;
+  }
+  rdcssComplete(guard, false);
+  CASResult result = desc->state.load(std::memory_order_acquire) == Descriptor::Committed
+                         ? CASResult::Committed
+                         : CASResult::Aborted;
+  retireNow(guard, desc);
+  return result;
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+void ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::rdcssComplete(
+    const Guard &guard, bool abort) {
+  for (;;) {
+    Node *root = _root.load(std::memory_order_acquire);
+    if (root->kind == NodeKind::INode) {
+      return;
+    }
+
+    // Decide the outcome first so that every thread completing the RDCSS (and
+    // the thread that started it) agree on it.
+    Descriptor *desc = static_cast<Descriptor *>(root);
+    uint8_t state = desc->state.load(std::memory_order_acquire);
+    if (state == Descriptor::Pending) {
+      uint8_t decision = Descriptor::Aborted;
+      if (!abort && gcasRead(guard, desc->old_root) == desc->expected_main) {
+        decision = Descriptor::Committed;
+      }
+      desc->state.compare_exchange_strong(
+          state, decision, std::memory_order_acq_rel, std::memory_order_acquire);
+      state = desc->state.load(std::memory_order_acquire);
+    }
+
+    Node *expected = desc;
+    Node *replacement = state == Descriptor::Committed ? desc->new_root : desc->old_root;
+    _root.compare_exchange_strong(
+        expected, replacement, std::memory_order_acq_rel, std::memory_order_acquire);
+  }
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+typename ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::CASResult
+ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::gcas(const Guard &guard,
+                                                                      INode *in,
+                                                                      MainNode *old_main,
+                                                                      MainNode *new_main) {
+  new_main->prev.store(old_main, std::memory_order_relaxed);
+  MainNode *expected = old_main;
+  if (!in->main.compare_exchange_strong(
+          expected, new_main, std::memory_order_acq_rel, std::memory_order_acquire)) {
+    return CASResult::Failed;
+  }
+  gcasCommit(guard, in, new_main);
+  if (new_main->prev.load(std::memory_order_acquire) == nullptr) {
+    return CASResult::Committed;
+  }
+  return CASResult::Aborted;
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+typename ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::MainNode *
+ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::gcasCommit(const Guard &guard,
+                                                                            INode *in,
+                                                                            MainNode *m) {
+  for (;;) {
+    MainNode *p = m->prev.load(std::memory_order_acquire);
+    if (p == nullptr) {
+      return m;
+    }
+
+    INode *root = readRoot(guard, true);
+    if (p->kind == NodeKind::FailedNode) {
+      // Aborted: restore the previous main node.
+      MainNode *expected = m;
+      MainNode *restore = p->prev.load(std::memory_order_acquire);
+      if (in->main.compare_exchange_strong(
+              expected, restore, std::memory_order_acq_rel, std::memory_order_acquire)) {
+        return restore;
+      }
+      m = in->main.load(std::memory_order_acquire);
+      continue;
+    }
+
+    if (root->gen == in->gen && !_read_only) {
+      // Commit
+      MainNode *expected = p;
+      if (m->prev.compare_exchange_strong(
+              expected, nullptr, std::memory_order_acq_rel, std::memory_order_acquire)) {
+        return m;
+      }
+      continue;
+    }
+
+    // A snapshot was taken since the update started. Abort.
+    FailedNode *fn = newFailedNode(p);
+    if (fn == nullptr) {
+      continue;
+    }
+    MainNode *expected = p;
+    if (!m->prev.compare_exchange_strong(
+            expected, fn, std::memory_order_acq_rel, std::memory_order_acquire)) {
+      freeNode(fn);
+    }
+    m = in->main.load(std::memory_order_acquire);
+  }
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+typename ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::CASResult
+ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::replaceMain(const Guard &guard,
+                                                                             INode *in,
+                                                                             MainNode *old_main,
+                                                                             MainNode *new_main) {
+  CASResult result = gcas(guard, in, old_main, new_main);
+  if (result == CASResult::Committed) {
+    release(guard, old_main);
+  } else {
+    if (result == CASResult::Aborted) {
+      // The FailedNode of the aborted GCAS.
+      retireNow(guard, new_main->prev.load(std::memory_order_acquire));
+    }
+    dispose(guard, result, new_main);
+  }
+  return result;
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+typename ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::Status
+ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::renew(const Guard &guard,
+                                                                       INode *in,
+                                                                       CNode *cn,
+                                                                       uint32_t gen) {
+  CNode *ncn = newCNode(cn->bitmap, gen);
+  if (ncn == nullptr) {
+    return Status::Failed;
+  }
+  const uint32_t sz = cn->size();
+  for (uint32_t i = 0; i < sz; i++) {
+    Node *branch = cn->array[i];
+    Status status = Status::Restart;
+    if (branch->kind == NodeKind::INode && branch->gen != gen) {
+      MainNode *main = gcasRead(guard, static_cast<INode *>(branch));
+      if (tryAcquire(main)) {
+        branch = newINode(main, gen);
+        if (branch == nullptr) {
+          release(guard, main);
+          status = Status::Failed;
+        }
+      } else {
+        branch = nullptr;
+      }
+    } else if (!tryAcquire(branch)) {
+      branch = nullptr;
+    }
+    if (branch == nullptr) {
+      // Out of memory or cn was replaced since it was read.
+      for (uint32_t j = 0; j < i; j++) {
+        release(guard, ncn->array[j]);
+      }
+      freeNode(ncn);
+      return status;
+    }
+    ncn->array[i] = branch;
+  }
+
+  if (replaceMain(guard, in, cn, ncn) == CASResult::Committed) {
+    return Status::Inserted;
+  }
+  return Status::Restart;
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+typename ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::Status
+ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::insertEntry(const Guard &guard,
+                                                                             INode *in,
+                                                                             const Entry &entry,
+                                                                             uint64_t hash,
+                                                                             uint32_t hash_offset,
+                                                                             uint32_t level,
+                                                                             INode *parent,
+                                                                             uint32_t start_gen) {
+  for (;;) {
+    MainNode *main = gcasRead(guard, in);
+    if (main->kind == NodeKind::TNode) {
+      clean(guard, parent, level - 1);
+      return Status::Restart;
+    }
+
+    if (UNLIKELY(main->kind == NodeKind::LNode)) {
+      // Replace the entry of the key or append a new one to a copy of ln.
+      LNode *ln = static_cast<LNode *>(main);
+      uint32_t pos = findColliding(ln, entry.first);
+      SNode *sn = newSNode(entry, in->gen);
+      LNode *nln = sn ? updated(ln, pos, sn, in->gen) : nullptr;
+      if (nln == nullptr) {
+        if (sn) {
+          freeNode(sn);
+        }
+        return Status::Failed;
+      }
+      if (!shareBranches(guard, nln, sn)) {
+        freeNode(nln);
+        freeNode(sn);
+        continue;
+      }
+      CASResult result = replaceMain(guard, in, ln, nln);
+      if (result == CASResult::Committed) {
+        return pos < ln->size ? Status::Replaced : Status::Inserted;
+      }
+      if (result == CASResult::Failed) {
+        continue;
+      }
+      return Status::Restart;
+    }
+
+    CNode *cn = static_cast<CNode *>(main);
+    uint32_t flag = 0x1U << ((hash >> hash_offset) & 0x1f);
+    uint32_t pos = __builtin_popcount(cn->bitmap & (flag - 1));
+
+    // Empty position: insert the entry in a copy of cn.
+    if (!(cn->bitmap & flag)) {
+      SNode *sn = newSNode(entry, in->gen);
+      CNode *ncn = sn ? inserted(cn, pos, flag, sn, in->gen) : nullptr;
+      if (ncn == nullptr) {
+        if (sn) {
+          freeNode(sn);
+        }
+        return Status::Failed;
+      }
+      if (!shareBranches(guard, ncn, sn)) {
+        freeNode(ncn);
+        freeNode(sn);
+        continue;
+      }
+      CASResult result = replaceMain(guard, in, cn, ncn);
+      if (result == CASResult::Committed) {
+        return Status::Inserted;
+      }
+      if (result == CASResult::Failed) {
+        continue;
+      }
+      return Status::Restart;
+    }
+
+    Node *branch = cn->array[pos];
+    if (branch->kind == NodeKind::INode) {
+      INode *child = static_cast<INode *>(branch);
+      if (child->gen != start_gen) {
+        // The sub-trie is shared with a snapshot. Copy it to this generation
+        // and try again.
+        Status status = renew(guard, in, cn, start_gen);
+        if (status == Status::Inserted) {
+          continue;
+        }
+        return status;
+      }
+      return insertEntry(guard, child, entry, hash, hash_offset + 5, level + 1, in, start_gen);
+    }
+
+    SNode *old_sn = static_cast<SNode *>(branch);
+    bool same_key = _key_equal(old_sn->entry.first, entry.first);
+    SNode *sn = newSNode(entry, in->gen);
+    if (sn == nullptr) {
+      return Status::Failed;
+    }
+
+    // Replace the entry or the entry with a trie containing both entries.
+    INode *nin = nullptr;
+    if (!same_key) {
+      // The new trie shares old_sn with cn.
+      if (!tryAcquire(old_sn)) {
+        freeNode(sn);
+        continue;
+      }
+      uint64_t old_hash = hash64(old_sn->entry.first);
+      MainNode *sub = dual(old_sn, old_hash, sn, hash, hash_offset + 5, level + 1, in->gen);
+      nin = sub ? newINode(sub, in->gen) : nullptr;
+      if (nin == nullptr) {
+        if (sub) {
+          freeDual(sub);
+        }
+        release(guard, old_sn);
+        freeNode(sn);
+        return Status::Failed;
+      }
+    }
+    Node *new_branch = same_key ? static_cast<Node *>(sn) : nin;
+    CNode *ncn = updated(cn, pos, new_branch, in->gen);
+    if (ncn == nullptr) {
+      dispose(guard, CASResult::Failed, new_branch);
+      return Status::Failed;
+    }
+    if (!shareBranches(guard, ncn, new_branch)) {
+      freeNode(ncn);
+      dispose(guard, CASResult::Failed, new_branch);
+      continue;
+    }
+    if (replaceMain(guard, in, cn, ncn) == CASResult::Committed) {
+      return same_key ? Status::Replaced : Status::Inserted;
+    }
+    return Status::Restart;
+  }
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+typename ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::MainNode *
+ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::dual(SNode *x,
+                                                                      uint64_t x_hash,
+                                                                      SNode *y,
+                                                                      uint64_t y_hash,
+                                                                      uint32_t hash_offset,
+                                                                      uint32_t level,
+                                                                      uint32_t gen) {
+  if (UNLIKELY(level == detail::hamt_collision_level)) {
+    LNode *ln = newLNode(2, gen);
+    if (ln) {
+      ln->array[0] = x;
+      ln->array[1] = y;
+    }
+    return ln;
+  }
+
+  uint32_t x_slice = (x_hash >> hash_offset) & 0x1f;
+  uint32_t y_slice = (y_hash >> hash_offset) & 0x1f;
+  if (x_slice != y_slice) {
+    CNode *cn = newCNode((0x1U << x_slice) | (0x1U << y_slice), gen);
+    if (cn) {
+      cn->array[0] = x_slice < y_slice ? x : y;
+      cn->array[1] = x_slice < y_slice ? y : x;
+    }
+    return cn;
+  }
+
+  MainNode *sub = dual(x, x_hash, y, y_hash, hash_offset + 5, level + 1, gen);
+  INode *in = sub ? newINode(sub, gen) : nullptr;
+  CNode *cn = in ? newCNode(0x1U << x_slice, gen) : nullptr;
+  if (cn == nullptr) {
+    if (in) {
+      freeNode(in);
+    }
+    if (sub) {
+      freeDual(sub);
+    }
+    return nullptr;
+  }
+  cn->array[0] = in;
+  return cn;
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+typename ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::Status
+ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::eraseEntry(const Guard &guard,
+                                                                            INode *in,
+                                                                            const Key &key,
+                                                                            uint64_t hash,
+                                                                            uint32_t hash_offset,
+                                                                            uint32_t level,
+                                                                            INode *parent,
+                                                                            uint32_t start_gen) {
+  for (;;) {
+    MainNode *main = gcasRead(guard, in);
+    if (main->kind == NodeKind::TNode) {
+      clean(guard, parent, level - 1);
+      return Status::Restart;
+    }
+
+    if (UNLIKELY(main->kind == NodeKind::LNode)) {
+      LNode *ln = static_cast<LNode *>(main);
+      uint32_t pos = findColliding(ln, key);
+      if (pos == ln->size) {
+        return Status::NotFound;
+      }
+      LNode *nln = removed(ln, pos, in->gen);
+      if (nln == nullptr) {
+        return Status::Failed;
+      }
+      if (!shareBranches(guard, nln, nullptr)) {
+        freeNode(nln);
+        continue;
+      }
+      if (replaceMain(guard, in, ln, contracted(nln)) == CASResult::Committed) {
+        return Status::Erased;
+      }
+      return Status::Restart;
+    }
+
+    CNode *cn = static_cast<CNode *>(main);
+    uint32_t flag = 0x1U << ((hash >> hash_offset) & 0x1f);
+    if (!(cn->bitmap & flag)) {
+      return Status::NotFound;
+    }
+    uint32_t pos = __builtin_popcount(cn->bitmap & (flag - 1));
+
+    Node *branch = cn->array[pos];
+    if (branch->kind == NodeKind::INode) {
+      INode *child = static_cast<INode *>(branch);
+      if (child->gen != start_gen) {
+        Status status = renew(guard, in, cn, start_gen);
+        if (status == Status::Inserted) {
+          continue;
+        }
+        return status;
+      }
+      Status status =
+          eraseEntry(guard, child, key, hash, hash_offset + 5, level + 1, in, start_gen);
+      if (status == Status::Erased && gcasRead(guard, child)->kind == NodeKind::TNode) {
+        cleanParent(guard, in, child, flag, level, start_gen);
+      }
+      return status;
+    }
+
+    SNode *sn = static_cast<SNode *>(branch);
+    if (!_key_equal(sn->entry.first, key)) {
+      return Status::NotFound;
+    }
+
+    CNode *ncn = removed(cn, pos, flag, in->gen);
+    if (ncn == nullptr) {
+      return Status::Failed;
+    }
+    if (!shareBranches(guard, ncn, nullptr)) {
+      freeNode(ncn);
+      continue;
+    }
+    if (replaceMain(guard, in, cn, contracted(ncn, level)) == CASResult::Committed) {
+      return Status::Erased;
+    }
+    return Status::Restart;
+  }
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+void ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::clean(const Guard &guard,
+                                                                            INode *in,
+                                                                            uint32_t level) {
+  MainNode *main = gcasRead(guard, in);
+  if (main->kind != NodeKind::CNode) {
+    return;
+  }
+
+  CNode *ncn = compressed(guard, static_cast<CNode *>(main), in->gen);
+  if (ncn) {
+    replaceMain(guard, in, main, contracted(ncn, level));
+  }
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+void ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::cleanParent(
+    const Guard &guard,
+    INode *parent,
+    INode *in,
+    uint32_t flag,
+    uint32_t level,
+    uint32_t start_gen) {
+  for (;;) {
+    MainNode *parent_main = gcasRead(guard, parent);
+    if (parent_main->kind != NodeKind::CNode) {
+      return;
+    }
+    CNode *cn = static_cast<CNode *>(parent_main);
+    uint32_t pos = __builtin_popcount(cn->bitmap & (flag - 1));
+    if (!(cn->bitmap & flag) || cn->array[pos] != in) {
+      return;
+    }
+    MainNode *main = gcasRead(guard, in);
+    if (main->kind != NodeKind::TNode) {
+      return;
+    }
+
+    // The entry of the tomb is shared too.
+    CNode *ncn = updated(cn, pos, static_cast<TNode *>(main)->sn, parent->gen);
+    if (ncn == nullptr) {
+      return;
+    }
+    if (!shareBranches(guard, ncn, nullptr)) {
+      freeNode(ncn);
+      continue;
+    }
+    if (replaceMain(guard, parent, cn, contracted(ncn, level)) == CASResult::Committed) {
+      return;
+    }
+    if (readRoot(guard)->gen != start_gen) {
+      return;
+    }
+  }
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+typename ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::CNode *
+ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::compressed(const Guard &guard,
+                                                                            CNode *cn,
+                                                                            uint32_t gen) {
+  CNode *ncn = newCNode(cn->bitmap, gen);
+  if (ncn == nullptr) {
+    return nullptr;
+  }
+  for (uint32_t i = 0; i < cn->size(); i++) {
+    Node *branch = cn->array[i];
+    if (branch->kind == NodeKind::INode) {
+      MainNode *main = gcasRead(guard, static_cast<INode *>(branch));
+      if (main->kind == NodeKind::TNode) {
+        branch = static_cast<TNode *>(main)->sn;
+      }
+    }
+    ncn->array[i] = branch;
+  }
+  if (!shareBranches(guard, ncn, nullptr)) {
+    freeNode(ncn);
+    return nullptr;
+  }
+  return ncn;
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+typename ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::MainNode *
+ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::contracted(CNode *cn,
+                                                                            uint32_t level) {
+  if (level > 0 && cn->size() == 1 && cn->array[0]->kind == NodeKind::SNode) {
+    // Contraction is an optimization. If the tomb can't be allocated keep cn.
+    TNode *tn = newTNode(static_cast<SNode *>(cn->array[0]), cn->gen);
+    if (tn) {
+      // The tomb takes over the reference of cn to the entry.
+      freeNode(cn);
+      return tn;
+    }
+  }
+  return cn;
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+typename ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::MainNode *
+ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::contracted(LNode *ln) {
+  if (ln->size == 1) {
+    TNode *tn = newTNode(ln->array[0], ln->gen);
+    if (tn) {
+      freeNode(ln);
+      return tn;
+    }
+  }
+  return ln;
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+typename ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::CNode *
+ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::inserted(
+    const CNode *cn, uint32_t pos, uint32_t flag, Node *branch, uint32_t gen) {
+  CNode *ncn = newCNode(cn->bitmap | flag, gen);
+  if (ncn) {
+    const uint32_t sz = cn->size();
+    for (uint32_t i = 0; i < pos; i++) {
+      ncn->array[i] = cn->array[i];
+    }
+    ncn->array[pos] = branch;
+    for (uint32_t i = pos; i < sz; i++) {
+      ncn->array[i + 1] = cn->array[i];
+    }
+  }
+  return ncn;
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+typename ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::CNode *
+ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::updated(const CNode *cn,
+                                                                         uint32_t pos,
+                                                                         Node *branch,
+                                                                         uint32_t gen) {
+  CNode *ncn = newCNode(cn->bitmap, gen);
+  if (ncn) {
+    const uint32_t sz = cn->size();
+    for (uint32_t i = 0; i < sz; i++) {
+      ncn->array[i] = cn->array[i];
+    }
+    ncn->array[pos] = branch;
+  }
+  return ncn;
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+typename ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::CNode *
+ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::removed(const CNode *cn,
+                                                                         uint32_t pos,
+                                                                         uint32_t flag,
+                                                                         uint32_t gen) {
+  CNode *ncn = newCNode(cn->bitmap & ~flag, gen);
+  if (ncn) {
+    const uint32_t sz = cn->size();
+    for (uint32_t i = 0; i < pos; i++) {
+      ncn->array[i] = cn->array[i];
+    }
+    for (uint32_t i = pos + 1; i < sz; i++) {
+      ncn->array[i - 1] = cn->array[i];
+    }
+  }
+  return ncn;
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+typename ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::LNode *
+ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::updated(const LNode *ln,
+                                                                         uint32_t pos,
+                                                                         SNode *sn,
+                                                                         uint32_t gen) {
+  LNode *nln = newLNode(pos < ln->size ? ln->size : ln->size + 1, gen);
+  if (nln) {
+    for (uint32_t i = 0; i < ln->size; i++) {
+      nln->array[i] = ln->array[i];
+    }
+    nln->array[pos] = sn;
+  }
+  return nln;
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+typename ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::LNode *
+ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::removed(const LNode *ln,
+                                                                         uint32_t pos,
+                                                                         uint32_t gen) {
+  LNode *nln = newLNode(ln->size - 1, gen);
+  if (nln) {
+    for (uint32_t i = 0; i < pos; i++) {
+      nln->array[i] = ln->array[i];
+    }
+    for (uint32_t i = pos + 1; i < ln->size; i++) {
+      nln->array[i - 1] = ln->array[i];
+    }
+  }
+  return nln;
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+typename ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::SNode *
+ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::newSNode(const Entry &entry,
+                                                                          uint32_t gen) {
+  void *ptr = _allocator.allocate(sizeof(SNode), alignof(SNode));
+  return ptr ? new (ptr) SNode(entry, gen) : nullptr;
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+typename ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::INode *
+ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::newINode(MainNode *main,
+                                                                          uint32_t gen) {
+  void *ptr = _allocator.allocate(sizeof(INode), alignof(INode));
+  return ptr ? new (ptr) INode(main, gen) : nullptr;
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+typename ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::TNode *
+ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::newTNode(SNode *sn,
+                                                                          uint32_t gen) {
+  void *ptr = _allocator.allocate(sizeof(TNode), alignof(TNode));
+  return ptr ? new (ptr) TNode(sn, gen) : nullptr;
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+typename ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::CNode *
+ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::newCNode(uint32_t bitmap,
+                                                                          uint32_t gen) {
+  void *ptr =
+      _allocator.allocate(CNode::allocationSize(__builtin_popcount(bitmap)), alignof(CNode));
+  return ptr ? new (ptr) CNode(bitmap, gen) : nullptr;
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+typename ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::LNode *
+ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::newLNode(uint32_t size,
+                                                                          uint32_t gen) {
+  void *ptr = _allocator.allocate(LNode::allocationSize(size), alignof(LNode));
+  return ptr ? new (ptr) LNode(size, gen) : nullptr;
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+typename ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::FailedNode *
+ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::newFailedNode(
+    MainNode *restore) {
+  void *ptr = _allocator.allocate(sizeof(FailedNode), alignof(FailedNode));
+  return ptr ? new (ptr) FailedNode(restore) : nullptr;
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+typename ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::Descriptor *
+ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::newDescriptor(
+    INode *old_root, MainNode *expected_main, INode *new_root) {
+  void *ptr = _allocator.allocate(sizeof(Descriptor), alignof(Descriptor));
+  return ptr ? new (ptr) Descriptor(old_root, expected_main, new_root) : nullptr;
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+void ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::freeNode(
+    Allocator &allocator, Node *node) {
+  switch (node->kind) {
+    case NodeKind::SNode:
+      static_cast<SNode *>(node)->~SNode();
+      allocator.deallocate(node, sizeof(SNode));
+      break;
+    case NodeKind::INode:
+      static_cast<INode *>(node)->~INode();
+      allocator.deallocate(node, sizeof(INode));
+      break;
+    case NodeKind::TNode:
+      static_cast<TNode *>(node)->~TNode();
+      allocator.deallocate(node, sizeof(TNode));
+      break;
+    case NodeKind::CNode: {
+      size_t size = CNode::allocationSize(static_cast<CNode *>(node)->size());
+      static_cast<CNode *>(node)->~CNode();
+      allocator.deallocate(node, size);
+      break;
+    }
+    case NodeKind::LNode: {
+      size_t size = LNode::allocationSize(static_cast<LNode *>(node)->size);
+      static_cast<LNode *>(node)->~LNode();
+      allocator.deallocate(node, size);
+      break;
+    }
+    case NodeKind::FailedNode:
+      static_cast<FailedNode *>(node)->~FailedNode();
+      allocator.deallocate(node, sizeof(FailedNode));
+      break;
+    case NodeKind::Descriptor:
+      static_cast<Descriptor *>(node)->~Descriptor();
+      allocator.deallocate(node, sizeof(Descriptor));
+      break;
+  }
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+void ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::freeDual(
+    MainNode *main) {
+  // The SNodes belong to the caller.
+  if (main->kind == NodeKind::CNode) {
+    CNode *cn = static_cast<CNode *>(main);
+    for (uint32_t i = 0; i < cn->size(); i++) {
+      if (cn->array[i]->kind == NodeKind::INode) {
+        INode *in = static_cast<INode *>(cn->array[i]);
+        freeDual(in->main.load(std::memory_order_relaxed));
+        freeNode(in);
+      }
+    }
+  }
+  freeNode(main);
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+bool ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::tryAcquire(Node *node) {
+  uint32_t refcount = node->refcount.load(std::memory_order_relaxed);
+  do {
+    if (refcount == 0) {
+      return false;
+    }
+  } while (!node->refcount.compare_exchange_weak(
+      refcount, refcount + 1, std::memory_order_relaxed, std::memory_order_relaxed));
+  return true;
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+bool ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::shareBranches(
+    const Guard &guard, MainNode *copy, const Node *fresh) {
+  LNode *ln = copy->kind == NodeKind::LNode ? static_cast<LNode *>(copy) : nullptr;
+  CNode *cn = ln ? nullptr : static_cast<CNode *>(copy);
+  const uint32_t sz = ln ? ln->size : cn->size();
+  for (uint32_t i = 0; i < sz; i++) {
+    Node *branch = ln ? ln->array[i] : cn->array[i];
+    if (branch != fresh && !tryAcquire(branch)) {
+      for (uint32_t j = 0; j < i; j++) {
+        branch = ln ? ln->array[j] : cn->array[j];
+        if (branch != fresh) {
+          release(guard, branch);
+        }
+      }
+      return false;
+    }
+  }
+  return true;
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+void ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::release(const Guard &guard,
+                                                                              Node *node) {
+  uint32_t refcount = node->refcount.fetch_sub(1, std::memory_order_acq_rel);
+  assert(refcount > 0 && "Released a node more times than it was acquired");
+  if (refcount == 1) {
+    releaseChildren(guard, node);
+    retireNow(guard, node);
+  }
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+void ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::releaseChildren(
+    const Guard &guard, Node *node) {
+  switch (node->kind) {
+    case NodeKind::INode:
+      // The main node of an INode that is no longer reachable can only be
+      // replaced by a GCAS that will be aborted (see gcasCommit()).
+      release(guard, const_cast<MainNode *>(static_cast<INode *>(node)->committed()));
+      break;
+    case NodeKind::CNode: {
+      CNode *cn = static_cast<CNode *>(node);
+      for (uint32_t i = 0; i < cn->size(); i++) {
+        release(guard, cn->array[i]);
+      }
+      break;
+    }
+    case NodeKind::LNode: {
+      LNode *ln = static_cast<LNode *>(node);
+      for (uint32_t i = 0; i < ln->size; i++) {
+        release(guard, ln->array[i]);
+      }
+      break;
+    }
+    case NodeKind::TNode:
+      release(guard, static_cast<TNode *>(node)->sn);
+      break;
+    case NodeKind::SNode:
+    case NodeKind::FailedNode:
+    case NodeKind::Descriptor:
+      break;
+  }
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+void ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::dispose(const Guard &guard,
+                                                                              CASResult result,
+                                                                              Node *node) {
+  releaseChildren(guard, node);
+  if (result == CASResult::Failed) {
+    freeNode(node);
+  } else if (result == CASResult::Aborted) {
+    retireNow(guard, node);
+  }
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+void ConcurrentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::releaseDomain() {
+  if (_domain->refcount.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+    return;
+  }
+  // Reclaims the nodes retired through the epochs.
+  _domain->~Domain();
+  _allocator.deallocate(_domain, sizeof(Domain));
+  _domain = nullptr;
+}
+
+// }}} End of ConcurrentHashArrayMappedTrie
+
+}  // namespace foc
@@ -0,0 +1,498 @@
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#define GTEST
+#define HAMT_IMPLEMENTATION
+#include "concurrent_hash_array_mapped_trie.h"
+
+using foc::ConcurrentHashArrayMappedTrie;
+
+using Ctrie = ConcurrentHashArrayMappedTrie<int64_t, int64_t>;
+
+struct IdentityFunction {
+  size_t operator()(int64_t key) const { return key; }
+};
+
+struct ConstantFunction {
+  size_t operator()(int64_t) const { return 1; }
+};
+
+// Counts the allocated bytes that weren't deallocated yet.
+struct CountingAllocator {
+  static std::atomic<int64_t> allocated;
+
+  void *allocate(size_t size, size_t) {
+    allocated.fetch_add(size);
+    return malloc(size);
+  }
+
+  void deallocate(void *ptr, size_t size) {
+    allocated.fetch_sub(size);
+    free(ptr);
+  }
+};
+
+std::atomic<int64_t> CountingAllocator::allocated(0);
+
+template <class Ctrie>
+static void single_thread_test(int64_t n) {
+  Ctrie ctrie;
+  for (int64_t i = 0; i < n; i++) {
+    EXPECT_TRUE(ctrie.insert(std::make_pair(i, i)));
+  }
+  EXPECT_EQ(ctrie.size(), n);
+
+  int64_t value;
+  for (int64_t key = 0; key < n; key++) {
+    EXPECT_TRUE(ctrie.find(key, &value));
+    EXPECT_EQ(value, key);
+    EXPECT_TRUE(ctrie.insert(std::make_pair(key, -key)));
+    EXPECT_TRUE(ctrie.find(key, &value));
+    EXPECT_EQ(value, -key);
+  }
+  EXPECT_EQ(ctrie.size(), n);
+
+  for (int64_t key = 0; key < n; key++) {
+    EXPECT_EQ(ctrie.erase(key), 1);
+    EXPECT_FALSE(ctrie.find(key, &value));
+    EXPECT_EQ(ctrie.erase(key), 0);
+  }
+  EXPECT_TRUE(ctrie.empty());
+
+  // The trie is compacted back to an empty root.
+  auto *root_in = static_cast<typename Ctrie::INode *>(ctrie._root.load());
+  auto *root = static_cast<typename Ctrie::CNode *>(root_in->main.load());
+  EXPECT_EQ(root->bitmap, 0);
+}
+
+TEST(ConcurrentHashArrayMappedTrieTest, SingleThreadTest) {
+  single_thread_test<Ctrie>(10000);
+}
+
+TEST(ConcurrentHashArrayMappedTrieTest, SingleThreadTestWithIdentityFunction) {
+  single_thread_test<ConcurrentHashArrayMappedTrie<int64_t, int64_t, IdentityFunction>>(10000);
+}
+
+TEST(ConcurrentHashArrayMappedTrieTest, SingleThreadTestWithConstantFunction) {
+  // The keys are kept in a collision node.
+  single_thread_test<ConcurrentHashArrayMappedTrie<int64_t, int64_t, ConstantFunction>>(100);
+}
+
+TEST(ConcurrentHashArrayMappedTrieTest, CollisionNodeTest) {
+  using ConstantCtrie = ConcurrentHashArrayMappedTrie<int64_t, int64_t, ConstantFunction>;
+  ConstantCtrie ctrie;
+  const int64_t n = 100;
+  for (int64_t i = 0; i < n; i++) {
+    EXPECT_TRUE(ctrie.insert(std::make_pair(i, i)));
+  }
+
+  // Every key is in the list node at the collision level.
+  auto *in = static_cast<ConstantCtrie::INode *>(ctrie._root.load());
+  for (uint32_t level = 0; level < foc::detail::hamt_collision_level; level++) {
+    auto *cn = static_cast<ConstantCtrie::CNode *>(in->main.load());
+    ASSERT_EQ(cn->kind, ConstantCtrie::NodeKind::CNode);
+    ASSERT_EQ(cn->size(), 1);
+    ASSERT_EQ(cn->array[0]->kind, ConstantCtrie::NodeKind::INode);
+    in = static_cast<ConstantCtrie::INode *>(cn->array[0]);
+  }
+  auto *ln = static_cast<ConstantCtrie::LNode *>(in->main.load());
+  ASSERT_EQ(ln->kind, ConstantCtrie::NodeKind::LNode);
+  EXPECT_EQ(ln->size, n);
+  EXPECT_EQ(std::distance(ctrie.begin(), ctrie.end()), n);
+
+  // Erasing every key but one folds the last entry back into the root.
+  for (int64_t i = 1; i < n; i++) {
+    EXPECT_EQ(ctrie.erase(i), 1);
+  }
+  int64_t value;
+  EXPECT_TRUE(ctrie.find(0, &value));
+  EXPECT_EQ(value, 0);
+  auto *root_in = static_cast<ConstantCtrie::INode *>(ctrie._root.load());
+  auto *root = static_cast<ConstantCtrie::CNode *>(root_in->main.load());
+  ASSERT_EQ(root->size(), 1);
+  EXPECT_EQ(root->array[0]->kind, ConstantCtrie::NodeKind::SNode);
+}
+
+// Fails every allocation.
+struct NullAllocator {
+  void *allocate(size_t, size_t) { return nullptr; }
+  void deallocate(void *, size_t) {}
+};
+
+TEST(ConcurrentHashArrayMappedTrieTest, RootAllocationFailureTest) {
+  ConcurrentHashArrayMappedTrie<int64_t,
+                                int64_t,
+                                std::hash<int64_t>,
+                                std::equal_to<int64_t>,
+                                NullAllocator>
+      ctrie;
+  EXPECT_FALSE(ctrie.insert(std::make_pair(1, 1)));
+  int64_t value;
+  EXPECT_FALSE(ctrie.find(1, &value));
+  EXPECT_EQ(ctrie.erase(1), 0);
+  EXPECT_TRUE(ctrie.empty());
+  EXPECT_TRUE(ctrie.begin() == ctrie.end());
+
+  bool succeeded = true;
+  auto snapshot = ctrie.snapshot(&succeeded);
+  EXPECT_FALSE(succeeded);
+  EXPECT_FALSE(snapshot.insert(std::make_pair(1, 1)));
+}
+
+// Fails the allocations once the budget runs out.
+struct BudgetAllocator {
+  static std::atomic<int64_t> budget;
+
+  void *allocate(size_t size, size_t) {
+    if (budget.fetch_sub(1) <= 0) {
+      return nullptr;
+    }
+    return malloc(size);
+  }
+  void deallocate(void *ptr, size_t) { free(ptr); }
+};
+
+std::atomic<int64_t> BudgetAllocator::budget(0);
+
+TEST(ConcurrentHashArrayMappedTrieTest, SnapshotAllocationFailureTest) {
+  using BudgetCtrie = ConcurrentHashArrayMappedTrie<int64_t,
+                                                    int64_t,
+                                                    std::hash<int64_t>,
+                                                    std::equal_to<int64_t>,
+                                                    BudgetAllocator>;
+  BudgetAllocator::budget = 1000;
+  BudgetCtrie ctrie;
+  for (int64_t i = 0; i < 10; i++) {
+    EXPECT_TRUE(ctrie.insert(std::make_pair(i, i)));
+  }
+
+  // The trie is left as it was and the snapshots can't be updated.
+  BudgetAllocator::budget = 0;
+  bool succeeded = true;
+  BudgetCtrie snapshot = ctrie.snapshot(&succeeded);
+  EXPECT_FALSE(succeeded);
+  EXPECT_TRUE(snapshot.empty());
+  EXPECT_TRUE(snapshot.begin() == snapshot.end());
+  succeeded = true;
+  BudgetCtrie read_only = ctrie.readOnlySnapshot(&succeeded);
+  EXPECT_FALSE(succeeded);
+  EXPECT_TRUE(read_only.empty());
+
+  BudgetAllocator::budget = 1000;
+  EXPECT_FALSE(snapshot.insert(std::make_pair(10, 10)));
+  int64_t value;
+  for (int64_t i = 0; i < 10; i++) {
+    EXPECT_TRUE(ctrie.find(i, &value));
+    EXPECT_FALSE(snapshot.find(i, &value));
+  }
+  EXPECT_TRUE(ctrie.insert(std::make_pair(10, 10)));
+  BudgetCtrie copy = ctrie.snapshot(&succeeded);
+  EXPECT_TRUE(succeeded);
+  EXPECT_EQ(copy.size(), 11);
+}
+
+TEST(ConcurrentHashArrayMappedTrieTest, StringKeysTest) {
+  ConcurrentHashArrayMappedTrie<std::string, std::string> ctrie;
+  for (int i = 0; i < 1000; i++) {
+    EXPECT_TRUE(ctrie.insert(std::make_pair(std::to_string(i), std::to_string(i))));
+  }
+  for (int i = 0; i < 1000; i += 2) {
+    EXPECT_EQ(ctrie.erase(std::to_string(i)), 1);
+  }
+  std::string value;
+  for (int i = 0; i < 1000; i++) {
+    EXPECT_EQ(ctrie.find(std::to_string(i), &value), i % 2 == 1);
+  }
+}
+
+TEST(ConcurrentHashArrayMappedTrieTest, ConcurrentInsertAndEraseTest) {
+  const int num_threads = 8;
+  const int64_t keys_per_thread = 5000;
+  Ctrie ctrie;
+
+  // Every thread inserts its own keys, erases half of them and updates the rest
+  // while the others do the same.
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; t++) {
+    threads.emplace_back([&ctrie, t, keys_per_thread]() {
+      const int64_t first = t * keys_per_thread;
+      for (int64_t i = first; i < first + keys_per_thread; i++) {
+        EXPECT_TRUE(ctrie.insert(std::make_pair(i, i)));
+      }
+      int64_t value;
+      for (int64_t i = first; i < first + keys_per_thread; i++) {
+        EXPECT_TRUE(ctrie.find(i, &value));
+        if (i % 2 == 0) {
+          EXPECT_EQ(ctrie.erase(i), 1);
+        } else {
+          EXPECT_TRUE(ctrie.insert(std::make_pair(i, -i)));
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  EXPECT_EQ(ctrie.size(), num_threads * keys_per_thread / 2);
+  int64_t value;
+  for (int64_t i = 0; i < num_threads * keys_per_thread; i++) {
+    if (i % 2 == 0) {
+      EXPECT_FALSE(ctrie.find(i, &value));
+    } else {
+      EXPECT_TRUE(ctrie.find(i, &value));
+      EXPECT_EQ(value, -i);
+    }
+  }
+}
+
+TEST(ConcurrentHashArrayMappedTrieTest, ConcurrentCollisionsTest) {
+  const int num_threads = 4;
+  const int64_t keys_per_thread = 200;
+  ConcurrentHashArrayMappedTrie<int64_t, int64_t, ConstantFunction> ctrie;
+
+  // Every update copies the same collision node.
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; t++) {
+    threads.emplace_back([&ctrie, t, keys_per_thread]() {
+      const int64_t first = t * keys_per_thread;
+      for (int64_t i = first; i < first + keys_per_thread; i++) {
+        EXPECT_TRUE(ctrie.insert(std::make_pair(i, i)));
+      }
+      for (int64_t i = first; i < first + keys_per_thread; i += 2) {
+        EXPECT_EQ(ctrie.erase(i), 1);
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  EXPECT_EQ(ctrie.size(), num_threads * keys_per_thread / 2);
+  int64_t value;
+  for (int64_t i = 0; i < num_threads * keys_per_thread; i++) {
+    EXPECT_EQ(ctrie.find(i, &value), i % 2 == 1);
+  }
+}
+
+TEST(ConcurrentHashArrayMappedTrieTest, ReclamationTest) {
+  using CountingCtrie = ConcurrentHashArrayMappedTrie<int64_t,
+                                                      int64_t,
+                                                      std::hash<int64_t>,
+                                                      std::equal_to<int64_t>,
+                                                      CountingAllocator>;
+  {
+    CountingCtrie ctrie;
+    for (int64_t i = 0; i < 1000; i++) {
+      ctrie.insert(std::make_pair(i, i));
+    }
+    const int64_t allocated = CountingAllocator::allocated.load();
+
+    // The replaced nodes are reclaimed while the trie is in use.
+    for (int64_t round = 0; round < 50; round++) {
+      for (int64_t i = 0; i < 1000; i++) {
+        ctrie.insert(std::make_pair(i, round));
+      }
+    }
+    EXPECT_LT(CountingAllocator::allocated.load(), 2 * allocated);
+
+    // Nodes shared with a snapshot are kept while the snapshot is alive and
+    // reclaimed once it's destroyed and the trie replaced them.
+    for (int64_t round = 0; round < 20; round++) {
+      {
+        CountingCtrie snapshot = round % 2 ? ctrie.snapshot() : ctrie.readOnlySnapshot();
+        for (int64_t i = 0; i < 1000; i++) {
+          ctrie.insert(std::make_pair(i, -round));
+        }
+        int64_t value;
+        EXPECT_TRUE(snapshot.find(0, &value));
+        EXPECT_EQ(value, round == 0 ? 49 : 1 - round);
+      }
+      for (int64_t i = 0; i < 1000; i++) {
+        ctrie.insert(std::make_pair(i, -round));
+      }
+    }
+    EXPECT_LT(CountingAllocator::allocated.load(), 2 * allocated);
+
+    {
+      CountingCtrie snapshot = ctrie.snapshot();
+      for (int64_t i = 0; i < 1000; i++) {
+        ctrie.erase(i);
+      }
+      int64_t value;
+      EXPECT_TRUE(snapshot.find(0, &value));
+      EXPECT_FALSE(ctrie.find(0, &value));
+    }
+    for (int64_t i = 0; i < 1000; i++) {
+      ctrie.insert(std::make_pair(i, i));
+      ctrie.erase(i);
+    }
+    EXPECT_LT(CountingAllocator::allocated.load(), allocated / 2);
+  }
+  EXPECT_EQ(CountingAllocator::allocated.load(), 0);
+}
+
+TEST(ConcurrentHashArrayMappedTrieTest, ConcurrentReadersTest) {
+  Ctrie ctrie;
+  for (int64_t i = 0; i < 1000; i++) {
+    ctrie.insert(std::make_pair(i, i));
+  }
+
+  // Readers always find the keys that are never erased while a writer keeps
+  // inserting and erasing other keys.
+  std::atomic<bool> done(false);
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 4; t++) {
+    readers.emplace_back([&ctrie, &done]() {
+      int64_t value;
+      while (!done.load()) {
+        for (int64_t i = 0; i < 1000; i++) {
+          EXPECT_TRUE(ctrie.find(i, &value));
+          EXPECT_EQ(value, i);
+        }
+      }
+    });
+  }
+  for (int round = 0; round < 20; round++) {
+    for (int64_t i = 1000; i < 3000; i++) {
+      ctrie.insert(std::make_pair(i, i));
+    }
+    for (int64_t i = 1000; i < 3000; i++) {
+      ctrie.erase(i);
+    }
+  }
+  done.store(true);
+  for (auto &reader : readers) {
+    reader.join();
+  }
+  EXPECT_EQ(ctrie.size(), 1000);
+}
+
+template <class Ctrie>
+static void check_snapshot(const Ctrie &ctrie, const std::map<int64_t, int64_t> &expected) {
+  size_t visited = 0;
+  for (const auto &entry : ctrie) {
+    auto it = expected.find(entry.first);
+    ASSERT_TRUE(it != expected.end());
+    EXPECT_EQ(entry.second, it->second);
+    visited++;
+  }
+  EXPECT_EQ(visited, expected.size());
+  int64_t value;
+  for (const auto &pair : expected) {
+    EXPECT_TRUE(ctrie.find(pair.first, &value));
+    EXPECT_EQ(value, pair.second);
+  }
+}
+
+template <class Ctrie>
+static void snapshot_test(int64_t n) {
+  Ctrie ctrie;
+  std::map<int64_t, int64_t> expected;
+  for (int64_t i = 0; i < n; i++) {
+    EXPECT_TRUE(ctrie.insert(std::make_pair(i, i)));
+    expected[i] = i;
+  }
+
+  Ctrie snapshot = ctrie.snapshot();
+  Ctrie read_only = ctrie.readOnlySnapshot();
+  EXPECT_FALSE(snapshot.readOnly());
+  EXPECT_TRUE(read_only.readOnly());
+  EXPECT_EQ(snapshot.size(), expected.size());
+
+  // Updates on the trie and on the snapshot don't see each other.
+  std::map<int64_t, int64_t> updated = expected;
+  for (int64_t i = 0; i < n; i += 2) {
+    EXPECT_EQ(ctrie.erase(i), 1);
+    updated.erase(i);
+  }
+  for (int64_t i = 1; i < n; i += 2) {
+    EXPECT_TRUE(ctrie.insert(std::make_pair(i, -i)));
+    updated[i] = -i;
+  }
+  std::map<int64_t, int64_t> snapshot_updated = expected;
+  for (int64_t i = 0; i < n; i += 3) {
+    EXPECT_EQ(snapshot.erase(i), 1);
+    snapshot_updated.erase(i);
+  }
+
+  check_snapshot(ctrie, updated);
+  check_snapshot(snapshot, snapshot_updated);
+  check_snapshot(read_only, expected);
+
+  // Snapshots of snapshots
+  Ctrie copy = read_only.snapshot();
+  EXPECT_EQ(copy.erase(0), 1);
+  check_snapshot(read_only, expected);
+  expected.erase(0);
+  check_snapshot(copy, expected);
+}
+
+TEST(ConcurrentHashArrayMappedTrieTest, SnapshotTest) {
+  snapshot_test<Ctrie>(10000);
+}
+
+TEST(ConcurrentHashArrayMappedTrieTest, SnapshotTestWithIdentityFunction) {
+  snapshot_test<ConcurrentHashArrayMappedTrie<int64_t, int64_t, IdentityFunction>>(10000);
+}
+
+TEST(ConcurrentHashArrayMappedTrieTest, SnapshotTestWithConstantFunction) {
+  snapshot_test<ConcurrentHashArrayMappedTrie<int64_t, int64_t, ConstantFunction>>(100);
+}
+
+TEST(ConcurrentHashArrayMappedTrieTest, ConcurrentSnapshotsTest) {
+  const int num_threads = 4;
+  const int64_t keys_per_thread = 2000;
+  Ctrie ctrie;
+
+  // Every thread inserts its own keys in increasing order, so a consistent
+  // snapshot contains a prefix of the keys of every thread.
+  std::atomic<bool> done(false);
+  std::vector<std::thread> writers;
+  for (int t = 0; t < num_threads; t++) {
+    writers.emplace_back([&ctrie, t, keys_per_thread]() {
+      const int64_t first = t * keys_per_thread;
+      for (int64_t i = first; i < first + keys_per_thread; i++) {
+        EXPECT_TRUE(ctrie.insert(std::make_pair(i, i)));
+      }
+    });
+  }
+  std::thread snapshotter([&ctrie, &done, keys_per_thread]() {
+    for (int round = 0; !done.load(); round++) {
+      Ctrie snapshot = round % 2 ? ctrie.snapshot() : ctrie.readOnlySnapshot();
+      std::vector<int64_t> counts(num_threads, 0);
+      for (const auto &entry : snapshot) {
+        counts[entry.first / keys_per_thread]++;
+      }
+      int64_t value;
+      for (int t = 0; t < num_threads; t++) {
+        const int64_t first = t * keys_per_thread;
+        for (int64_t i = first; i < first + keys_per_thread; i++) {
+          EXPECT_EQ(snapshot.find(i, &value), i < first + counts[t]);
+        }
+      }
+      if (!snapshot.readOnly()) {
+        // Writes to the snapshot copy the tries the writers are updating.
+        for (int t = 0; t < num_threads; t++) {
+          EXPECT_EQ(snapshot.erase(t * keys_per_thread), counts[t] > 0 ? 1 : 0);
+        }
+      }
+    }
+  });
+  for (auto &writer : writers) {
+    writer.join();
+  }
+  done.store(true);
+  snapshotter.join();
+
+  Ctrie snapshot = ctrie.snapshot();
+  std::map<int64_t, int64_t> expected;
+  for (int64_t i = 0; i < num_threads * keys_per_thread; i++) {
+    expected[i] = i;
+  }
+  check_snapshot(snapshot, expected);
+}
@@ -0,0 +1,261 @@
+// Epoch-Based Reclamation
+//
+// Lock-free data structures can't free the nodes they unlink right away: other
+// threads may still be reading them. With epoch-based reclamation [1] threads
+// pin the current epoch while they access the data structure and retire the
+// nodes they unlink instead of freeing them. The global epoch only advances
+// once every pinned thread has seen it, so the nodes retired two epochs ago
+// can't be reached by anyone anymore and are freed in batches.
+//
+// Readers pay for pinning and unpinning once per operation and nothing per node
+// they access.
+//
+// A thread that stays pinned (or is descheduled while pinned) keeps the epoch
+// from advancing and delays the reclamation of everything retired meanwhile.
+//
+// [1] "Practical lock-freedom". Keir Fraser. 2004.
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <new>
+
+#include "allocator.h"
+#include "support.h"
+
+#ifndef PUBLIC_IN_GTEST
+#ifdef GTEST
+#define PUBLIC_IN_GTEST public
+#else
+#define PUBLIC_IN_GTEST private
+#endif
+#endif
+
+namespace foc {
+
+// Defers the destruction of objects of type T until no thread can be accessing
+// them. T must have a `T *retired_next` member that the reclaimer owns while
+// the object is retired. Deleter is called on every retired object once it's
+// safe to destroy it.
+template <class T, class Deleter, class Allocator = MallocAllocator>
+class EpochReclaimer {
+  // clang-format off
+ PUBLIC_IN_GTEST:
+  // clang-format on
+  // Participant of the epoch protocol. A thread owns a record while it's pinned
+  // and records are reused by other threads after that.
+  struct Record {
+    // (epoch << 1) | 1 while pinned and 0 otherwise.
+    std::atomic<uint64_t> state;
+    std::atomic<bool> in_use;
+    Record *next;
+    // Objects retired through this record in the last three epochs.
+    T *limbo[3];
+    uint64_t limbo_epoch[3];
+    uint32_t retired_since_advance;
+
+    Record() : state(0), in_use(true), next(nullptr), retired_since_advance(0) {
+      for (int i = 0; i < 3; i++) {
+        limbo[i] = nullptr;
+        limbo_epoch[i] = 0;
+      }
+    }
+  };
+
+  // Number of objects retired through a record between attempts to advance the
+  // global epoch.
+  static const uint32_t advance_threshold = 64;
+
+  std::atomic<uint64_t> _epoch;
+  std::atomic<Record *> _records;
+  Deleter _deleter;
+  Allocator _allocator;
+
+ public:
+  // Keeps the thread that created it pinned to an epoch. Move-only.
+  class Guard {
+   public:
+    // An empty guard that doesn't pin any thread.
+    Guard() noexcept : _reclaimer(nullptr), _record(nullptr) {}
+
+    Guard(Guard &&other) noexcept : _reclaimer(other._reclaimer), _record(other._record) {
+      other._record = nullptr;
+    }
+
+    Guard(const Guard &) = delete;
+    Guard &operator=(const Guard &) = delete;
+
+    ~Guard() {
+      if (_record) {
+        _reclaimer->unpin(_record);
+      }
+    }
+
+   private:
+    Guard(EpochReclaimer *reclaimer, Record *record) : _reclaimer(reclaimer), _record(record) {}
+
+    EpochReclaimer *_reclaimer;
+    Record *_record;
+
+    friend class EpochReclaimer;
+  };
+
+  explicit EpochReclaimer(const Deleter &deleter = Deleter(),
+                          const Allocator &a = Allocator())
+      : _epoch(0), _records(nullptr), _deleter(deleter), _allocator(a) {}
+
+  EpochReclaimer(const EpochReclaimer &) = delete;
+  EpochReclaimer &operator=(const EpochReclaimer &) = delete;
+
+  // Destroys all the retired objects. No thread may be pinned.
+  ~EpochReclaimer();
+
+  // Pins the calling thread to the current epoch until the guard is destroyed.
+  // The objects the thread reads from the data structure while pinned are
+  // valid until then.
+  Guard pin();
+
+  // Destroys object once no thread pinned at this point can be accessing it.
+  // object must be unreachable for threads that pin after this call.
+  void retire(const Guard &guard, T *object);
+
+ PUBLIC_IN_GTEST:
+  uint64_t epoch() const { return _epoch.load(std::memory_order_relaxed); }
+
+ private:
+  Record *acquireRecord();
+  void unpin(Record *record);
+
+  // Advances the global epoch if every pinned thread has seen epoch.
+  bool tryAdvance(uint64_t epoch);
+  // Destroys the objects retired through record that are safe to destroy in
+  // epoch.
+  void collect(Record *record, uint64_t epoch);
+  void destroyList(T *list);
+};
+
+// EpochReclaimer {{{
+
+template <class T, class Deleter, class Allocator>
+EpochReclaimer<T, Deleter, Allocator>::~EpochReclaimer() {
+  Record *record = _records.load(std::memory_order_acquire);
+  while (record) {
+    assert(!record->in_use.load(std::memory_order_relaxed) && "Destroyed while pinned");
+    Record *next = record->next;
+    for (int i = 0; i < 3; i++) {
+      destroyList(record->limbo[i]);
+    }
+    record->~Record();
+    _allocator.deallocate(record, sizeof(Record));
+    record = next;
+  }
+}
+
+template <class T, class Deleter, class Allocator>
+typename EpochReclaimer<T, Deleter, Allocator>::Guard
+EpochReclaimer<T, Deleter, Allocator>::pin() {
+  Record *record = acquireRecord();
+  uint64_t epoch = _epoch.load(std::memory_order_relaxed);
+  for (;;) {
+    // The epoch may have advanced before the record was seen as pinned.
+    record->state.store((epoch << 1) | 1, std::memory_order_seq_cst);
+    uint64_t current = _epoch.load(std::memory_order_seq_cst);
+    if (current == epoch) {
+      break;
+    }
+    epoch = current;
+  }
+  collect(record, epoch);
+  return Guard(this, record);
+}
+
+template <class T, class Deleter, class Allocator>
+void EpochReclaimer<T, Deleter, Allocator>::retire(const Guard &guard, T *object) {
+  Record *record = guard._record;
+  assert(record && "Objects can only be retired while pinned");
+  // The epoch is read after object was unlinked, so the threads that can still
+  // reach it are pinned to this epoch or the previous one. The epoch the thread
+  // is pinned to may be behind and is not enough.
+  const uint64_t epoch = _epoch.load(std::memory_order_seq_cst);
+  const uint32_t i = epoch % 3;
+  if (record->limbo_epoch[i] != epoch) {
+    // Retired three or more epochs ago.
+    destroyList(record->limbo[i]);
+    record->limbo[i] = nullptr;
+    record->limbo_epoch[i] = epoch;
+  }
+  object->retired_next = record->limbo[i];
+  record->limbo[i] = object;
+
+  if (++record->retired_since_advance == advance_threshold) {
+    record->retired_since_advance = 0;
+    tryAdvance(epoch);
+  }
+}
+
+template <class T, class Deleter, class Allocator>
+typename EpochReclaimer<T, Deleter, Allocator>::Record *
+EpochReclaimer<T, Deleter, Allocator>::acquireRecord() {
+  for (Record *record = _records.load(std::memory_order_acquire); record;
+       record = record->next) {
+    bool expected = false;
+    if (!record->in_use.load(std::memory_order_relaxed) &&
+        record->in_use.compare_exchange_strong(
+            expected, true, std::memory_order_acquire, std::memory_order_relaxed)) {
+      return record;
+    }
+  }
+
+  // More threads pinned than ever before.
+  void *ptr = _allocator.allocate(sizeof(Record), alignof(Record));
+  assert(ptr && "Can't allocate an epoch record");
+  Record *record = new (ptr) Record();
+  Record *head = _records.load(std::memory_order_relaxed);
+  do {
+    record->next = head;
+  } while (!_records.compare_exchange_weak(
+      head, record, std::memory_order_release, std::memory_order_relaxed));
+  return record;
+}
+
+template <class T, class Deleter, class Allocator>
+void EpochReclaimer<T, Deleter, Allocator>::unpin(Record *record) {
+  record->state.store(0, std::memory_order_release);
+  record->in_use.store(false, std::memory_order_release);
+}
+
+template <class T, class Deleter, class Allocator>
+bool EpochReclaimer<T, Deleter, Allocator>::tryAdvance(uint64_t epoch) {
+  for (Record *record = _records.load(std::memory_order_acquire); record;
+       record = record->next) {
+    uint64_t state = record->state.load(std::memory_order_seq_cst);
+    if ((state & 1) && (state >> 1) != epoch) {
+      return false;
+    }
+  }
+  return _epoch.compare_exchange_strong(epoch, epoch + 1, std::memory_order_seq_cst);
+}
+
+template <class T, class Deleter, class Allocator>
+void EpochReclaimer<T, Deleter, Allocator>::collect(Record *record, uint64_t epoch) {
+  for (int i = 0; i < 3; i++) {
+    if (record->limbo[i] && record->limbo_epoch[i] + 2 <= epoch) {
+      destroyList(record->limbo[i]);
+      record->limbo[i] = nullptr;
+    }
+  }
+}
+
+template <class T, class Deleter, class Allocator>
+void EpochReclaimer<T, Deleter, Allocator>::destroyList(T *list) {
+  while (list) {
+    T *next = list->retired_next;
+    _deleter(list);
+    list = next;
+  }
+}
+
+// }}} End of EpochReclaimer
+
+}  // namespace foc
@@ -0,0 +1,107 @@
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#define GTEST
+#include "epoch_reclaimer.h"
+
+using foc::EpochReclaimer;
+
+namespace {
+
+struct Object {
+  int64_t value;
+  Object *retired_next;
+
+  explicit Object(int64_t v) : value(v), retired_next(nullptr) {}
+};
+
+std::atomic<int64_t> destroyed(0);
+
+struct ObjectDeleter {
+  void operator()(Object *object) {
+    destroyed.fetch_add(1);
+    delete object;
+  }
+};
+
+using Reclaimer = EpochReclaimer<Object, ObjectDeleter>;
+
+}  // namespace
+
+TEST(EpochReclaimerTest, RetireTest) {
+  destroyed.store(0);
+  {
+    Reclaimer reclaimer;
+    Reclaimer::Guard reader = reclaimer.pin();
+    {
+      Reclaimer::Guard guard = reclaimer.pin();
+      for (int64_t i = 0; i < 1000; i++) {
+        reclaimer.retire(guard, new Object(i));
+      }
+    }
+    // The reader pinned before the objects were retired keeps the epoch from
+    // advancing twice.
+    for (int i = 0; i < 10; i++) {
+      Reclaimer::Guard guard = reclaimer.pin();
+      for (int64_t j = 0; j < 1000; j++) {
+        reclaimer.retire(guard, new Object(j));
+      }
+    }
+    EXPECT_LE(reclaimer.epoch(), 1);
+    EXPECT_EQ(destroyed.load(), 0);
+
+    // Once the reader unpins the objects are destroyed in batches.
+    { Reclaimer::Guard moved(std::move(reader)); }
+    for (int i = 0; i < 10; i++) {
+      Reclaimer::Guard guard = reclaimer.pin();
+      for (int64_t j = 0; j < 1000; j++) {
+        reclaimer.retire(guard, new Object(j));
+      }
+    }
+    EXPECT_GE(reclaimer.epoch(), 3);
+    EXPECT_GT(destroyed.load(), 0);
+    EXPECT_LT(destroyed.load(), 21000);
+  }
+  // The rest are destroyed with the reclaimer.
+  EXPECT_EQ(destroyed.load(), 21000);
+}
+
+TEST(EpochReclaimerTest, ConcurrentTest) {
+  destroyed.store(0);
+  const int num_threads = 8;
+  const int64_t swaps_per_thread = 20000;
+  std::atomic<int64_t> retired(0);
+  {
+    Reclaimer reclaimer;
+    std::atomic<Object *> shared(new Object(0));
+
+    // Every thread replaces the shared object and retires the old one while the
+    // others keep reading it.
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; t++) {
+      threads.emplace_back([&reclaimer, &shared, &retired, swaps_per_thread]() {
+        for (int64_t i = 0; i < swaps_per_thread; i++) {
+          Reclaimer::Guard guard = reclaimer.pin();
+          Object *old = shared.load(std::memory_order_acquire);
+          EXPECT_GE(old->value, 0);
+          Object *object = new Object(i);
+          if (shared.compare_exchange_strong(old, object, std::memory_order_acq_rel)) {
+            reclaimer.retire(guard, old);
+            retired.fetch_add(1);
+          } else {
+            delete object;
+          }
+        }
+      });
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+    EXPECT_GT(destroyed.load(), 0);
+    delete shared.load();
+  }
+  EXPECT_EQ(destroyed.load(), retired.load());
+}
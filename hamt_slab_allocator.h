@@ -0,0 +1,291 @@
+// Slab Allocator for HAMTs
+//
+// The base arrays of a HAMT only come in the capacities returned by
+// detail::hamt_trie_allocation_size(): 1, 2, 3, 5, 8, 13, 21, 29 and 32 nodes.
+// HamtSlabAllocator carves the arrays of each of these size classes out of big
+// slabs and keeps the freed ones in per-class free lists, so inserts and erases
+// rarely reach the underlying allocator and the arrays of the same class are
+// packed together without per-allocation headers.
+//
+// Usage:
+//
+//   using Entry = std::pair<Key, T>;
+//   HashArrayMappedTrie<Key, T, Hash, KeyEqual, HamtSlabAllocator<Entry>> hamt;
+//
+// Entry must be the type of the entries stored in the nodes of the trie, or the
+// sizes of the classes wouldn't match the base arrays. The tries check it at
+// compile time (see detail::hamt_allocator_supports). A HashArrayMappedTrie
+// whose Hash caches hashes (see hamt_cache_hash) stores the hash next to every
+// entry:
+//
+//   template <>
+//   struct hamt_cache_hash<StringHash> : std::true_type {};
+//
+//   using Entry = detail::HashedEntry<std::string, T>;
+//   HashArrayMappedTrie<std::string, T, StringHash, KeyEqual, HamtSlabAllocator<Entry>> hamt;
+//
+// The allocator is a handle to a pool of slabs: copies of an allocator share
+// the same pool (the copies of a persistent HAMT share nodes, so they must free
+// them to the pool they came from) and the pool is freed with the last handle.
+// Pools aren't thread-safe. All the tries using the same pool must be used by
+// one thread at a time.
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+#include "allocator.h"
+#include "hash_array_mapped_trie.h"
+#include "support.h"
+
+#ifndef PUBLIC_IN_GTEST
+#ifdef GTEST
+#define PUBLIC_IN_GTEST public
+#else
+#define PUBLIC_IN_GTEST private
+#endif
+#endif
+
+namespace foc {
+
+template <class Entry, class Allocator = MallocAllocator>
+class HamtSlabAllocator {
+ public:
+  typedef Entry hamt_entry_type;
+
+  static const uint32_t size_class_count = 9;
+
+  // Occupancy of a size class.
+  struct SizeClassStats {
+    // Capacity (in nodes) of the base arrays of the class.
+    uint32_t capacity;
+    size_t block_size;
+    // Number of blocks handed out to tries.
+    size_t used_blocks;
+    // Number of blocks in the slabs of the class that aren't in use.
+    size_t free_blocks;
+    size_t slab_count;
+  };
+
+  // clang-format off
+ PUBLIC_IN_GTEST:
+  // clang-format on
+  using BitmapTrie = detail::BitmapTrieTemplate<Entry, HamtSlabAllocator>;
+
+  // Size of the slabs of a class unless a block is larger than that.
+  static const size_t slab_size = 16 * 1024;
+  static const size_t min_blocks_per_slab = 8;
+
+  struct Slab {
+    Slab *next;
+    size_t size;
+  };
+
+  // Blocks in a slab start after its header.
+  static constexpr size_t slabHeaderSize() {
+    return (sizeof(Slab) + alignof(std::max_align_t) - 1) / alignof(std::max_align_t) *
+           alignof(std::max_align_t);
+  }
+
+  struct SizeClass {
+    size_t block_size;
+    size_t blocks_per_slab;
+    // Freed blocks. The first bytes of a free block point to the next one.
+    void *free_list;
+    // Blocks of the newest slab that were never handed out.
+    char *unused_begin;
+    char *unused_end;
+    size_t used_blocks;
+    size_t slab_count;
+  };
+
+  struct Pool {
+    size_t refcount;
+    Allocator allocator;
+    Slab *slabs;
+    SizeClass classes[size_class_count];
+  };
+
+  Pool *_pool;
+
+ public:
+  explicit HamtSlabAllocator(const Allocator &a = Allocator());
+  HamtSlabAllocator(const HamtSlabAllocator &other);
+  HamtSlabAllocator &operator=(const HamtSlabAllocator &other);
+  ~HamtSlabAllocator();
+
+  void *allocate(size_t size, size_t alignment);
+  void deallocate(void *ptr, size_t size);
+
+  SizeClassStats sizeClassStats(uint32_t size_class) const;
+
+ PUBLIC_IN_GTEST:
+  // Capacities of the size classes. See detail::hamt_trie_allocation_size().
+  static uint32_t sizeClassCapacity(uint32_t size_class) {
+    static const uint32_t capacities[size_class_count] = {1, 2, 3, 5, 8, 13, 21, 29, 32};
+    return capacities[size_class];
+  }
+
+  // Returns the size class for allocations of size bytes or -1 if they don't
+  // belong to any class.
+  static int sizeClassOf(size_t size) {
+    // clang-format off
+    static const int8_t class_by_capacity[33] = {
+    // 0   1  2  3   4  5   6   7  8   9  10  11  12 13  14  15  16
+      -1,  0, 1, 2, -1, 3, -1, -1, 4, -1, -1, -1, -1, 5, -1, -1, -1,
+    // 17  18  19  20 21  22  23  24  25  26  27  28 29  30  31 32
+      -1, -1, -1, -1, 6, -1, -1, -1, -1, -1, -1, -1, 7, -1, -1, 8
+    };
+    // clang-format on
+    const size_t header_size = BitmapTrie::allocationSize(0);
+    const size_t node_size = BitmapTrie::allocationSize(1) - header_size;
+    if (size <= header_size || (size - header_size) % node_size != 0) {
+      return -1;
+    }
+    const size_t capacity = (size - header_size) / node_size;
+    return capacity <= 32 ? class_by_capacity[capacity] : -1;
+  }
+
+ private:
+  void release();
+  bool allocateSlab(SizeClass &size_class);
+};
+
+// HamtSlabAllocator {{{
+
+template <class Entry, class Allocator>
+HamtSlabAllocator<Entry, Allocator>::HamtSlabAllocator(const Allocator &a) {
+  Allocator allocator(a);
+  void *ptr = allocator.allocate(sizeof(Pool), alignof(Pool));
+  assert(ptr && "Can't allocate the slab pool");
+  _pool = new (ptr) Pool;
+  _pool->refcount = 1;
+  _pool->allocator = allocator;
+  _pool->slabs = nullptr;
+  for (uint32_t i = 0; i < size_class_count; i++) {
+    SizeClass &size_class = _pool->classes[i];
+    size_class.block_size = BitmapTrie::allocationSize(sizeClassCapacity(i));
+    size_class.blocks_per_slab = (slab_size - slabHeaderSize()) / size_class.block_size;
+    if (size_class.blocks_per_slab < min_blocks_per_slab) {
+      size_class.blocks_per_slab = min_blocks_per_slab;
+    }
+    size_class.free_list = nullptr;
+    size_class.unused_begin = nullptr;
+    size_class.unused_end = nullptr;
+    size_class.used_blocks = 0;
+    size_class.slab_count = 0;
+  }
+}
+
+template <class Entry, class Allocator>
+HamtSlabAllocator<Entry, Allocator>::HamtSlabAllocator(const HamtSlabAllocator &other)
+    : _pool(other._pool) {
+  _pool->refcount++;
+}
+
+template <class Entry, class Allocator>
+HamtSlabAllocator<Entry, Allocator> &HamtSlabAllocator<Entry, Allocator>::operator=(
+    const HamtSlabAllocator &other) {
+  other._pool->refcount++;
+  release();
+  _pool = other._pool;
+  return *this;
+}
+
+template <class Entry, class Allocator>
+HamtSlabAllocator<Entry, Allocator>::~HamtSlabAllocator() {
+  release();
+}
+
+template <class Entry, class Allocator>
+void *HamtSlabAllocator<Entry, Allocator>::allocate(size_t size, size_t alignment) {
+  const int i = sizeClassOf(size);
+  if (UNLIKELY(i < 0)) {
+    return _pool->allocator.allocate(size, alignment);
+  }
+  assert(alignment <= alignof(std::max_align_t) && "Over-aligned entries aren't supported");
+
+  SizeClass &size_class = _pool->classes[i];
+  void *block = size_class.free_list;
+  if (block) {
+    size_class.free_list = *static_cast<void **>(block);
+  } else {
+    if (size_class.unused_begin == size_class.unused_end && !allocateSlab(size_class)) {
+      return nullptr;
+    }
+    block = size_class.unused_begin;
+    size_class.unused_begin += size_class.block_size;
+  }
+  size_class.used_blocks++;
+  return block;
+}
+
+template <class Entry, class Allocator>
+void HamtSlabAllocator<Entry, Allocator>::deallocate(void *ptr, size_t size) {
+  const int i = sizeClassOf(size);
+  if (UNLIKELY(i < 0)) {
+    _pool->allocator.deallocate(ptr, size);
+    return;
+  }
+
+  SizeClass &size_class = _pool->classes[i];
+  assert(size_class.used_blocks > 0);
+  *static_cast<void **>(ptr) = size_class.free_list;
+  size_class.free_list = ptr;
+  size_class.used_blocks--;
+}
+
+template <class Entry, class Allocator>
+typename HamtSlabAllocator<Entry, Allocator>::SizeClassStats
+HamtSlabAllocator<Entry, Allocator>::sizeClassStats(uint32_t i) const {
+  assert(i < size_class_count);
+  const SizeClass &size_class = _pool->classes[i];
+  SizeClassStats stats;
+  stats.capacity = sizeClassCapacity(i);
+  stats.block_size = size_class.block_size;
+  stats.used_blocks = size_class.used_blocks;
+  stats.free_blocks = size_class.slab_count * size_class.blocks_per_slab - size_class.used_blocks;
+  stats.slab_count = size_class.slab_count;
+  return stats;
+}
+
+template <class Entry, class Allocator>
+void HamtSlabAllocator<Entry, Allocator>::release() {
+  if (--_pool->refcount > 0) {
+    return;
+  }
+  Allocator allocator(_pool->allocator);
+  Slab *slab = _pool->slabs;
+  while (slab) {
+    Slab *next = slab->next;
+    allocator.deallocate(slab, slab->size);
+    slab = next;
+  }
+  _pool->~Pool();
+  allocator.deallocate(_pool, sizeof(Pool));
+}
+
+template <class Entry, class Allocator>
+bool HamtSlabAllocator<Entry, Allocator>::allocateSlab(SizeClass &size_class) {
+  const size_t size = slabHeaderSize() + size_class.blocks_per_slab * size_class.block_size;
+  void *ptr = _pool->allocator.allocate(size, alignof(std::max_align_t));
+  if (ptr == nullptr) {
+    return false;
+  }
+  Slab *slab = static_cast<Slab *>(ptr);
+  slab->next = _pool->slabs;
+  slab->size = size;
+  _pool->slabs = slab;
+  size_class.slab_count++;
+
+  size_class.unused_begin = static_cast<char *>(ptr) + slabHeaderSize();
+  size_class.unused_end =
+      size_class.unused_begin + size_class.blocks_per_slab * size_class.block_size;
+  return true;
+}
+
+// }}} End of HamtSlabAllocator
+
+}  // namespace foc
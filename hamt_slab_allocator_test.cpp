@@ -0,0 +1,181 @@
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#define GTEST
+#define HAMT_IMPLEMENTATION
+#include "hamt_slab_allocator.h"
+#include "persistent_hash_array_mapped_trie.h"
+
+using foc::HamtSlabAllocator;
+using foc::HashArrayMappedTrie;
+using foc::PersistentHashArrayMappedTrie;
+
+using Entry = std::pair<int64_t, int64_t>;
+
+// Counts the calls to allocate and the bytes that weren't deallocated yet.
+struct CountingAllocator {
+  static size_t allocations;
+  static int64_t allocated;
+
+  void *allocate(size_t size, size_t) {
+    allocations++;
+    allocated += size;
+    return malloc(size);
+  }
+
+  void deallocate(void *ptr, size_t size) {
+    allocated -= size;
+    free(ptr);
+  }
+};
+
+size_t CountingAllocator::allocations = 0;
+int64_t CountingAllocator::allocated = 0;
+
+using SlabAllocator = HamtSlabAllocator<Entry, CountingAllocator>;
+using HAMT = HashArrayMappedTrie<int64_t, int64_t, std::hash<int64_t>, std::equal_to<int64_t>,
+                                 SlabAllocator>;
+
+TEST(HamtSlabAllocatorTest, SizeClassOfTest) {
+  using BitmapTrie = SlabAllocator::BitmapTrie;
+  for (uint32_t i = 0; i < SlabAllocator::size_class_count; i++) {
+    uint32_t capacity = SlabAllocator::sizeClassCapacity(i);
+    EXPECT_EQ(SlabAllocator::sizeClassOf(BitmapTrie::allocationSize(capacity)), (int)i);
+    // The capacities of the classes are the ones the HAMT allocates.
+    EXPECT_EQ(foc::detail::hamt_trie_allocation_size(capacity, 1, 4), capacity);
+  }
+  EXPECT_EQ(SlabAllocator::sizeClassOf(BitmapTrie::allocationSize(4)), -1);
+  EXPECT_EQ(SlabAllocator::sizeClassOf(BitmapTrie::allocationSize(33)), -1);
+  EXPECT_EQ(SlabAllocator::sizeClassOf(BitmapTrie::allocationSize(1) + 1), -1);
+  EXPECT_EQ(SlabAllocator::sizeClassOf(1), -1);
+
+  // The tries refuse an allocator made for another Entry.
+  EXPECT_TRUE((foc::detail::hamt_allocator_supports<SlabAllocator, Entry>::value));
+  EXPECT_FALSE((foc::detail::hamt_allocator_supports<SlabAllocator,
+                                                     std::pair<int32_t, int64_t>>::value));
+  EXPECT_TRUE((foc::detail::hamt_allocator_supports<CountingAllocator, Entry>::value));
+}
+
+TEST(HamtSlabAllocatorTest, HAMTTest) {
+  CountingAllocator::allocations = 0;
+  {
+    HAMT hamt;
+    const int64_t n = 100000;
+    for (int64_t i = 0; i < n; i++) {
+      ASSERT_TRUE(hamt.insert(std::make_pair(i, i)) != hamt.end());
+    }
+    // Many arrays fit in a slab.
+    size_t allocations_after_insert = CountingAllocator::allocations;
+    EXPECT_LT(allocations_after_insert, n / 100);
+
+    size_t used_blocks = 0;
+    for (uint32_t i = 0; i < SlabAllocator::size_class_count; i++) {
+      auto stats = hamt.get_allocator().sizeClassStats(i);
+      EXPECT_EQ(stats.capacity, SlabAllocator::sizeClassCapacity(i));
+      EXPECT_EQ(stats.used_blocks + stats.free_blocks,
+                stats.slab_count * hamt.get_allocator()._pool->classes[i].blocks_per_slab);
+      used_blocks += stats.used_blocks;
+    }
+    EXPECT_GT(used_blocks, 0);
+
+    for (int64_t i = 0; i < n; i++) {
+      ASSERT_EQ(*hamt.find(i), i);
+    }
+    for (int64_t i = 0; i < n; i++) {
+      ASSERT_EQ(hamt.erase(i), 1);
+    }
+    // Every array was given back.
+    used_blocks = 0;
+    for (uint32_t i = 0; i < SlabAllocator::size_class_count; i++) {
+      used_blocks += hamt.get_allocator().sizeClassStats(i).used_blocks;
+    }
+    EXPECT_EQ(used_blocks, 0);
+
+    // The freed blocks are reused.
+    for (int64_t i = 0; i < n; i++) {
+      ASSERT_TRUE(hamt.insert(std::make_pair(i, -i)) != hamt.end());
+    }
+    EXPECT_LT(CountingAllocator::allocations - allocations_after_insert, n / 1000);
+  }
+  EXPECT_EQ(CountingAllocator::allocated, 0);
+}
+
+struct CachedHash {
+  size_t operator()(int64_t key) const { return std::hash<int64_t>()(key); }
+};
+
+namespace foc {
+template <>
+struct hamt_cache_hash<CachedHash> : std::true_type {};
+}  // namespace foc
+
+TEST(HamtSlabAllocatorTest, CachedHashTest) {
+  using HashedEntry = foc::detail::HashedEntry<int64_t, int64_t>;
+  using HashedSlabAllocator = HamtSlabAllocator<HashedEntry, CountingAllocator>;
+  using HashedHAMT = HashArrayMappedTrie<int64_t, int64_t, CachedHash, std::equal_to<int64_t>,
+                                         HashedSlabAllocator>;
+  EXPECT_FALSE((foc::detail::hamt_allocator_supports<SlabAllocator, HashedEntry>::value));
+  {
+    HashedHAMT hamt;
+    const int64_t n = 10000;
+    for (int64_t i = 0; i < n; i++) {
+      ASSERT_TRUE(hamt.insert(std::make_pair(i, i)) != hamt.end());
+    }
+    // The base arrays of the larger entries come from the slabs too.
+    size_t used_blocks = 0;
+    for (uint32_t i = 0; i < HashedSlabAllocator::size_class_count; i++) {
+      used_blocks += hamt.get_allocator().sizeClassStats(i).used_blocks;
+    }
+    EXPECT_GT(used_blocks, 0);
+    for (int64_t i = 0; i < n; i++) {
+      ASSERT_EQ(*hamt.find(i), i);
+    }
+  }
+  EXPECT_EQ(CountingAllocator::allocated, 0);
+}
+
+TEST(HamtSlabAllocatorTest, PersistentHAMTTest) {
+  using PHAMT = PersistentHashArrayMappedTrie<int64_t, int64_t, std::hash<int64_t>,
+                                              std::equal_to<int64_t>, SlabAllocator>;
+  {
+    std::vector<PHAMT> versions;
+    versions.push_back(PHAMT());
+    for (int64_t i = 0; i < 2000; i++) {
+      versions.push_back(versions.back().insert(std::make_pair(i, i)));
+    }
+    for (int64_t i = 0; i < 2000; i += 2) {
+      versions.push_back(versions.back().erase(i));
+    }
+    // Drop every other version. The nodes they share with the rest go back to
+    // the same pool.
+    for (size_t v = 1; v < versions.size(); v += 2) {
+      versions[v] = PHAMT();
+    }
+    for (size_t v = 0; v <= 2000; v += 2) {
+      EXPECT_EQ(versions[v].size(), v);
+      for (int64_t i = 0; i < (int64_t)v; i++) {
+        ASSERT_EQ(*versions[v].find(i), i);
+      }
+    }
+  }
+  EXPECT_EQ(CountingAllocator::allocated, 0);
+}
+
+TEST(HamtSlabAllocatorTest, StringKeysTest) {
+  using StringEntry = std::pair<std::string, std::string>;
+  HashArrayMappedTrie<std::string, std::string, std::hash<std::string>,
+                      std::equal_to<std::string>, HamtSlabAllocator<StringEntry>>
+      hamt;
+  for (int i = 0; i < 1000; i++) {
+    hamt.insert(std::make_pair(std::to_string(i), std::to_string(i)));
+  }
+  for (int i = 0; i < 1000; i += 2) {
+    hamt.erase(std::to_string(i));
+  }
+  EXPECT_EQ(hamt.size(), 500);
+  for (int i = 0; i < 1000; i++) {
+    EXPECT_EQ(hamt.find(std::to_string(i)) != nullptr, i % 2 == 1);
+  }
+}
@@ -6,17 +6,26 @@
 // http://infoscience.epfl.ch/record/64398
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cstddef>
 #include <cstdint>
 #include <cstdlib>
 #include <functional>
 #include <initializer_list>
 #include <iterator>
+#include <queue>
 #include <stack>
 #include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
 #include <utility>
+#include <vector>
 
 #include "allocator.h"
+#include "array_ref.h"
 #include "support.h"
 
 #ifndef PUBLIC_IN_GTEST
@@ -41,20 +50,117 @@ namespace foc {
 
 namespace detail {
 
+// The hash of a key is consumed in 5-bit slices, one per level of the HAMT.
+// Keys are hashed once: the 64-bit hash provides 12 slices.
+constexpr uint32_t hamt_levels_per_hash = 12;
+// hash_offset of the last slice of a hash.
+constexpr uint32_t hamt_last_hash_offset = 5 * (hamt_levels_per_hash - 1);
+// Level of the deepest tries. The keys whose hashes share all the slices meet
+// there in a collision node: a trie whose entries are in no particular order and
+// are found by comparing keys.
+constexpr uint32_t hamt_collision_level = hamt_levels_per_hash;
+// A collision node holds up to this many entries. When it's full, the next
+// colliding keys go to an overflow node (another collision node) at the last
+// logical position, so a chain of nodes can hold any number of keys. Every node
+// of a chain but the last one is full.
+constexpr uint32_t hamt_collision_node_entries = 31;
+// Maximum number of tries in a path from the root to an entry (root included),
+// not counting the overflow nodes of a collision node, which bounds the cursor
+// stack used by iterators.
+constexpr uint32_t hamt_max_depth = hamt_collision_level + 1;
+
+// Finalizer of MurmurHash3 (fmix64). Every bit of the input affects every bit
+// of the output, so the slices of the hash are well distributed even when the
+// hash function is the identity, as std::hash is for integers.
+inline uint64_t hamt_mix_hash(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+// Runs f(0), f(1), ..., f(task_count - 1) on up to thread_count threads, the
+// calling thread included. Tasks are handed out in order as threads get free.
+template <class F>
+void hamt_parallel_for(uint32_t thread_count, size_t task_count, const F &f) {
+  std::atomic<size_t> next_task(0);
+  auto worker = [&next_task, task_count, &f]() {
+    for (size_t i = next_task.fetch_add(1, std::memory_order_relaxed); i < task_count;
+         i = next_task.fetch_add(1, std::memory_order_relaxed)) {
+      f(i);
+    }
+  };
+  if (thread_count > task_count) {
+    thread_count = task_count;
+  }
+  std::vector<std::thread> threads;
+  for (uint32_t t = 1; t < thread_count; t++) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
 // expected_hamt_size is the expected_hamt_size after insertion
 uint32_t hamt_trie_allocation_size(uint32_t required, size_t expected_hamt_size, uint32_t level);
 
+template <class T>
+struct hamt_void {
+  using type = void;
+};
+
+// Allocators made for the nodes of a single Entry type (e.g. HamtSlabAllocator,
+// whose size classes depend on the size of a Node) declare it as
+// hamt_entry_type. Any other allocator supports every Entry.
+template <class Allocator, class Entry, class = void>
+struct hamt_allocator_supports : std::true_type {};
+
+template <class Allocator, class Entry>
+struct hamt_allocator_supports<Allocator,
+                               Entry,
+                               typename hamt_void<typename Allocator::hamt_entry_type>::type>
+    : std::is_same<typename Allocator::hamt_entry_type, Entry> {};
+
 template <class Entry, class Allocator>
 class NodeTemplate;
 
 // The root of a trie that can contain up to 32 Nodes. A bitmap is used
 // to compress the array as decribed in the paper.
+//
+// The nodes are laid out as in CHAMP [1]: one bitmap for the logical positions
+// holding entries (_datamap) and one for the positions holding sub-tries
+// (_nodemap). Entries are packed at the front of the base array in logical
+// order and sub-tries at the back in reverse logical order, so a scan of the
+// entries of a trie touches a contiguous range of memory and the kind of a
+// node never has to be stored in the node itself.
+//
+// The capacity of the base array is stored in a small header right before the
+// array, so a BitmapTrie (and a Node of a small Entry) is just 16 bytes.
+//
+// [1] "Optimizing Hash-Array Mapped Tries for Fast and Lean Immutable JVM
+//     Collections". Michael J. Steindorfer and Jurgen J. Vinju. 2015.
 template <class Entry, class Allocator>
 class BitmapTrieTemplate {
  private:
   using Node = NodeTemplate<Entry, Allocator>;
-  uint32_t _bitmap;
-  uint32_t _capacity;
+
+  static_assert(hamt_allocator_supports<Allocator, Entry>::value,
+                "The Allocator was made for the nodes of another Entry type");
+
+  // Stored right before the first Node of every base array.
+  struct BaseHeader {
+    uint32_t capacity;
+    // Number of tries pointing to the base array. Only persistent HAMTs share
+    // base arrays, and the count fits in the padding before the first Node.
+    std::atomic<uint32_t> refcount;
+  };
+
+  uint32_t _datamap;
+  uint32_t _nodemap;
   Node *_base;
 
  public:
@@ -62,36 +168,79 @@ class BitmapTrieTemplate {
   // Users of this class should call allocate and deallocate correctly.
   BitmapTrieTemplate() = default;
   BitmapTrieTemplate(BitmapTrieTemplate &&other) = default;
+  BitmapTrieTemplate &operator=(BitmapTrieTemplate &&other) = default;
+
+  // Number of bytes requested from the Allocator for a base array.
+  static constexpr size_t allocationSize(uint32_t capacity) {
+    return headerSize() + capacity * sizeof(Node);
+  }
 
   ATTRIBUTE_ALWAYS_INLINE
   Node *allocate(Allocator &allocator, uint32_t capacity);
+  // Allocates the base array of a trie with the given bitmaps. The nodes are
+  // left for the caller to construct.
+  Node *allocate(Allocator &allocator, uint32_t capacity, uint32_t datamap, uint32_t nodemap) {
+    Node *base = allocate(allocator, capacity);
+    _datamap = datamap;
+    _nodemap = nodemap;
+    return base;
+  }
   ATTRIBUTE_ALWAYS_INLINE
   void deallocate(Allocator &allocator);
 
-  void cloneRecursively(Allocator &, BitmapTrieTemplate &root);
+  void cloneRecursively(Allocator &, const BitmapTrieTemplate &root);
+  // Destroys the entries and deallocates the base arrays of the trie and all
+  // its sub-tries.
   void deallocateRecursively(Allocator &) noexcept;
+  // Destroys the entries of the trie and all its sub-tries, leaving the base
+  // arrays to whoever owns the memory they were carved out of.
+  void destroyEntriesRecursively(Allocator &allocator) noexcept {
+    if (_base) {
+      deallocateRecursively(allocator, std::false_type(), false);
+    }
+    _base = nullptr;
+  }
 
   void clear(Allocator &allocator) {
     deallocateRecursively(allocator);
-    _bitmap = 0;
-    _capacity = 0;
+    _datamap = 0;
+    _nodemap = 0;
     _base = nullptr;
   }
 
   void swap(BitmapTrieTemplate &other) {
-    std::swap(_bitmap, other._bitmap);
-    std::swap(_capacity, other._capacity);
+    std::swap(_datamap, other._datamap);
+    std::swap(_nodemap, other._nodemap);
     std::swap(_base, other._base);
   }
 
+  // Index of the entry at (or that would be inserted at) logical_index.
+  uint32_t entryIndex(uint32_t logical_index) const {
+    assert(logical_index < 32);
+    uint32_t _bitmask = 0x1U << logical_index;
+    return __builtin_popcount(_datamap & (_bitmask - 1));
+  }
+
+  // Index of the sub-trie at logical_index.
+  uint32_t trieIndex(uint32_t logical_index) const {
+    assert(logical_index < 32);
+    uint32_t _bitmask = 0x1U << logical_index;
+    return size() - 1 - __builtin_popcount(_nodemap & (_bitmask - 1));
+  }
+
   uint32_t physicalIndex(uint32_t logical_index) const {
     assert(logical_index < 32);
-    uint32_t _bitmask = 0x1 << logical_index;
-    return __builtin_popcount(_bitmap & (_bitmask - 1));
+    if (_nodemap & (0x1U << logical_index)) {
+      return trieIndex(logical_index);
+    }
+    return entryIndex(logical_index);
   }
 
-  uint32_t size() const { return __builtin_popcount(_bitmap); }
-  uint32_t capacity() const { return _capacity; }
+  uint32_t bitmap() const { return _datamap | _nodemap; }
+  uint32_t size() const { return __builtin_popcount(_datamap | _nodemap); }
+  uint32_t entryCount() const { return __builtin_popcount(_datamap); }
+  uint32_t trieCount() const { return __builtin_popcount(_nodemap); }
+  uint32_t capacity() const { return _base ? header()->capacity : 0; }
   Node &physicalGet(uint32_t i) { return _base[i]; }
   const Node &physicalGet(uint32_t i) const { return _base[i]; }
   Node &logicalGet(uint32_t i) { return _base[physicalIndex(i)]; }
@@ -99,8 +248,16 @@ class BitmapTrieTemplate {
 
   bool logicalPositionTaken(uint32_t logical_index) const {
     assert(logical_index < 32);
-    return _bitmap & (0x1 << logical_index);
+    return (_datamap | _nodemap) & (0x1U << logical_index);
+  }
+
+  bool physicalIsEntry(uint32_t i) const {
+    assert(i < size());
+    return i < entryCount();
   }
+  bool physicalIsTrie(uint32_t i) const { return !physicalIsEntry(i); }
+  bool logicalIsEntry(uint32_t i) const { return _datamap & (0x1U << i); }
+  bool logicalIsTrie(uint32_t i) const { return _nodemap & (0x1U << i); }
 
   uint32_t physicalIndexOf(const Node *needle) const {
     assert(needle);
@@ -109,31 +266,181 @@ class BitmapTrieTemplate {
     return needle - _base;
   }
 
-  Node *insertEntry(Allocator &,
+  Node *insertEntry(Allocator &allocator,
+                    int logical_index,
+                    const Entry &new_entry,
+                    size_t expected_hamt_size,
+                    uint32_t level) {
+    return emplaceEntry(allocator, logical_index, expected_hamt_size, level, new_entry);
+  }
+  Node *insertEntry(Allocator &allocator,
                     int logical_index,
-                    const Entry &,
-                    Node *parent,
+                    Entry &&new_entry,
                     size_t expected_hamt_size,
-                    uint32_t level);
+                    uint32_t level) {
+    return emplaceEntry(
+        allocator, logical_index, expected_hamt_size, level, std::move(new_entry));
+  }
+  // Constructs an entry from args in place at logical_index. args are left
+  // untouched if the base array can't be grown.
+  template <class... Args>
+  Node *emplaceEntry(Allocator &,
+                     int logical_index,
+                     size_t expected_hamt_size,
+                     uint32_t level,
+                     Args &&... args);
+
+  // Destroys the entry at logical_index and closes the gap in the base array.
+  // The array is moved to a smaller allocation when the remaining nodes fit a
+  // smaller size class.
+  void eraseEntry(Allocator &, int logical_index, size_t expected_hamt_size, uint32_t level);
+
+  // Moves the nodes to a base array of the given capacity if it's larger than
+  // the current one. Returns false if the array can't be allocated.
+  bool grow(Allocator &, uint32_t capacity);
+
+  // Moves the base array of the trie and of all its sub-tries to allocations
+  // that have room for their nodes and nothing else. An array that can't be
+  // reallocated is left as is.
+  void shrinkToFitRecursively(Allocator &);
+
+  // Bytes taken by the base arrays of the trie and of all its sub-tries when
+  // they have room for their nodes and nothing else.
+  size_t fittedSizeRecursively() const;
+  // Moves the base arrays of the trie and of all its sub-tries, in
+  // breadth-first order, to arrays with room for their nodes and nothing else.
+  // The arrays are carved out of image, which has room for
+  // fittedSizeRecursively() bytes, or allocated one by one if image is null.
+  // The old arrays are deallocated unless they were carved out of an image.
+  // Returns false, leaving the tries untouched, if the arrays can't be
+  // allocated.
+  bool relocateBreadthFirst(Allocator &, char *image, bool from_image);
+
+  // Replaces the entry at logical_index with an empty trie of the given capacity.
+  // The entry is destroyed, so callers should move it out of the node first.
+  BitmapTrieTemplate *entryToTrie(Allocator &, int logical_index, uint32_t capacity);
+  // Replaces the trie at logical_index with the entry. The trie should already be
+  // deallocated.
+  Node *trieToEntry(int logical_index, Entry &&entry);
 
 #ifdef GTEST
-  Node *insertTrie(Allocator &, Node *parent, int logical_index, uint32_t capacity);
+  BitmapTrieTemplate *insertTrie(Allocator &, int logical_index, uint32_t capacity);
 #endif  // GTEST
 
   const Node *firstEntryNodeRecursively() const noexcept;
 
+  // Compares two tries built with the same hash seeds. Since the layout is
+  // canonical, equal maps have tries with the same shape and their entries in
+  // the same positions, except in collision nodes (see hamt_collision_level).
+  template <class EntryEqual>
+  bool equalsRecursively(const BitmapTrieTemplate &other,
+                         const EntryEqual &entry_equal,
+                         uint32_t level = 0) const;
+
+  // Collision node chains {{{
+  //
+  // The overflow node of a collision node (see hamt_collision_node_entries) is
+  // its only sub-trie, at the last logical position.
+
+  BitmapTrieTemplate *overflowNode() { return _nodemap ? &_base[size() - 1].asTrie() : nullptr; }
+  const BitmapTrieTemplate *overflowNode() const {
+    return _nodemap ? &_base[size() - 1].asTrie() : nullptr;
+  }
+
+  // Chains an empty overflow node of the given capacity to this full collision
+  // node, which should be the last one of its chain. Returns nullptr if the
+  // node can't be allocated.
+  BitmapTrieTemplate *appendOverflowNode(Allocator &, uint32_t capacity);
+  // Unchains the overflow node, which should be the last node of the chain and
+  // have no entries left.
+  void removeOverflowNode(Allocator &);
+  // Erases the entry with physical index i of node, a node of the chain that
+  // starts at this collision node. The last entry of the chain takes its place,
+  // so only the last node can have room left, and the last node is unchained
+  // when it's emptied.
+  void eraseCollidingEntry(Allocator &,
+                           BitmapTrieTemplate *node,
+                           uint32_t i,
+                           size_t expected_hamt_size,
+                           uint32_t level);
+
+  // }}}
+
+  // Structural sharing {{{
+  //
+  // Persistent HAMTs share base arrays between versions. A trie can only be
+  // modified in place while its base array is not shared.
+
+  void retainBase() const {
+    if (_base) {
+      header()->refcount.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  // Makes this (uninitialized) trie share the base array of source.
+  void share(const BitmapTrieTemplate &source) {
+    _datamap = source._datamap;
+    _nodemap = source._nodemap;
+    _base = source._base;
+    retainBase();
+  }
+
+  bool baseIsShared() const {
+    return _base && header()->refcount.load(std::memory_order_acquire) > 1;
+  }
+
+  // Initializes this trie with a new base array of the given capacity holding
+  // copies of the entries of source. The sub-tries are shared with source.
+  bool copyShallow(Allocator &, const BitmapTrieTemplate &source, uint32_t capacity);
+
+  // Drops this trie's reference to the base array. The last reference destroys
+  // the entries, releases the sub-tries and deallocates the array.
+  void releaseRecursively(Allocator &) noexcept;
+
+  // }}}
+
 #ifdef GTEST
-  uint32_t &bitmap() { return _bitmap; }
+  uint32_t &datamap() { return _datamap; }
+  uint32_t &nodemap() { return _nodemap; }
 #endif
+
+ private:
+  // Size of the BaseHeader rounded up to keep the nodes aligned.
+  static constexpr size_t headerSize() {
+    return (sizeof(BaseHeader) + alignof(Node) - 1) / alignof(Node) * alignof(Node);
+  }
+
+  BaseHeader *header() const {
+    return reinterpret_cast<BaseHeader *>(reinterpret_cast<char *>(_base) - headerSize());
+  }
+
+  static Node *allocateBase(Allocator &allocator, uint32_t capacity);
+  // Initializes the header of a base array of the given capacity at ptr, which
+  // has room for allocationSize(capacity) bytes.
+  static Node *constructBase(void *ptr, uint32_t capacity);
+  static void deallocateBase(Allocator &allocator, Node *base);
+
+  // Moves the entry or trie in src to the uninitialized node dest.
+  static void relocate(Node *dest, Node *src, bool is_entry);
+
+  void deallocateRecursively(Allocator &, std::true_type) noexcept {}
+  void deallocateRecursively(Allocator &,
+                             std::false_type,
+                             bool deallocate_arrays = true) noexcept;
+  // Does deallocateRecursively() for an overflow node and the rest of its
+  // chain without a stack.
+  void deallocateOverflowChain(Allocator &, bool deallocate_arrays) noexcept;
+  // Destroys the entries of the trie and returns how many there were.
+  uint32_t destroyEntries() noexcept;
 };
 
 // A Node in the HAMT is a sum type of Entry and BitmapTrie (i.e. can be one or the other).
+// Which one it holds is recorded in the bitmaps of the trie that contains the node.
 template <class Entry, class Allocator>
 class NodeTemplate {
  private:
   using BitmapTrieT = BitmapTrieTemplate<Entry, Allocator>;
 
-  NodeTemplate *_parent;
   union {
     struct {
       alignas(alignof(Entry)) char buffer[sizeof(Entry)];
@@ -143,64 +450,45 @@ class NodeTemplate {
 
  public:
   ATTRIBUTE_ALWAYS_INLINE
-  explicit NodeTemplate(NodeTemplate *parent) { BitmapTrie(parent); }
-  ATTRIBUTE_ALWAYS_INLINE
-  NodeTemplate(const Entry &entry, NodeTemplate *parent);
-  ATTRIBUTE_ALWAYS_INLINE
-  NodeTemplate(Entry &&entry, NodeTemplate *parent);
-
-  ATTRIBUTE_ALWAYS_INLINE
-  NodeTemplate *BitmapTrie(NodeTemplate *parent);
+  explicit NodeTemplate(const Entry &entry);
   ATTRIBUTE_ALWAYS_INLINE
-  NodeTemplate *BitmapTrie(Allocator &allocator, NodeTemplate *parent, uint32_t capacity);
+  explicit NodeTemplate(Entry &&entry);
 
   ATTRIBUTE_ALWAYS_INLINE
-  NodeTemplate &operator=(NodeTemplate &&other);
-  ATTRIBUTE_ALWAYS_INLINE
-  NodeTemplate &operator=(Entry &&other);
-
-  bool isEntry() const { return (uintptr_t)_parent & (uintptr_t)0x1U; }
-  bool isTrie() const { return !isEntry(); }
-
-  const NodeTemplate *parent() const {
-    return (NodeTemplate *)((uintptr_t)_parent & ~(uintptr_t)0x1U);
-  }
-
-  NodeTemplate *parent() { return (NodeTemplate *)((uintptr_t)_parent & ~(uintptr_t)0x1U); }
-
-  Entry &asEntry() {
-    assert(isEntry() && "Node should be an entry");
-    return *reinterpret_cast<Entry *>(&_either.entry);
-  }
-
-  const Entry &asEntry() const {
-    assert(isEntry() && "Node should be an entry");
-    return *reinterpret_cast<const Entry *>(&_either.entry);
-  }
-
-  BitmapTrieT &asTrie() {
-    assert(isTrie() && "Node should be a trie");
-    return _either.trie;
-  }
+  BitmapTrieT *BitmapTrie(Allocator &allocator, uint32_t capacity);
 
-  const BitmapTrieT &asTrie() const {
-    assert(isTrie() && "Node should be a trie");
-    return _either.trie;
-  }
-
-  NodeTemplate *nextEntryNode() {
-    // TODO: fix
-    return this;
-  }
+  Entry &asEntry() { return *reinterpret_cast<Entry *>(&_either.entry); }
+  const Entry &asEntry() const { return *reinterpret_cast<const Entry *>(&_either.entry); }
+  BitmapTrieT &asTrie() { return _either.trie; }
+  const BitmapTrieT &asTrie() const { return _either.trie; }
 };
 
 }  // namespace detail
 
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+class PersistentHashArrayMappedTrie;
+
+// Iterates over the entries of a HAMT in a depth-first traversal of the tries.
+//
+// Instead of following parent links, the iterator keeps a cursor into the base
+// array of every trie in the path from the root to the current entry. The path
+// can't be longer than detail::hamt_max_depth (the overflow nodes of a collision
+// node share its cursor), so the stack has a fixed size and a full scan never
+// allocates.
 template <class Entry, class Allocator>
 class HAMTConstForwardIterator {
  private:
   using Node = detail::NodeTemplate<Entry, Allocator>;
-  const Node *_node;
+  using BitmapTrie = detail::BitmapTrieTemplate<Entry, Allocator>;
+
+  struct Cursor {
+    const BitmapTrie *trie;
+    uint32_t index;
+  };
+
+  Cursor _stack[detail::hamt_max_depth];
+  // Number of cursors in the stack. The end() iterator has an empty stack.
+  uint32_t _depth;
 
  public:
   // clang-format off
@@ -211,40 +499,168 @@ class HAMTConstForwardIterator {
   typedef const Entry*               pointer;
   // clang-format on
 
-  HAMTConstForwardIterator() noexcept : _node(nullptr) {}
-  HAMTConstForwardIterator(const Node *node) noexcept : _node(node) {}
+  HAMTConstForwardIterator() noexcept : _depth(0) {}
+  // Allows comparisons with nullptr as a synonym of end().
+  HAMTConstForwardIterator(std::nullptr_t) noexcept : _depth(0) {}
   // TODO: implement HAMTForwardIterator
-  // HAMTConstForwardIterator(const HAMTForwardIterator& it) noexcept : _node(it._node) {}
-  HAMTConstForwardIterator(const HAMTConstForwardIterator &it) noexcept : _node(it._node) {}
+  // HAMTConstForwardIterator(const HAMTForwardIterator& it) noexcept;
+  HAMTConstForwardIterator(const HAMTConstForwardIterator &it) noexcept : _depth(it._depth) {
+    for (uint32_t i = 0; i < _depth; i++) {
+      _stack[i] = it._stack[i];
+    }
+  }
+
+  HAMTConstForwardIterator &operator=(const HAMTConstForwardIterator &it) noexcept {
+    _depth = it._depth;
+    for (uint32_t i = 0; i < _depth; i++) {
+      _stack[i] = it._stack[i];
+    }
+    return *this;
+  }
 
-  reference operator*() const noexcept { return _node->asEntry(); }
-  pointer operator->() const noexcept { return &_node->asEntry(); }
+  reference operator*() const noexcept { return node()->asEntry(); }
+  pointer operator->() const noexcept { return &node()->asEntry(); }
 
   HAMTConstForwardIterator &operator++() {
-    _node = _node->nextEntryNode();
+    assert(_depth > 0 && "Can't increment the end() iterator");
+    _stack[_depth - 1].index++;
+    seekEntry();
     return *this;
   }
 
   HAMTConstForwardIterator operator++(int) {
-    HAMTConstForwardIterator _this(_node);
+    HAMTConstForwardIterator _this(*this);
     ++(*this);
     return _this;
   }
 
   friend bool operator==(const HAMTConstForwardIterator &x, const HAMTConstForwardIterator &y) {
-    return x._node == y._node;
+    return x.node() == y.node();
   }
 
   friend bool operator!=(const HAMTConstForwardIterator &x, const HAMTConstForwardIterator &y) {
-    return x._node != y._node;
+    return x.node() != y.node();
+  }
+
+ private:
+  // Creates an iterator positioned at the first entry of the trie.
+  explicit HAMTConstForwardIterator(const BitmapTrie &root) noexcept : _depth(0) {
+    push(root);
+    seekEntry();
+  }
+
+  const Node *node() const {
+    if (_depth == 0) {
+      return nullptr;
+    }
+    const Cursor &cursor = _stack[_depth - 1];
+    return &cursor.trie->physicalGet(cursor.index);
+  }
+
+  void push(const BitmapTrie &trie) {
+    assert(_depth < detail::hamt_max_depth);
+    _stack[_depth++] = Cursor{&trie, 0};
+  }
+
+  // Positions the cursor at the node with physical index i of trie at depth
+  // level. The cursors of the previous levels should point to the tries in the
+  // path to the node.
+  void set(uint32_t level, const BitmapTrie &trie, uint32_t i) {
+    assert(level < detail::hamt_max_depth);
+    _stack[level] = Cursor{&trie, i};
+    _depth = level + 1;
+  }
+
+  // Moves the cursors forward until the top of the stack points to an entry
+  // or the stack is empty (end of the traversal).
+  void seekEntry() {
+    while (_depth > 0) {
+      Cursor &cursor = _stack[_depth - 1];
+      if (cursor.index == cursor.trie->size()) {
+        // Done with this trie, continue from the next node of the parent trie.
+        if (--_depth > 0) {
+          _stack[_depth - 1].index++;
+        }
+      } else if (cursor.trie->physicalIsTrie(cursor.index)) {
+        const BitmapTrie &child = cursor.trie->physicalGet(cursor.index).asTrie();
+        if (_depth == detail::hamt_max_depth) {
+          // The overflow node of a collision node is its last node, so the
+          // cursor of the collision node isn't needed anymore.
+          cursor = Cursor{&child, 0};
+        } else {
+          push(child);
+        }
+      } else {
+        return;
+      }
+    }
   }
 
   template <class, class, class, class, class>
   friend class HashArrayMappedTrie;
-  template <class, class>
-  friend class NodeTemplate;
+  template <class, class, class, class, class>
+  friend class PersistentHashArrayMappedTrie;
+};
+
+// Specialize as std::true_type for hash functions that are expensive to compute
+// (e.g. hashes of long strings). HashArrayMappedTries using them store the hash
+// of every key next to its entry. Splitting a slot then doesn't rehash the key
+// already there, and lookups only compare the keys of entries with the same
+// hash.
+template <class Hash>
+struct hamt_cache_hash : std::false_type {};
+
+namespace detail {
+
+// Entry of the HAMTs that don't cache hashes.
+template <class Key, class T, bool CacheHash>
+struct HAMTEntry {
+  using type = std::pair<Key, T>;
+
+  static bool cachedHash(const type &, uint64_t *) { return false; }
+  static bool hashMayMatch(const type &, uint64_t) { return true; }
+};
+
+// Entry of the HAMTs that cache hashes.
+template <class Key, class T>
+struct HashedEntry : public std::pair<Key, T> {
+  // Hash of the key with the seed of the HAMT.
+  uint64_t hash;
+
+  // Constructs the pair from args.
+  template <class... Args>
+  explicit HashedEntry(uint64_t hash, Args &&... args)
+      : std::pair<Key, T>(std::forward<Args>(args)...), hash(hash) {}
+};
+
+template <class Key, class T>
+struct HAMTEntry<Key, T, true> {
+  using type = HashedEntry<Key, T>;
+
+  static bool cachedHash(const type &entry, uint64_t *hash) {
+    *hash = entry.hash;
+    return true;
+  }
+  static bool hashMayMatch(const type &entry, uint64_t hash) { return entry.hash == hash; }
 };
 
+// Hash and KeyEqual declare `is_transparent` when they accept other types than
+// Key (e.g. a string view for std::string keys).
+template <class F>
+std::true_type hamt_is_transparent_test(typename F::is_transparent *);
+template <class F>
+std::false_type hamt_is_transparent_test(...);
+
+template <class F>
+struct hamt_is_transparent : decltype(hamt_is_transparent_test<F>(nullptr)) {};
+
+template <class T>
+struct hamt_is_pair : std::false_type {};
+template <class A, class B>
+struct hamt_is_pair<std::pair<A, B>> : std::true_type {};
+
+}  // namespace detail
+
 template <class Key,
           class T,
           class Hash = std::hash<Key>,
@@ -253,11 +669,21 @@ template <class Key,
 class HashArrayMappedTrie {
   // clang-format off
  PUBLIC_IN_GTEST:
-  using Entry = std::pair<Key, T>;
+  using EntryTraits = detail::HAMTEntry<Key, T, hamt_cache_hash<Hash>::value>;
+  using Entry = typename EntryTraits::type;
   // clang-format on
+  using CacheHash = std::integral_constant<bool, hamt_cache_hash<Hash>::value>;
   using BitmapTrie = detail::BitmapTrieTemplate<Entry, Allocator>;
   using Node = detail::NodeTemplate<Entry, Allocator>;
 
+  // Enables the overloads of the lookup functions for keys of type K that
+  // aren't Key when both Hash and KeyEqual are transparent.
+  template <class K>
+  using EnableIfTransparent =
+      typename std::enable_if<detail::hamt_is_transparent<Hash>::value &&
+                                  detail::hamt_is_transparent<KeyEqual>::value,
+                              K>::type;
+
  public:
   // Some std::unordered_map member types.
   //
@@ -276,16 +702,22 @@ class HashArrayMappedTrie {
   typedef const std::pair<const Key, T>&                    const_reference;
   // TODO: implement HAMTForwardIterator
   // typedef HAMTForwardIterator<Entry, Allocator>             iterator;
-  typedef const HAMTConstForwardIterator<Entry, Allocator>  iterator;
-  typedef const HAMTConstForwardIterator<Entry, Allocator>  const_iterator;
+  typedef HAMTConstForwardIterator<Entry, Allocator>        iterator;
+  typedef HAMTConstForwardIterator<Entry, Allocator>        const_iterator;
   // clang-format on
 
   size_type _count;
-  Node _root;
-  uint32_t _seed;
+  // Size the allocation decisions plan for while the HAMT is smaller. See
+  // reserve().
+  size_type _reserved;
+  BitmapTrie _root;
+  uint64_t _seed;
   Hash _hasher;
   KeyEqual _key_equal;
   Allocator _allocator;
+  // The allocation holding the base arrays of a frozen HAMT. See freeze().
+  char *_image;
+  size_t _image_size;
 
  public:
   HashArrayMappedTrie() : HashArrayMappedTrie(1) {}
@@ -303,6 +735,20 @@ class HashArrayMappedTrie {
   HashArrayMappedTrie(HashArrayMappedTrie &&other);
 
   HashArrayMappedTrie(HashArrayMappedTrie &&, const allocator_type &);
+
+  // Builds the HAMT from the entries in [first, last) at once. See
+  // insert(first, last).
+  template <class InputIterator>
+  HashArrayMappedTrie(InputIterator first,
+                      InputIterator last,
+                      size_t n = 0,
+                      const hasher &hf = hasher(),
+                      const key_equal &eql = key_equal(),
+                      const allocator_type &a = allocator_type())
+      : HashArrayMappedTrie(n, hf, eql, a) {
+    insert(first, last);
+  }
+
   /*HashArrayMappedTrie(
       initializer_list<value_type>,
       size_t n = 0,
@@ -333,15 +779,15 @@ class HashArrayMappedTrie {
   allocator_type& a) : HashArrayMappedTrie(il, n, hf, key_equal(), a) {}
   */
 
-  ~HashArrayMappedTrie() { _root.asTrie().deallocateRecursively(_allocator); }
+  ~HashArrayMappedTrie() { deallocateTries(); }
 
   // TODO: define out-of-line
   HashArrayMappedTrie &operator=(const HashArrayMappedTrie &other) {
     if (this != &other) {
-      _root.asTrie().deallocateRecursively(_allocator);
+      deallocateTries();
       _count = other._count;
+      _reserved = other._reserved;
       _seed = other._seed;
-      _root = other._root;
       _hasher = other._hasher;
       _key_equal = other._key_equal;
       _allocator = other._allocator;  // TODO: can copy allocator?
@@ -353,13 +799,21 @@ class HashArrayMappedTrie {
   // TODO: define out-of-line
   HashArrayMappedTrie &operator=(HashArrayMappedTrie &&other) {
     if (this != &other) {
-      _root.asTrie().deallocateRecursively(_allocator);
+      deallocateTries();
       _count = other._count;
+      _reserved = other._reserved;
       _seed = other._seed;
       _root = std::move(other._root);
       _hasher = std::move(other._hasher);
       _key_equal = std::move(other._key_equal);
       _allocator = std::move(other._allocator);  // TODO: can copy allocator?
+      _image = other._image;
+      _image_size = other._image_size;
+      other._count = 0;
+      other._reserved = 0;
+      other._image = nullptr;
+      other._image_size = 0;
+      other._root.allocate(other._allocator, 0);
     }
     return *this;
   }
@@ -368,202 +822,821 @@ class HashArrayMappedTrie {
 
   allocator_type get_allocator() const { return _allocator; }
 
+  const_iterator begin() const { return const_iterator(_root); }
+  const_iterator end() const { return const_iterator(); }
+  const_iterator cbegin() const { return begin(); }
+  const_iterator cend() const { return end(); }
+
   bool empty() const { return _count == 0; }
   size_type size() const { return _count; }
   // We don't implement max_size()
 
-  // template <class... Args> pair<iterator, bool> emplace(Args&&... args);
+  // Sizes the tries as if the HAMT already had n entries, so they get the
+  // capacity they would have at that size when they are first allocated
+  // instead of growing one size class at a time. The root is grown now.
+  // Erases don't shrink the tries below the capacity planned for n entries.
+  void reserve(size_type n) {
+    if (!thaw()) {
+      return;
+    }
+    _reserved = n;
+    const uint32_t required = _root.size() > 0 ? _root.size() : 1;
+    _root.grow(_allocator,
+               detail::hamt_trie_allocation_size(required, expectedSize(_count + 1), 0));
+  }
+
   // template <class... Args> iterator emplace_hint(const_iterator position, Args&&... args);
 
+  // Inserts entry or, unlike std::unordered_map, replaces the value of the key
+  // if it's already in the HAMT. Returns end() if the entry can't be inserted.
   iterator insert(const value_type &entry) {
-    uint32_t hash = hash32(entry.first, _seed);
-    Node *node = insertEntry(&_root, entry, _seed, hash, 0, 0);
+    iterator it;
+    bool found;
+    Node *node = findOrEmplace(entry.first, it, found, entry);
+    if (node == nullptr) {
+      return end();
+    }
+    if (found) {
+      node->asEntry().second = entry.second;
+    }
+    return it;
+  }
+
+  iterator insert(value_type &&entry) {
+    iterator it;
+    bool found;
+    Node *node = findOrEmplace(entry.first, it, found, std::move(entry));
     if (node == nullptr) {
-      return iterator(nullptr);
+      return end();
+    }
+    if (found) {
+      node->asEntry().second = std::move(entry.second);
+    }
+    return it;
+  }
+
+  // The functions below follow std::unordered_map: the bool is true if the
+  // entry was inserted and false if the key was already in the HAMT. The
+  // iterator is end() if the entry can't be inserted.
+
+  // Constructs the entry from args unless the key is already in the HAMT. When
+  // args are a key and a value, or a pair of them, the key is looked up first
+  // and the entry is constructed in place from them (a key of another type is
+  // converted to Key first). Other args are used to construct an entry that is
+  // then moved into the trie.
+  template <class... Args>
+  std::pair<iterator, bool> emplace(Args &&... args) {
+    return emplaceArgs(std::forward<Args>(args)...);
+  }
+
+  // Constructs the entry in place from key and args unless the key is already
+  // in the HAMT, in which case args are left untouched.
+  template <class... Args>
+  std::pair<iterator, bool> try_emplace(const Key &key, Args &&... args) {
+    iterator it;
+    bool found;
+    Node *node = findOrEmplace(key,
+                               it,
+                               found,
+                               std::piecewise_construct,
+                               std::forward_as_tuple(key),
+                               std::forward_as_tuple(std::forward<Args>(args)...));
+    return std::make_pair(node ? it : end(), node && !found);
+  }
+
+  template <class... Args>
+  std::pair<iterator, bool> try_emplace(Key &&key, Args &&... args) {
+    iterator it;
+    bool found;
+    Node *node = findOrEmplace(key,
+                               it,
+                               found,
+                               std::piecewise_construct,
+                               std::forward_as_tuple(std::move(key)),
+                               std::forward_as_tuple(std::forward<Args>(args)...));
+    return std::make_pair(node ? it : end(), node && !found);
+  }
+
+  template <class M>
+  std::pair<iterator, bool> insert_or_assign(const Key &key, M &&obj) {
+    iterator it;
+    bool found;
+    Node *node = findOrEmplace(key, it, found, key, std::forward<M>(obj));
+    if (node && found) {
+      node->asEntry().second = std::forward<M>(obj);
+    }
+    return std::make_pair(node ? it : end(), node && !found);
+  }
+
+  template <class M>
+  std::pair<iterator, bool> insert_or_assign(Key &&key, M &&obj) {
+    iterator it;
+    bool found;
+    Node *node = findOrEmplace(key, it, found, std::move(key), std::forward<M>(obj));
+    if (node && found) {
+      node->asEntry().second = std::forward<M>(obj);
+    }
+    return std::make_pair(node ? it : end(), node && !found);
+  }
+
+  size_type erase(const Key &key) { return eraseKey(key); }
+
+  // Erases the key equal to key without constructing a Key. Only available
+  // when Hash and KeyEqual are transparent.
+  template <class K, class = EnableIfTransparent<K>>
+  size_type erase(const K &key) {
+    return eraseKey(key);
+  }
+
+  // Inserts the entries in [first, last). As with insert(entry), the last
+  // value of a repeated key wins.
+  //
+  // An empty HAMT is built in one pass instead of entry by entry: the keys are
+  // hashed up front and radix-partitioned by the slices of their hashes, so
+  // every base array is allocated once at its final size and no entry is moved
+  // by splits. If there isn't enough memory to build the tries at once, the
+  // entries are inserted one by one.
+  //
+  // Returns false if some entries couldn't be inserted (i.e. memory ran out).
+  template <class InputIterator>
+  bool insert(InputIterator first, InputIterator last) {
+    return bulkInsert(first, last, 1);
+  }
+
+  // Same as insert(first, last), but an empty HAMT is built on thread_count
+  // threads (one per hardware thread if 0): the keys are hashed in parallel
+  // and the sub-tries of the root, which partition the keys by the first slice
+  // of their hashes, are built independently. The Allocator must be safe to
+  // use from several threads at once. MallocAllocator is, the slab and arena
+  // allocators aren't.
+  template <class InputIterator>
+  bool build_parallel(InputIterator first, InputIterator last, uint32_t thread_count = 0) {
+    if (thread_count == 0) {
+      thread_count = std::thread::hardware_concurrency();
     }
-    _count++;
-    return iterator(node);
+    return bulkInsert(first, last, thread_count > 0 ? thread_count : 1);
   }
 
   /*
   template <class P> pair<iterator, bool> insert(P&& obj);
   iterator insert(const_iterator hint, const value_type& obj);
   template <class P> iterator insert(const_iterator hint, P&& obj);
-  template <class InputIterator> void insert(InputIterator first, InputIterator last);
   void insert(initializer_list<value_type>);
   */
 
+  // If the HAMT is the only user of an arena allocator, the arena is reset.
   void clear() {
     _count = 0;
-    _root.asTrie().clear(_allocator);
+    deallocateTries();
+    resetArena(std::integral_constant<bool, is_arena_allocator<Allocator>::value>());
+  }
+
+  // Reallocates the base array of every trie to the exact number of nodes in
+  // it, giving back the room the sizing heuristic (see
+  // detail::hamt_trie_allocation_size()) keeps for inserts. Meant for maps
+  // that are mostly read after they are loaded: the next insert into a trie
+  // reallocates its array again. Does nothing with an arena allocator, which
+  // can't take the old arrays back.
+  void shrink_to_fit() {
+    shrinkToFit(std::integral_constant<bool, is_arena_allocator<Allocator>::value>());
   }
 
+  // Moves all the tries into a single allocation, in breadth-first order, with
+  // every base array sized for its nodes. The upper levels, which every lookup
+  // goes through, end up next to each other in a few cache lines and the
+  // whole HAMT takes as few pages as it can. Meant for maps in a read-only
+  // phase: the next change to the HAMT thaws it first. Does nothing if the
+  // image can't be allocated.
+  void freeze();
+  // Moves the tries of a frozen HAMT back to allocations of their own. Returns
+  // false, leaving the HAMT frozen, if they can't be allocated.
+  bool thaw();
+  bool frozen() const { return _image != nullptr; }
+
   // TODO: define out-of-line
   void swap(HashArrayMappedTrie &other) {
     std::swap(_count, other._count);
+    std::swap(_reserved, other._reserved);
     std::swap(_seed, other._seed);
     std::swap(_hasher, other._hasher);
     std::swap(_key_equal, other._key_equal);
     std::swap(_allocator, other._allocator);
+    std::swap(_image, other._image);
+    std::swap(_image_size, other._image_size);
     _root.swap(other._root);
   }
 
-  const Node *findNode(const Key &key) {
-    const BitmapTrie *trie = &_root.asTrie();
-    uint32_t seed = _seed;
-    uint32_t hash = hash32(key, _seed);
+  bool operator==(const HashArrayMappedTrie &other) const;
+  bool operator!=(const HashArrayMappedTrie &other) const { return !(*this == other); }
+
+  template <class K>
+  const Node *findNode(const K &key) const {
+    const BitmapTrie *trie = &_root;
+    uint64_t hash = hash64(key, _seed);
     uint32_t hash_offset = 0;
     uint32_t t = hash & 0x1f;
 
     while (trie->logicalPositionTaken(t)) {
-      const Node *node = &trie->logicalGet(t);
-      if (node->isEntry()) {
+      if (trie->logicalIsEntry(t)) {
+        const Node *node = &trie->physicalGet(trie->entryIndex(t));
         const auto &entry = node->asEntry();
         // Keys match!
-        if (_key_equal(entry.first, key)) {
+        if (hashMayMatch(entry, hash) && _key_equal(entry.first, key)) {
           return node;
         }
-        /* printf("%d -> %d\n", key, hash); */
-        /* printf("%d -> %d\n", entry.first, hash32(entry.second, seed)); */
         return nullptr;
       }
 
       // The position stores a trie. Keep searching.
-
-      if (LIKELY(hash_offset < 25)) {
-        hash_offset += 5;
-      } else {
-        hash_offset = 0;
-        seed = next_seed(seed);
-        hash = hash32(key, seed);
+      trie = &trie->physicalGet(trie->trieIndex(t)).asTrie();
+      if (UNLIKELY(hash_offset == detail::hamt_last_hash_offset)) {
+        return findCollidingNode(*trie, key, hash);
       }
-
-      trie = &node->asTrie();
+      hash_offset += 5;
       t = (hash >> hash_offset) & 0x1f;
     }
 
     return nullptr;
   }
 
-  const T *find(const Key &key) {
-    const Node *node = findNode(key);
-    if (node) {
-      return &node->asEntry().second;
-    }
-    return nullptr;
+  const T *find(const Key &key) const { return findValue(key); }
+
+  // Finds the key equal to key without constructing a Key (e.g. a string view
+  // into a buffer for std::string keys). Only available when Hash and KeyEqual
+  // are transparent: both declare `is_transparent` and accept K and Key, and
+  // Hash gives the same hash to equal K and Key values.
+  template <class K, class = EnableIfTransparent<K>>
+  const T *find(const K &key) const {
+    return findValue(key);
   }
 
-  Node *insertEntry(Node *trie_node,
-                    const Entry &new_entry,
-                    uint32_t seed,
-                    uint32_t hash,
-                    uint32_t hash_offset,
-                    uint32_t level) {
-    // Insert the entry directly in the trie if the hash_slice slot is empty.
-    uint32_t hash_slice = (hash >> hash_offset) & 0x1f;
-    BitmapTrie *trie = &trie_node->asTrie();
-    if (UNLIKELY(!trie->logicalPositionTaken(hash_slice))) {
-      return trie->insertEntry(_allocator, hash_slice, new_entry, trie_node, _count + 1, level);
+  // Stores the result of find(keys[i]) in values[i]. The lookups are
+  // interleaved: each one prefetches the next node it needs and yields to the
+  // others, so the cache misses of up to find_batch_width lookups overlap
+  // instead of being paid one after another. This pays off on HAMTs that don't
+  // fit in the cache.
+  void findBatch(ArrayRef<Key> keys, MutableArrayRef<const T *> values) const {
+    findBatchOf(keys, values);
+  }
+
+  template <class K, class = EnableIfTransparent<K>>
+  void findBatch(ArrayRef<K> keys, MutableArrayRef<const T *> values) const {
+    findBatchOf(keys, values);
+  }
+
+  // Finds key or inserts an entry constructed from args for it, and positions
+  // it at the node of the key. found is set if the key was already in the HAMT,
+  // in which case args are left untouched. Returns nullptr if the entry can't
+  // be inserted.
+  //
+  // The tries are walked down in a loop, like findNode() does. The entry is
+  // constructed from args directly in its final position, after which key
+  // isn't used anymore (args may be moving it).
+  template <class... Args>
+  Node *findOrEmplace(const Key &key, iterator &it, bool &found, Args &&... args) {
+    found = false;
+    if (UNLIKELY(!thaw())) {
+      return nullptr;
     }
+    const uint64_t hash = hash64(key, _seed);
+    BitmapTrie *trie = &_root;
+    uint32_t hash_offset = 0;
+    uint32_t level = 0;
+    // The first slot that was split to make room for the new entry. The split
+    // is undone if the entry can't be inserted after all.
+    BitmapTrie *split_trie = nullptr;
+    uint32_t split_slice = 0;
+    Node *new_node;
+
+    for (;;) {
+      if (UNLIKELY(level == detail::hamt_collision_level)) {
+        new_node =
+            insertCollidingEntry(trie, key, hash, level, it, found, std::forward<Args>(args)...);
+        break;
+      }
+
+      // Insert the entry directly in the trie if the hash_slice slot is empty.
+      const uint32_t hash_slice = (hash >> hash_offset) & 0x1f;
+      if (UNLIKELY(!trie->logicalPositionTaken(hash_slice))) {
+        new_node = emplaceEntry(
+            CacheHash(), trie, hash_slice, level, hash, std::forward<Args>(args)...);
+        if (new_node) {
+          it.set(level, *trie, trie->physicalIndexOf(new_node));
+        }
+        break;
+      }
 
-    // If the Node in hash_slice is a trie, insert recursively.
-    Node *node = &trie->logicalGet(hash_slice);
-    if (node->isTrie()) {
-      if (LIKELY(hash_offset < 25)) {
+      // If the Node in hash_slice is a trie, keep going down.
+      const uint32_t i = trie->physicalIndex(hash_slice);
+      Node *node = &trie->physicalGet(i);
+      it.set(level, *trie, i);
+      if (trie->physicalIsTrie(i)) {
+        trie = &node->asTrie();
         hash_offset += 5;
-      } else {
-        hash_offset = 0;
-        seed = next_seed(seed);
-        hash = hash32(new_entry.first, seed);
+        level++;
+        continue;
       }
-      return insertEntry(node, new_entry, seed, hash, hash_offset, level + 1);
-    }
 
-    // If the Node is an entry and the key matches, override the value.
-    Entry *old_entry = &node->asEntry();
-    if (_key_equal(old_entry->first, new_entry.first)) {
-      // Keys match! Override the value.
-      old_entry->second = std::move(new_entry.second);
-      return node;
+      // If the Node is an entry and the key matches, we're done.
+      Entry *old_entry = &node->asEntry();
+      if (hashMayMatch(*old_entry, hash) && _key_equal(old_entry->first, key)) {
+        found = true;
+        return node;
+      }
+
+      // Has to replace the entry with a trie that will contain the replaced
+      // entry and the new entry. The replaced entry goes first, it can't
+      // collide with anything in an empty trie. Entries whose hashes share all
+      // the slices meet again in a collision node.
+      const uint64_t old_entry_hash = entryHash(*old_entry);
+      Entry replaced_entry(std::move(*old_entry));
+      BitmapTrie *child = trie->entryToTrie(
+          _allocator,
+          hash_slice,
+          detail::hamt_trie_allocation_size(2, expectedSize(_count + 1), level + 1));
+      it.set(level, *trie, trie->trieIndex(hash_slice));
+
+      const uint32_t replaced_slice = level + 1 == detail::hamt_collision_level
+                                          ? 0
+                                          : (old_entry_hash >> (hash_offset + 5)) & 0x1f;
+      if (child->insertEntry(_allocator,
+                             replaced_slice,
+                             std::move(replaced_entry),
+                             expectedSize(_count + 1),
+                             level + 1) == nullptr) {
+        // Restore the old entry and give up on inserting the new one.
+        child->deallocate(_allocator);
+        trie->trieToEntry(hash_slice, std::move(replaced_entry));
+        new_node = nullptr;
+        break;
+      }
+      if (split_trie == nullptr) {
+        split_trie = trie;
+        split_slice = hash_slice;
+      }
+      trie = child;
+      hash_offset += 5;
+      level++;
     }
 
-    // Has to replace the entry with a trie.
+    if (UNLIKELY(new_node == nullptr)) {
+      if (split_trie) {
+        // Put the replaced entry back in place of the tries created for it
+        // instead of leaving a chain of single-entry tries behind.
+        collapseSingleEntryChain(split_trie, split_slice);
+      }
+      return nullptr;
+    }
+    if (!found) {
+      _count++;
+    }
+    return new_node;
+  }
 
-    uint32_t old_entry_hash;
-    if (LIKELY(hash_offset < 25)) {
-      hash_offset += 5;
-      old_entry_hash = hash32(old_entry->first, seed);
-    } else {
-      hash_offset = 0;
-      seed = next_seed(seed);
-      hash = hash32(new_entry.first, seed);
-      old_entry_hash = hash32(old_entry->first, seed);
-      if (UNLIKELY(hash == old_entry_hash)) {
+  // Does findOrEmplace() in the chain of collision nodes that starts at trie.
+  // New entries go to the last node, or to a new node chained to it if it's
+  // full.
+  template <class... Args>
+  Node *insertCollidingEntry(BitmapTrie *trie,
+                             const Key &key,
+                             uint64_t hash,
+                             uint32_t level,
+                             iterator &it,
+                             bool &found,
+                             Args &&... args) {
+    BitmapTrie *last = trie;
+    for (BitmapTrie *node = trie; node; node = node->overflowNode()) {
+      const uint32_t entry_count = node->entryCount();
+      for (uint32_t i = 0; i < entry_count; i++) {
+        const Entry &entry = node->physicalGet(i).asEntry();
+        if (hashMayMatch(entry, hash) && _key_equal(entry.first, key)) {
+          found = true;
+          it.set(level, *node, i);
+          return &node->physicalGet(i);
+        }
+      }
+      last = node;
+    }
+    if (last->entryCount() == detail::hamt_collision_node_entries) {
+      last = last->appendOverflowNode(
+          _allocator, detail::hamt_trie_allocation_size(1, expectedSize(_count + 1), level));
+      if (UNLIKELY(last == nullptr)) {
         return nullptr;
       }
     }
 
-    // This new trie will contain the replaced_entry and the new_entry.
-    Entry replaced_entry(std::move(*old_entry));
-    trie_node = node->BitmapTrie(_allocator, node->parent(), 2);
-
-    auto replaced_node =
-        insertEntry(trie_node, replaced_entry, seed, old_entry_hash, hash_offset, level + 1);
-    if (replaced_node == nullptr) {
-      // If re-inserting the old entry fail for some reason, we give uo
-      // on inserting the new entry and restore the old entry.
-      *node = std::move(replaced_entry);
-      return nullptr;
+    // Any free position will do.
+    const uint32_t logical_index = __builtin_ctz(~last->bitmap());
+    Node *new_node =
+        emplaceEntry(CacheHash(), last, logical_index, level, hash, std::forward<Args>(args)...);
+    if (new_node) {
+      it.set(level, *last, last->physicalIndexOf(new_node));
     }
-    return insertEntry(trie_node, new_entry, seed, hash, hash_offset, level + 1);
+    return new_node;
   }
 
- private:
-  Node *allocateBaseTrieArray(size_t capacity) {
-    void *ptr = _allocator.allocate(capacity * sizeof(Node), alignof(Node));
-    return static_cast<Node *>(ptr);
+  // The HAMT size the tries are sized for when the HAMT has size entries.
+  size_t expectedSize(size_t size) const { return size > _reserved ? size : _reserved; }
+
+  // Constructs an entry from args at logical_index of trie, storing the hash
+  // of its key in it if hashes are cached.
+  template <class... Args>
+  Node *emplaceEntry(std::false_type,
+                     BitmapTrie *trie,
+                     uint32_t logical_index,
+                     uint32_t level,
+                     uint64_t,
+                     Args &&... args) {
+    return trie->emplaceEntry(
+        _allocator, logical_index, expectedSize(_count + 1), level, std::forward<Args>(args)...);
   }
-
-  uint32_t next_seed(uint32_t seed) const {
-    seed ^= seed << 13;
-    seed ^= seed >> 17;
-    seed ^= seed << 5;
-    return seed;
+  template <class... Args>
+  Node *emplaceEntry(std::true_type,
+                     BitmapTrie *trie,
+                     uint32_t logical_index,
+                     uint32_t level,
+                     uint64_t hash,
+                     Args &&... args) {
+    return trie->emplaceEntry(_allocator,
+                              logical_index,
+                              expectedSize(_count + 1),
+                              level,
+                              hash,
+                              std::forward<Args>(args)...);
   }
 
-  uint32_t hash32(const Key &key, uint32_t seed) const {
-    return seed ^ _hasher(key);
+  template <class K>
+  const Node *findCollidingNode(const BitmapTrie &trie, const K &key, uint64_t hash) const {
+    for (const BitmapTrie *node = &trie; node; node = node->overflowNode()) {
+      const uint32_t entry_count = node->entryCount();
+      for (uint32_t i = 0; i < entry_count; i++) {
+        const Node *entry_node = &node->physicalGet(i);
+        if (hashMayMatch(entry_node->asEntry(), hash) &&
+            _key_equal(entry_node->asEntry().first, key)) {
+          return entry_node;
+        }
+      }
+    }
+    return nullptr;
   }
 
-#ifdef GTEST
-  // clang-format off
- PUBLIC_IN_GTEST:
-  Node & root() { return _root; }
-  // clang-format on
+  template <class K>
+  bool eraseEntry(BitmapTrie *trie,
+                  const K &key,
+                  uint64_t hash,
+                  uint32_t hash_offset,
+                  uint32_t level,
+                  size_t expected_hamt_size) {
+    if (UNLIKELY(level == detail::hamt_collision_level)) {
+      return eraseCollidingEntry(trie, key, hash, level, expected_hamt_size);
+    }
 
-  size_t countInnerNodes(BitmapTrie &trie) {
-    size_t inner_nodes_count = 0;
+    uint32_t hash_slice = (hash >> hash_offset) & 0x1f;
+    if (!trie->logicalPositionTaken(hash_slice)) {
+      return false;
+    }
 
-    for (uint32_t i = 0; i < trie.size(); i++) {
-      Node &node = trie.physicalGet(i);
-      if (node.isTrie()) {
-        inner_nodes_count += 1 + countInnerNodes(node.asTrie());
+    uint32_t i = trie->physicalIndex(hash_slice);
+    Node *node = &trie->physicalGet(i);
+    if (trie->physicalIsEntry(i)) {
+      const Entry &entry = node->asEntry();
+      if (!hashMayMatch(entry, hash) || !_key_equal(entry.first, key)) {
+        return false;
       }
+      trie->eraseEntry(_allocator, hash_slice, expected_hamt_size, level);
+      return true;
     }
 
-    return inner_nodes_count;
+    BitmapTrie *child = &node->asTrie();
+    if (!eraseEntry(child, key, hash, hash_offset + 5, level + 1, expected_hamt_size)) {
+      return false;
+    }
+
+    // A sub-trie is only created when two entries collide, so a sub-trie that is
+    // left with a single entry is collapsed back into its slot in this trie. This
+    // keeps the HAMT canonical: the shape depends only on the keys it contains.
+    if (child->size() == 1 && child->physicalIsEntry(0)) {
+      collapseSingleEntryTrie(trie, hash_slice);
+    }
+    return true;
   }
 
-  void print() {
-    /* size_t inner_nodes_count = countInnerNodes(_root); */
-    /* _allocator.dump(_count, inner_nodes_count); */
-    /* printf("%zu, %zu, %zu\n", _count, _allocator._total_allocated,
-     * _allocator._total_in_free_lists); */
+  // Does eraseEntry() in the chain of collision nodes that starts at trie.
+  template <class K>
+  bool eraseCollidingEntry(BitmapTrie *trie,
+                           const K &key,
+                           uint64_t hash,
+                           uint32_t level,
+                           size_t expected_hamt_size) {
+    for (BitmapTrie *node = trie; node; node = node->overflowNode()) {
+      const uint32_t entry_count = node->entryCount();
+      for (uint32_t i = 0; i < entry_count; i++) {
+        const Entry &entry = node->physicalGet(i).asEntry();
+        if (hashMayMatch(entry, hash) && _key_equal(entry.first, key)) {
+          trie->eraseCollidingEntry(_allocator, node, i, expected_hamt_size, level);
+          return true;
+        }
+      }
+    }
+    return false;
   }
-#endif  // GTEST
-};
 
-namespace detail {
+  // Replaces the chain of tries at logical_index, in which every trie holds
+  // only the next one and the last one holds a single entry, with the entry.
+  void collapseSingleEntryChain(BitmapTrie *trie, uint32_t logical_index) {
+    for (;;) {
+      BitmapTrie *parent = trie;
+      uint32_t slice = logical_index;
+      BitmapTrie *child = &parent->logicalGet(slice).asTrie();
+      while (child->physicalIsTrie(0)) {
+        parent = child;
+        slice = __builtin_ctz(child->bitmap());
+        child = &parent->logicalGet(slice).asTrie();
+      }
+      collapseSingleEntryTrie(parent, slice);
+      if (parent == trie) {
+        return;
+      }
+    }
+  }
+
+  // Replaces the trie at logical_index, which contains a single entry, with the
+  // entry itself.
+  void collapseSingleEntryTrie(BitmapTrie *trie, uint32_t logical_index) {
+    BitmapTrie *child = &trie->logicalGet(logical_index).asTrie();
+    assert(child->size() == 1 && child->physicalIsEntry(0));
+    Entry entry(std::move(child->physicalGet(0).asEntry()));
+    child->physicalGet(0).asEntry().~Entry();
+    child->deallocate(_allocator);
+    trie->trieToEntry(logical_index, std::move(entry));
+  }
+
+ private:
+  template <class K>
+  const T *findValue(const K &key) const {
+    const Node *node = findNode(key);
+    if (node) {
+      return &node->asEntry().second;
+    }
+    return nullptr;
+  }
+
+  template <class K>
+  size_type eraseKey(const K &key) {
+    if (UNLIKELY(!thaw())) {
+      return 0;
+    }
+    uint64_t hash = hash64(key, _seed);
+    // The shrinking decisions are made for the size the HAMT will have after
+    // the erase, which is the common case of the key being present.
+    size_t expected_hamt_size = expectedSize(_count > 1 ? _count - 1 : 1);
+    if (eraseEntry(&_root, key, hash, 0, 0, expected_hamt_size)) {
+      _count--;
+      return 1;
+    }
+    return 0;
+  }
+
+  template <class K>
+  void findBatchOf(ArrayRef<K> keys, MutableArrayRef<const T *> values) const;
+
+  // emplace() {{{
+
+  template <class K>
+  using IsKey = std::is_same<typename std::decay<K>::type, Key>;
+
+  template <class K, class V>
+  std::pair<iterator, bool> emplaceArgs(K &&key, V &&value) {
+    return emplaceKeyAndValue(IsKey<K>(), std::forward<K>(key), std::forward<V>(value));
+  }
+  template <class P>
+  std::pair<iterator, bool> emplaceArgs(P &&entry) {
+    return emplacePair(detail::hamt_is_pair<typename std::decay<P>::type>(),
+                       std::forward<P>(entry));
+  }
+  template <class... Args>
+  std::pair<iterator, bool> emplaceArgs(Args &&... args) {
+    std::pair<Key, T> entry(std::forward<Args>(args)...);
+    iterator it;
+    bool found;
+    Node *node = findOrEmplace(entry.first, it, found, std::move(entry));
+    return std::make_pair(node ? it : end(), node && !found);
+  }
+
+  template <class K, class V>
+  std::pair<iterator, bool> emplaceKeyAndValue(std::true_type, K &&key, V &&value) {
+    iterator it;
+    bool found;
+    Node *node = findOrEmplace(key, it, found, std::forward<K>(key), std::forward<V>(value));
+    return std::make_pair(node ? it : end(), node && !found);
+  }
+  template <class K, class V>
+  std::pair<iterator, bool> emplaceKeyAndValue(std::false_type, K &&key, V &&value) {
+    Key converted_key(std::forward<K>(key));
+    return emplaceKeyAndValue(std::true_type(), std::move(converted_key), std::forward<V>(value));
+  }
+
+  template <class P>
+  std::pair<iterator, bool> emplacePair(std::true_type, P &&entry) {
+    return emplaceArgs(std::get<0>(std::forward<P>(entry)), std::get<1>(std::forward<P>(entry)));
+  }
+  template <class P>
+  std::pair<iterator, bool> emplacePair(std::false_type, P &&entry) {
+    std::pair<Key, T> constructed(std::forward<P>(entry));
+    return emplacePair(std::true_type(), std::move(constructed));
+  }
+
+  // }}}
+
+  // Bulk building {{{
+
+  // Key (by index into the staged entries) and its hash.
+  struct BulkEntry {
+    uint64_t hash;
+    size_t index;
+  };
+
+  // Number of entries hashed by a task of build_parallel().
+  static const size_t bulk_hash_chunk = 64 * 1024;
+
+  template <class InputIterator>
+  bool bulkInsert(InputIterator first, InputIterator last, uint32_t thread_count);
+
+  // Allocates trie, at depth level, and its sub-tries for the n entries in
+  // items (which share the slices of the previous levels) and sets count to the
+  // number of entries in it. The slots of the entries are left holding their
+  // items for placeEntries(), so nothing is moved out of entries until all the
+  // tries are allocated. scratch has room for n items. The sub-tries of trie
+  // are built on thread_count threads. The recursion is bounded by
+  // hamt_max_depth.
+  //
+  // Returns false, leaving trie empty and without a base array, if an
+  // allocation fails.
+  bool buildTrie(BitmapTrie *trie,
+                 const std::vector<std::pair<Key, T>> &entries,
+                 BulkEntry *items,
+                 BulkEntry *scratch,
+                 size_t n,
+                 uint32_t level,
+                 size_t expected_hamt_size,
+                 uint32_t thread_count,
+                 size_t &count);
+  // Deallocates the base arrays of a trie built by buildTrie() and of its
+  // sub-tries before the entries are placed.
+  void deallocateBuiltTrie(BitmapTrie *trie);
+  // Replaces the items left in the slots of the entries of trie and of its
+  // sub-tries with the entries they refer to. The sub-tries are filled on
+  // thread_count threads.
+  void placeEntries(BitmapTrie *trie,
+                    std::vector<std::pair<Key, T>> &entries,
+                    uint32_t thread_count);
+  // Does placeEntries() for the entries of trie but not for its sub-tries.
+  void placeOwnEntries(BitmapTrie *trie, std::vector<std::pair<Key, T>> &entries) {
+    const uint32_t entry_count = trie->entryCount();
+    for (uint32_t i = 0; i < entry_count; i++) {
+      const BulkEntry item = slotItem(trie->physicalGet(i));
+      constructEntry(CacheHash(),
+                     &trie->physicalGet(i).asEntry(),
+                     item.hash,
+                     std::move(entries[item.index]));
+    }
+  }
+
+  static BulkEntry &slotItem(Node &node) { return *reinterpret_cast<BulkEntry *>(&node); }
+
+  // Keeps only the last occurrence of every key in items and returns how many
+  // items are left.
+  size_t dedupeKeys(const std::vector<std::pair<Key, T>> &entries, BulkEntry *items, size_t n);
+
+  template <class... Args>
+  static void constructEntry(std::false_type, Entry *entry, uint64_t, Args &&... args) {
+    new (entry) Entry(std::forward<Args>(args)...);
+  }
+  template <class... Args>
+  static void constructEntry(std::true_type, Entry *entry, uint64_t hash, Args &&... args) {
+    new (entry) Entry(hash, std::forward<Args>(args)...);
+  }
+
+  // }}}
+
+  // Number of lookups in flight in findBatch().
+  static const uint32_t find_batch_width = 16;
+
+  // State of a lookup in findBatch(). node was prefetched and is the next node
+  // to visit. When hash_offset is past the last slice, trie is the collision
+  // node with node as its first node.
+  struct BatchProbe {
+    const BitmapTrie *trie;
+    const Node *node;
+    uint64_t hash;
+    uint32_t hash_offset;
+    bool node_is_entry;
+    size_t index;
+  };
+
+  // Starts the lookup of keys[i]. Returns false if it already finished.
+  template <class K>
+  bool startProbe(BatchProbe &probe,
+                  ArrayRef<K> keys,
+                  size_t i,
+                  MutableArrayRef<const T *> values) const;
+  // Visits the prefetched node and moves to the next level. Returns false if
+  // the lookup finished.
+  template <class K>
+  bool advanceProbe(BatchProbe &probe,
+                    ArrayRef<K> keys,
+                    MutableArrayRef<const T *> values) const;
+  // Prefetches the node of trie at slice hash_offset of the hash. Returns false
+  // if the position is empty.
+  bool prefetchProbe(BatchProbe &probe, const BitmapTrie *trie) const {
+    const uint32_t t = (probe.hash >> probe.hash_offset) & 0x1f;
+    if (!trie->logicalPositionTaken(t)) {
+      return false;
+    }
+    probe.node = &trie->logicalGet(t);
+    probe.node_is_entry = trie->logicalIsEntry(t);
+    PREFETCH(probe.node);
+    return true;
+  }
+
+  void resetArena(std::true_type) {
+    if (!_allocator.shared()) {
+      _allocator.reset();
+    }
+  }
+  void resetArena(std::false_type) {}
+
+  void shrinkToFit(std::true_type) {}
+  void shrinkToFit(std::false_type) {
+    // The arrays of a frozen HAMT already fit their nodes.
+    if (!frozen()) {
+      _root.shrinkToFitRecursively(_allocator);
+    }
+  }
+
+  // Destroys the entries and gives back the memory of the tries, leaving an
+  // empty _root without a base array.
+  void deallocateTries() {
+    if (frozen()) {
+      _root.destroyEntriesRecursively(_allocator);
+      _allocator.deallocate(_image, _image_size);
+      _image = nullptr;
+      _image_size = 0;
+    }
+    _root.clear(_allocator);
+  }
+
+  // clang-format off
+ PUBLIC_IN_GTEST:
+  // clang-format on
+  template <class K>
+  uint64_t hash64(const K &key, uint64_t seed) const {
+    return detail::hamt_mix_hash(seed ^ static_cast<uint64_t>(_hasher(key)));
+  }
+
+  // Hash of the key of an entry in the trie. Uses the cached hash if possible.
+  uint64_t entryHash(const Entry &entry) const {
+    uint64_t hash;
+    if (EntryTraits::cachedHash(entry, &hash)) {
+      return hash;
+    }
+    return hash64(entry.first, _seed);
+  }
+
+  // False if the hash cached in entry shows that it can't have the key with
+  // this hash.
+  bool hashMayMatch(const Entry &entry, uint64_t hash) const {
+    return EntryTraits::hashMayMatch(entry, hash);
+  }
+
+#ifdef GTEST
+  // clang-format off
+ PUBLIC_IN_GTEST:
+  BitmapTrie & root() { return _root; }
+  // clang-format on
+
+  size_t countInnerNodes(BitmapTrie &trie) {
+    size_t inner_nodes_count = 0;
+
+    for (uint32_t i = 0; i < trie.size(); i++) {
+      if (trie.physicalIsTrie(i)) {
+        inner_nodes_count += 1 + countInnerNodes(trie.physicalGet(i).asTrie());
+      }
+    }
+
+    return inner_nodes_count;
+  }
+
+  void print() {
+    /* size_t inner_nodes_count = countInnerNodes(_root); */
+    /* _allocator.dump(_count, inner_nodes_count); */
+    /* printf("%zu, %zu, %zu\n", _count, _allocator._total_allocated,
+     * _allocator._total_in_free_lists); */
+  }
+#endif  // GTEST
+};
+
+namespace detail {
 
 #ifdef HAMT_IMPLEMENTATION
 
@@ -614,23 +1687,26 @@ uint32_t hamt_trie_allocation_size(uint32_t required, size_t expected_hamt_size,
 // BitmapTrieTemplate {{{
 
 template <class Entry, class Allocator>
-NodeTemplate<Entry, Allocator> *BitmapTrieTemplate<Entry, Allocator>::insertEntry(
+template <class... Args>
+NodeTemplate<Entry, Allocator> *BitmapTrieTemplate<Entry, Allocator>::emplaceEntry(
     Allocator &allocator,
     int logical_index,
-    const Entry &new_entry,
-    Node *parent,
     size_t expected_hamt_size,
-    uint32_t level) {
-  const uint32_t i = physicalIndex(logical_index);
+    uint32_t level,
+    Args &&... args) {
+  assert(!logicalPositionTaken(logical_index) && "Logical index should be empty");
+  const uint32_t i = entryIndex(logical_index);
+  const uint32_t entry_count = this->entryCount();
   const uint32_t sz = this->size();
 
+  // All the nodes after the new entry (including every sub-trie) are moved one
+  // position to the back.
   uint32_t required = sz + 1;
   assert(required <= 32);
-  if (required > _capacity) {
+  if (required > capacity()) {
     size_t alloc_size = hamt_trie_allocation_size(required, expected_hamt_size, level);
 
-    Node *new_base =
-        static_cast<Node *>(allocator.allocate(alloc_size * sizeof(Node), alignof(Node)));
+    Node *new_base = allocateBase(allocator, alloc_size);
     if (new_base == nullptr) {
       return nullptr;
     }
@@ -638,50 +1714,273 @@ NodeTemplate<Entry, Allocator> *BitmapTrieTemplate<Entry, Allocator>::insertEntr
     if (UNLIKELY(_base == nullptr)) {
       assert(i == 0);
       _base = new_base;
-      _capacity = alloc_size;
     } else {
       for (uint32_t j = 0; j < i; j++) {
-        new_base[j] = std::move(_base[j]);
+        relocate(&new_base[j], &_base[j], true);
       }
       for (uint32_t j = i + 1; j <= sz; j++) {
-        new_base[j] = std::move(_base[j - 1]);
+        relocate(&new_base[j], &_base[j - 1], j - 1 < entry_count);
       }
 
-      allocator.deallocate(_base, _capacity);
+      deallocateBase(allocator, _base);
       _base = new_base;
-      _capacity = alloc_size;
     }
   } else {
     for (int32_t j = (int32_t)sz; j > (int32_t)i; j--) {
-      _base[j] = std::move(_base[j - 1]);
+      relocate(&_base[j], &_base[j - 1], (uint32_t)j - 1 < entry_count);
     }
   }
 
   // Mark position as used
-  assert((_bitmap & (0x1 << logical_index)) == 0 && "Logical index should be empty");
-  _bitmap |= 0x1 << logical_index;
+  _datamap |= 0x1U << logical_index;
 
   // Insert at allocated position
-  return new (&_base[i]) Node(new_entry, parent);
+  new (&_base[i].asEntry()) Entry(std::forward<Args>(args)...);
+  return &_base[i];
 }
 
-#ifdef GTEST
+template <class Entry, class Allocator>
+void BitmapTrieTemplate<Entry, Allocator>::eraseEntry(Allocator &allocator,
+                                                      int logical_index,
+                                                      size_t expected_hamt_size,
+                                                      uint32_t level) {
+  assert(logicalIsEntry(logical_index) && "Node should be an entry");
+  const uint32_t i = entryIndex(logical_index);
+  const uint32_t entry_count = this->entryCount();
+  const uint32_t sz = this->size() - 1;
+
+  _base[i].asEntry().~Entry();
+  _datamap &= ~(0x1U << logical_index);
+
+  if (sz == 0) {
+    deallocate(allocator);
+    _base = nullptr;
+    return;
+  }
+
+  // Shrink only when the nodes would still fit the smaller size class after
+  // another insertion. Otherwise alternating inserts and erases on the boundary
+  // of a size class would reallocate the array every time.
+  if (hamt_trie_allocation_size(sz + 1, expected_hamt_size, level) < capacity()) {
+    size_t alloc_size = hamt_trie_allocation_size(sz, expected_hamt_size, level);
+
+    Node *new_base = allocateBase(allocator, alloc_size);
+    if (new_base != nullptr) {
+      for (uint32_t j = 0; j < i; j++) {
+        relocate(&new_base[j], &_base[j], true);
+      }
+      for (uint32_t j = i; j < sz; j++) {
+        relocate(&new_base[j], &_base[j + 1], j + 1 < entry_count);
+      }
+
+      deallocateBase(allocator, _base);
+      _base = new_base;
+      return;
+    }
+    // If the smaller array can't be allocated, keep using the current one.
+  }
+
+  for (uint32_t j = i; j < sz; j++) {
+    relocate(&_base[j], &_base[j + 1], j + 1 < entry_count);
+  }
+}
+
+template <class Entry, class Allocator>
+bool BitmapTrieTemplate<Entry, Allocator>::grow(Allocator &allocator, uint32_t capacity) {
+  if (capacity <= this->capacity()) {
+    return true;
+  }
+  Node *new_base = allocateBase(allocator, capacity);
+  if (new_base == nullptr) {
+    return false;
+  }
+  if (_base) {
+    const uint32_t entry_count = this->entryCount();
+    const uint32_t sz = this->size();
+    for (uint32_t j = 0; j < sz; j++) {
+      relocate(&new_base[j], &_base[j], j < entry_count);
+    }
+    deallocateBase(allocator, _base);
+  }
+  _base = new_base;
+  return true;
+}
+
+template <class Entry, class Allocator>
+void BitmapTrieTemplate<Entry, Allocator>::shrinkToFitRecursively(Allocator &allocator) {
+  // Pre-order traversal. The sub-tries are visited after they're moved to the
+  // new base array of their parent.
+  std::stack<BitmapTrieTemplate *> stack;
+  stack.push(this);
+  while (!stack.empty()) {
+    BitmapTrieTemplate *trie = stack.top();
+    stack.pop();
+    const uint32_t sz = trie->size();
+    if (sz == 0) {
+      // Only the root can be empty.
+      trie->deallocate(allocator);
+      trie->_base = nullptr;
+      continue;
+    }
+    if (sz < trie->capacity()) {
+      Node *new_base = allocateBase(allocator, sz);
+      if (new_base) {
+        const uint32_t entry_count = trie->entryCount();
+        for (uint32_t j = 0; j < sz; j++) {
+          relocate(&new_base[j], &trie->_base[j], j < entry_count);
+        }
+        deallocateBase(allocator, trie->_base);
+        trie->_base = new_base;
+      }
+    }
+    for (uint32_t j = trie->entryCount(); j < sz; j++) {
+      stack.push(&trie->_base[j].asTrie());
+    }
+  }
+}
+
+template <class Entry, class Allocator>
+size_t BitmapTrieTemplate<Entry, Allocator>::fittedSizeRecursively() const {
+  std::stack<const BitmapTrieTemplate *> stack;
+  stack.push(this);
+  size_t size = 0;
+  while (!stack.empty()) {
+    const BitmapTrieTemplate *trie = stack.top();
+    stack.pop();
+    const uint32_t sz = trie->size();
+    if (sz > 0) {
+      size += allocationSize(sz);
+    }
+    for (uint32_t j = trie->entryCount(); j < sz; j++) {
+      stack.push(&trie->_base[j].asTrie());
+    }
+  }
+  return size;
+}
+
+template <class Entry, class Allocator>
+bool BitmapTrieTemplate<Entry, Allocator>::relocateBreadthFirst(Allocator &allocator,
+                                                                char *image,
+                                                                bool from_image) {
+  // Without an image, all the arrays are allocated, in the order they are
+  // used below, before any node is moved.
+  std::vector<Node *> bases;
+  if (image == nullptr) {
+    std::queue<const BitmapTrieTemplate *> queue;
+    queue.push(this);
+    while (!queue.empty()) {
+      const BitmapTrieTemplate *trie = queue.front();
+      queue.pop();
+      const uint32_t sz = trie->size();
+      if (sz == 0) {
+        continue;
+      }
+      Node *base = allocateBase(allocator, sz);
+      if (base == nullptr) {
+        for (Node *allocated : bases) {
+          deallocateBase(allocator, allocated);
+        }
+        return false;
+      }
+      bases.push_back(base);
+      for (uint32_t j = trie->entryCount(); j < sz; j++) {
+        queue.push(&trie->_base[j].asTrie());
+      }
+    }
+  }
+
+  // The sub-tries are visited after they're moved to the new base array of
+  // their parent.
+  std::queue<BitmapTrieTemplate *> queue;
+  queue.push(this);
+  size_t next_base = 0;
+  while (!queue.empty()) {
+    BitmapTrieTemplate *trie = queue.front();
+    queue.pop();
+    const uint32_t sz = trie->size();
+    Node *new_base = nullptr;
+    if (sz > 0) {
+      if (image) {
+        new_base = constructBase(image, sz);
+        image += allocationSize(sz);
+      } else {
+        new_base = bases[next_base++];
+      }
+      const uint32_t entry_count = trie->entryCount();
+      for (uint32_t j = 0; j < sz; j++) {
+        relocate(&new_base[j], &trie->_base[j], j < entry_count);
+      }
+    }
+    if (!from_image) {
+      trie->deallocate(allocator);
+    }
+    trie->_base = new_base;
+    for (uint32_t j = trie->entryCount(); j < sz; j++) {
+      queue.push(&new_base[j].asTrie());
+    }
+  }
+  return true;
+}
+
+template <class Entry, class Allocator>
+BitmapTrieTemplate<Entry, Allocator> *BitmapTrieTemplate<Entry, Allocator>::entryToTrie(
+    Allocator &allocator, int logical_index, uint32_t capacity) {
+  assert(logicalIsEntry(logical_index) && "Node should be an entry");
+  const uint32_t i = entryIndex(logical_index);
+  const uint32_t entry_count = this->entryCount();
+  _base[i].asEntry().~Entry();
+
+  _datamap &= ~(0x1U << logical_index);
+  _nodemap |= 0x1U << logical_index;
+  const uint32_t t = trieIndex(logical_index);
+
+  // The nodes between the entry and the new position of the trie are moved one
+  // position to the front.
+  for (uint32_t j = i; j < t; j++) {
+    relocate(&_base[j], &_base[j + 1], j + 1 < entry_count);
+  }
+  return _base[t].BitmapTrie(allocator, capacity);
+}
 
 template <class Entry, class Allocator>
-NodeTemplate<Entry, Allocator> *BitmapTrieTemplate<Entry, Allocator>::insertTrie(
-    Allocator &allocator, Node *parent, int logical_index, uint32_t capacity) {
-  assert(_capacity > size());
+NodeTemplate<Entry, Allocator> *BitmapTrieTemplate<Entry, Allocator>::trieToEntry(int logical_index,
+                                                                                  Entry &&entry) {
+  assert(logicalIsTrie(logical_index) && "Node should be a trie");
+  const uint32_t t = trieIndex(logical_index);
+  const uint32_t i = entryIndex(logical_index);
+  const uint32_t entry_count = this->entryCount();
+
+  // The nodes between the new position of the entry and the trie are moved one
+  // position to the back.
+  for (uint32_t j = t; j > i; j--) {
+    relocate(&_base[j], &_base[j - 1], j - 1 < entry_count);
+  }
+
+  _nodemap &= ~(0x1U << logical_index);
+  _datamap |= 0x1U << logical_index;
+  return new (&_base[i]) Node(std::move(entry));
+}
+
+#ifdef GTEST
 
-  const int i = physicalIndex(logical_index);
-  for (int j = (int)size(); j > i; j--) {
-    _base[j] = std::move(_base[j - 1]);
+template <class Entry, class Allocator>
+BitmapTrieTemplate<Entry, Allocator> *BitmapTrieTemplate<Entry, Allocator>::insertTrie(
+    Allocator &allocator, int logical_index, uint32_t capacity) {
+  assert(this->capacity() > size());
+  assert(!logicalPositionTaken(logical_index) && "Logical index should be empty");
+
+  // The sub-tries that come before the new one in logical order are at the back
+  // of the array and are moved one position further back.
+  const uint32_t sz = size();
+  const uint32_t t = sz - __builtin_popcount(_nodemap & ((0x1U << logical_index) - 1));
+  for (uint32_t j = sz; j > t; j--) {
+    relocate(&_base[j], &_base[j - 1], false);
   }
 
   // Mark position as used
-  assert((_bitmap & (0x1 << logical_index)) == 0 && "Logical index should be empty");
-  _bitmap |= 0x1 << logical_index;
+  _nodemap |= 0x1U << logical_index;
 
-  return _base[i].BitmapTrie(allocator, parent, capacity);
+  return _base[t].BitmapTrie(allocator, capacity);
 }
 
 #endif  // GTEST
@@ -693,22 +1992,181 @@ const NodeTemplate<Entry, Allocator>
   assert(trie->size() > 0);
   for (;;) {
     const Node &node = trie->physicalGet(0);
-    if (node.isEntry()) {
+    if (trie->physicalIsEntry(0)) {
       return &node;
     }
     trie = &node.asTrie();
   }
 }
 
+template <class Entry, class Allocator>
+BitmapTrieTemplate<Entry, Allocator> *BitmapTrieTemplate<Entry, Allocator>::appendOverflowNode(
+    Allocator &allocator, uint32_t capacity) {
+  assert(_nodemap == 0 && entryCount() == hamt_collision_node_entries);
+  const uint32_t sz = size();
+  if (sz == this->capacity()) {
+    Node *new_base = allocateBase(allocator, sz + 1);
+    if (new_base == nullptr) {
+      return nullptr;
+    }
+    for (uint32_t j = 0; j < sz; j++) {
+      relocate(&new_base[j], &_base[j], true);
+    }
+    deallocateBase(allocator, _base);
+    _base = new_base;
+  }
+  BitmapTrieTemplate *node = _base[sz].BitmapTrie(allocator, capacity);
+  if (node->_base == nullptr) {
+    return nullptr;
+  }
+  _nodemap = 0x1U << 31;
+  return node;
+}
+
+template <class Entry, class Allocator>
+void BitmapTrieTemplate<Entry, Allocator>::removeOverflowNode(Allocator &allocator) {
+  BitmapTrieTemplate *node = overflowNode();
+  assert(node && node->size() == 0);
+  node->deallocate(allocator);
+  _nodemap = 0;
+}
+
+template <class Entry, class Allocator>
+void BitmapTrieTemplate<Entry, Allocator>::eraseCollidingEntry(Allocator &allocator,
+                                                               BitmapTrieTemplate *node,
+                                                               uint32_t i,
+                                                               size_t expected_hamt_size,
+                                                               uint32_t level) {
+  BitmapTrieTemplate *parent = nullptr;
+  BitmapTrieTemplate *last = this;
+  while (last->_nodemap) {
+    parent = last;
+    last = last->overflowNode();
+  }
+  if (last != node) {
+    const uint32_t last_index = last->entryCount() - 1;
+    Node *hole = &node->_base[i];
+    hole->asEntry().~Entry();
+    new (hole) Node(std::move(last->_base[last_index].asEntry()));
+    i = last_index;
+  }
+  // The logical position of the entry is the position of the i-th bit set.
+  uint32_t datamap = last->_datamap;
+  for (uint32_t j = 0; j < i; j++) {
+    datamap &= datamap - 1;
+  }
+  last->eraseEntry(allocator, __builtin_ctz(datamap), expected_hamt_size, level);
+  if (parent && last->size() == 0) {
+    parent->removeOverflowNode(allocator);
+  }
+}
+
+template <class Entry, class Allocator>
+template <class EntryEqual>
+bool BitmapTrieTemplate<Entry, Allocator>::equalsRecursively(const BitmapTrieTemplate &other,
+                                                             const EntryEqual &entry_equal,
+                                                             uint32_t level) const {
+  if (_base == other._base) {
+    // Shared between versions of a persistent HAMT (or both empty).
+    return _datamap == other._datamap && _nodemap == other._nodemap;
+  }
+  if (level == hamt_collision_level) {
+    // Only entries down here, in chains of collision nodes, in no particular
+    // order. Every entry has a different key, so it's enough to find a match
+    // for each of them.
+    size_t entry_count = 0;
+    for (const BitmapTrieTemplate *node = this; node; node = node->overflowNode()) {
+      entry_count += node->entryCount();
+    }
+    for (const BitmapTrieTemplate *node = &other; node; node = node->overflowNode()) {
+      if (entry_count < node->entryCount()) {
+        return false;
+      }
+      entry_count -= node->entryCount();
+    }
+    if (entry_count != 0) {
+      return false;
+    }
+    for (const BitmapTrieTemplate *node = this; node; node = node->overflowNode()) {
+      for (uint32_t i = 0; i < node->entryCount(); i++) {
+        bool matched = false;
+        for (const BitmapTrieTemplate *match = &other; match && !matched;
+             match = match->overflowNode()) {
+          for (uint32_t j = 0; j < match->entryCount() && !matched; j++) {
+            matched = entry_equal(node->_base[i].asEntry(), match->_base[j].asEntry());
+          }
+        }
+        if (!matched) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+  if (_datamap != other._datamap || _nodemap != other._nodemap) {
+    return false;
+  }
+  const uint32_t entry_count = entryCount();
+  for (uint32_t i = 0; i < entry_count; i++) {
+    if (!entry_equal(_base[i].asEntry(), other._base[i].asEntry())) {
+      return false;
+    }
+  }
+  // The recursion is bounded by hamt_max_depth.
+  const uint32_t sz = size();
+  for (uint32_t i = entry_count; i < sz; i++) {
+    if (!_base[i].asTrie().equalsRecursively(other._base[i].asTrie(), entry_equal, level + 1)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+template <class Entry, class Allocator>
+NodeTemplate<Entry, Allocator> *BitmapTrieTemplate<Entry, Allocator>::allocateBase(
+    Allocator &allocator, uint32_t capacity) {
+  void *ptr = allocator.allocate(allocationSize(capacity), alignof(Node));
+  if (ptr == nullptr) {
+    return nullptr;
+  }
+  return constructBase(ptr, capacity);
+}
+
+template <class Entry, class Allocator>
+NodeTemplate<Entry, Allocator> *BitmapTrieTemplate<Entry, Allocator>::constructBase(
+    void *ptr, uint32_t capacity) {
+  BaseHeader *header = new (ptr) BaseHeader;
+  header->capacity = capacity;
+  header->refcount.store(1, std::memory_order_relaxed);
+  return reinterpret_cast<Node *>(static_cast<char *>(ptr) + headerSize());
+}
+
+template <class Entry, class Allocator>
+void BitmapTrieTemplate<Entry, Allocator>::deallocateBase(Allocator &allocator, Node *base) {
+  char *ptr = reinterpret_cast<char *>(base) - headerSize();
+  uint32_t capacity = reinterpret_cast<BaseHeader *>(ptr)->capacity;
+  allocator.deallocate(ptr, allocationSize(capacity));
+}
+
+template <class Entry, class Allocator>
+void BitmapTrieTemplate<Entry, Allocator>::relocate(Node *dest, Node *src, bool is_entry) {
+  if (is_entry) {
+    new (&dest->asEntry()) Entry(std::move(src->asEntry()));
+    src->asEntry().~Entry();
+  } else {
+    new (&dest->asTrie()) BitmapTrieTemplate(std::move(src->asTrie()));
+  }
+}
+
 template <class Entry, class Allocator>
 NodeTemplate<Entry, Allocator> *BitmapTrieTemplate<Entry, Allocator>::allocate(Allocator &allocator,
                                                                                uint32_t capacity) {
-  _capacity = capacity;
-  _bitmap = 0;
+  _datamap = 0;
+  _nodemap = 0;
   if (capacity == 0) {
     _base = nullptr;
   } else {
-    _base = static_cast<Node *>(allocator.allocate(capacity * sizeof(Node), alignof(Node)));
+    _base = allocateBase(allocator, capacity);
   }
   return _base;
 }
@@ -716,118 +2174,194 @@ NodeTemplate<Entry, Allocator> *BitmapTrieTemplate<Entry, Allocator>::allocate(A
 template <class Entry, class Allocator>
 void BitmapTrieTemplate<Entry, Allocator>::deallocate(Allocator &allocator) {
   if (_base) {
-    allocator.deallocate(_base, _capacity);
+    deallocateBase(allocator, _base);
   }
 }
 
 template <class Entry, class Allocator>
 void BitmapTrieTemplate<Entry, Allocator>::deallocateRecursively(Allocator &allocator) noexcept {
-  // Maximum stack size: 1/5 * log2(hamt.size()) * O(32)
-  std::stack<BitmapTrieTemplate> stack;
-  stack.push(std::move(*this));
+  // An arena frees the base arrays by itself and entries that are trivially
+  // destructible don't need to be visited.
+  deallocateRecursively(
+      allocator,
+      std::integral_constant<bool,
+                             is_arena_allocator<Allocator>::value &&
+                                 std::is_trivially_destructible<Entry>::value>());
+  _base = nullptr;
+}
 
-  while (!stack.empty()) {
-    BitmapTrieTemplate trie(std::move(stack.top()));
-    stack.pop();
+template <class Entry, class Allocator>
+void BitmapTrieTemplate<Entry, Allocator>::deallocateRecursively(
+    Allocator &allocator, std::false_type, bool deallocate_arrays) noexcept {
+  if (_base == nullptr) {
+    return;
+  }
 
-    uint32_t trie_size = trie.size();
-    if (trie_size) {
-      for (int i = trie_size - 1; i >= 0; i--) {
-        Node *node = &trie.physicalGet(i);
-        if (node->isEntry()) {
-          node->asEntry().~Entry();
-        } else {
-          stack.push(std::move(node->asTrie()));
-        }
+  // Post-order traversal with a cursor per level. Every trie is deallocated
+  // after its sub-tries, which live in its base array.
+  struct Cursor {
+    BitmapTrieTemplate *trie;
+    uint32_t i;
+  };
+  Cursor stack[hamt_max_depth];
+  int32_t level = 0;
+  stack[0].trie = this;
+  stack[0].i = destroyEntries();
+
+  while (level >= 0) {
+    Cursor &cursor = stack[level];
+    if (cursor.i < cursor.trie->size()) {
+      BitmapTrieTemplate *child = &cursor.trie->_base[cursor.i++].asTrie();
+      if (level + 1 == (int32_t)hamt_max_depth) {
+        // Only the overflow nodes of collision nodes are this deep.
+        child->deallocateOverflowChain(allocator, deallocate_arrays);
+        continue;
+      }
+      level++;
+      assert(level < (int32_t)hamt_max_depth);
+      stack[level].trie = child;
+      stack[level].i = child->destroyEntries();
+    } else {
+      if (deallocate_arrays) {
+        cursor.trie->deallocate(allocator);
+      }
+      level--;
+    }
+  }
+}
+
+template <class Entry, class Allocator>
+void BitmapTrieTemplate<Entry, Allocator>::deallocateOverflowChain(
+    Allocator &allocator, bool deallocate_arrays) noexcept {
+  // Every node is moved out of the base array of the previous one, which may be
+  // deallocated first.
+  BitmapTrieTemplate node(std::move(*this));
+  for (;;) {
+    node.destroyEntries();
+    BitmapTrieTemplate *next = node.overflowNode();
+    if (next == nullptr) {
+      if (deallocate_arrays) {
+        node.deallocate(allocator);
       }
+      return;
+    }
+    BitmapTrieTemplate next_node(std::move(*next));
+    if (deallocate_arrays) {
+      node.deallocate(allocator);
     }
-    trie.deallocate(allocator);
+    node = std::move(next_node);
   }
 }
 
+template <class Entry, class Allocator>
+uint32_t BitmapTrieTemplate<Entry, Allocator>::destroyEntries() noexcept {
+  const uint32_t entry_count = entryCount();
+  for (uint32_t i = 0; i < entry_count; i++) {
+    _base[i].asEntry().~Entry();
+  }
+  return entry_count;
+}
+
 template <class Entry, class Allocator>
 void BitmapTrieTemplate<Entry, Allocator>::cloneRecursively(Allocator &allocator,
-                                                            BitmapTrieTemplate &root) {
+                                                            const BitmapTrieTemplate &root) {
   // Stack of pair<destination, source>
-  std::stack<std::pair<BitmapTrieTemplate *, BitmapTrieTemplate *>> stack;
-  stack.push(this, &root);
+  std::stack<std::pair<BitmapTrieTemplate *, const BitmapTrieTemplate *>> stack;
+  stack.push(std::make_pair(this, &root));
 
   while (!stack.empty()) {
     auto pair = stack.top();
     stack.pop();
     BitmapTrieTemplate *dest = pair.first;
-    BitmapTrieTemplate *source = pair.second;
+    const BitmapTrieTemplate *source = pair.second;
 
     dest->allocate(allocator, source->capacity());
+    dest->_datamap = source->_datamap;
+    dest->_nodemap = source->_nodemap;
 
     int source_size = source->size();
     if (source_size) {
       for (int i = source_size - 1; i >= 0; i--) {
-        Node *source_node = &source->physicalGet(i);
+        const Node *source_node = &source->physicalGet(i);
         Node *dest_node = &dest->physicalGet(i);
-        if (source_node->isEntry()) {
-          new (dest_node) Node(*source_node);
+        if (source->physicalIsEntry(i)) {
+          new (dest_node) Node(source_node->asEntry());
         } else {
-          stack.push(dest_node->BitmapTrie(), &source_node->asTrie());
+          stack.push(std::make_pair(&dest_node->asTrie(), &source_node->asTrie()));
         }
       }
     }
   }
 }
 
-// }}} END of BitmapTrieTemplate
-
-// NodeTemplate {{{
-
 template <class Entry, class Allocator>
-NodeTemplate<Entry, Allocator> *NodeTemplate<Entry, Allocator>::BitmapTrie(NodeTemplate *parent) {
-  // Make sure an even pointer was passed and this node is a trie -- !isEntry().
-  // The LSB is used to indicate if the node is an entry.
-  assert(((uintptr_t)parent & (uintptr_t)0x1) == 0);
-  _parent = parent;
-  return this;
-}
+bool BitmapTrieTemplate<Entry, Allocator>::copyShallow(Allocator &allocator,
+                                                       const BitmapTrieTemplate &source,
+                                                       uint32_t capacity) {
+  assert(capacity >= source.size());
+  if (allocate(allocator, capacity) == nullptr && capacity > 0) {
+    return false;
+  }
+  _datamap = source._datamap;
+  _nodemap = source._nodemap;
 
-template <class Entry, class Allocator>
-NodeTemplate<Entry, Allocator> *NodeTemplate<Entry, Allocator>::BitmapTrie(Allocator &allocator,
-                                                                           NodeTemplate *parent,
-                                                                           uint32_t capacity) {
-  auto node = this->BitmapTrie(parent);
-  node->asTrie().allocate(allocator, capacity);
-  return this;
+  const uint32_t entry_count = source.entryCount();
+  const uint32_t sz = source.size();
+  for (uint32_t i = 0; i < entry_count; i++) {
+    new (&_base[i]) Node(source._base[i].asEntry());
+  }
+  for (uint32_t i = entry_count; i < sz; i++) {
+    new (&_base[i].asTrie()) BitmapTrieTemplate();
+    _base[i].asTrie().share(source._base[i].asTrie());
+  }
+  return true;
 }
 
 template <class Entry, class Allocator>
-NodeTemplate<Entry, Allocator> &NodeTemplate<Entry, Allocator>::operator=(
-    NodeTemplate<Entry, Allocator> &&other) {
-  // The LSB of parent defines if this node will be an entry
-  _parent = other._parent;
-  if (isEntry()) {
-    Entry &rhs = *reinterpret_cast<Entry *>(&other._either.entry);
-    new (&_either.entry) Entry(std::move(rhs));
-  } else {
-    new (&_either.trie) BitmapTrieT(std::move(other.asTrie()));
+void BitmapTrieTemplate<Entry, Allocator>::releaseRecursively(Allocator &allocator) noexcept {
+  // The last sub-trie of every trie is released by the loop instead of a
+  // recursive call, so the recursion is bounded by hamt_max_depth even through
+  // chains of collision nodes.
+  BitmapTrieTemplate trie(std::move(*this));
+  while (trie._base && trie.header()->refcount.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    const uint32_t entry_count = trie.entryCount();
+    const uint32_t sz = trie.size();
+    for (uint32_t i = 0; i < entry_count; i++) {
+      trie._base[i].asEntry().~Entry();
+    }
+    for (uint32_t i = entry_count; i + 1 < sz; i++) {
+      trie._base[i].asTrie().releaseRecursively(allocator);
+    }
+    Node *base = trie._base;
+    if (sz > entry_count) {
+      trie = std::move(base[sz - 1].asTrie());
+    } else {
+      trie._base = nullptr;
+    }
+    deallocateBase(allocator, base);
   }
-  return *this;
 }
 
+// }}} END of BitmapTrieTemplate
+
+// NodeTemplate {{{
+
 template <class Entry, class Allocator>
-NodeTemplate<Entry, Allocator>::NodeTemplate(const Entry &entry, NodeTemplate *parent)
-    : _parent((NodeTemplate *)((uintptr_t)parent | (uintptr_t)0x1)) {
-  new (&_either.entry) Entry(entry);
+BitmapTrieTemplate<Entry, Allocator> *NodeTemplate<Entry, Allocator>::BitmapTrie(
+    Allocator &allocator, uint32_t capacity) {
+  BitmapTrieT *trie = new (&_either.trie) BitmapTrieT();
+  trie->allocate(allocator, capacity);
+  return trie;
 }
 
 template <class Entry, class Allocator>
-NodeTemplate<Entry, Allocator>::NodeTemplate(Entry &&entry, NodeTemplate *parent)
-    : _parent((NodeTemplate *)((uintptr_t)parent | (uintptr_t)0x1)) {
+NodeTemplate<Entry, Allocator>::NodeTemplate(const Entry &entry) {
   new (&_either.entry) Entry(entry);
 }
 
 template <class Entry, class Allocator>
-NodeTemplate<Entry, Allocator> &NodeTemplate<Entry, Allocator>::operator=(Entry &&other) {
-  _parent = (NodeTemplate *)((uintptr_t)_parent | (uintptr_t)0x1);  // is an entry
-  new (&_either.entry) Entry(other);
-  return *this;
+NodeTemplate<Entry, Allocator>::NodeTemplate(Entry &&entry) {
+  new (&_either.entry) Entry(std::move(entry));
 }
 
 // }}} END of NodeTemplate
@@ -842,11 +2376,17 @@ HashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::HashArrayMappedTrie(size
                                                                             const hasher &hf,
                                                                             const key_equal &eql,
                                                                             const allocator_type &a)
-    : _count(0), _root(nullptr), _hasher(hf), _key_equal(eql), _allocator(a) {
-  _seed = static_cast<uint32_t>(FOC_GET_HASH_SEED);
-  uint32_t alloc_size = detail::hamt_trie_allocation_size(1, (n > 0) ? n : 1, 0);
+    : _count(0),
+      _reserved(n),
+      _hasher(hf),
+      _key_equal(eql),
+      _allocator(a),
+      _image(nullptr),
+      _image_size(0) {
+  _seed = FOC_GET_HASH_SEED;
+  uint32_t alloc_size = detail::hamt_trie_allocation_size(1, expectedSize(1), 0);
   assert(alloc_size >= 1);
-  _root.asTrie().allocate(_allocator, alloc_size);
+  _root.allocate(_allocator, alloc_size);
 }
 
 template <class Key, class T, class Hash, class KeyEqual, class Allocator>
@@ -860,20 +2400,36 @@ HashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::HashArrayMappedTrie(
 
 template <class Key, class T, class Hash, class KeyEqual, class Allocator>
 HashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::HashArrayMappedTrie(
-    const HashArrayMappedTrie &, const allocator_type &a)
-    : _allocator(a) {
-  assert(false);
+    const HashArrayMappedTrie &other, const allocator_type &a)
+    : _count(other._count),
+      _reserved(other._reserved),
+      _seed(other._seed),
+      _hasher(other._hasher),
+      _key_equal(other._key_equal),
+      _allocator(a),
+      _image(nullptr),
+      _image_size(0) {
+  _root.cloneRecursively(_allocator, other._root);
 }
 
 template <class Key, class T, class Hash, class KeyEqual, class Allocator>
 HashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::HashArrayMappedTrie(
     HashArrayMappedTrie &&other)
     : _count(other._count),
-      _seed(other._seed),
+      _reserved(other._reserved),
       _root(std::move(other._root)),
+      _seed(other._seed),
       _hasher(std::move(other._hasher)),
       _key_equal(std::move(other._key_equal)),
-      _allocator(std::move(other._allocator)) {}
+      _allocator(std::move(other._allocator)),
+      _image(other._image),
+      _image_size(other._image_size) {
+  other._count = 0;
+  other._reserved = 0;
+  other._image = nullptr;
+  other._image_size = 0;
+  other._root.allocate(other._allocator, 0);
+}
 
 template <class Key, class T, class Hash, class KeyEqual, class Allocator>
 HashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::HashArrayMappedTrie(HashArrayMappedTrie &&,
@@ -882,6 +2438,413 @@ HashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::HashArrayMappedTrie(Hash
   assert(false);
 }
 
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+void HashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::freeze() {
+  if (frozen() || _count == 0) {
+    return;
+  }
+  const size_t image_size = _root.fittedSizeRecursively();
+  char *image = static_cast<char *>(_allocator.allocate(image_size, alignof(Node)));
+  if (image == nullptr) {
+    return;
+  }
+  _root.relocateBreadthFirst(_allocator, image, false);
+  _image = image;
+  _image_size = image_size;
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+bool HashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::thaw() {
+  if (!frozen()) {
+    return true;
+  }
+  if (!_root.relocateBreadthFirst(_allocator, nullptr, true)) {
+    return false;
+  }
+  _allocator.deallocate(_image, _image_size);
+  _image = nullptr;
+  _image_size = 0;
+  return true;
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+template <class InputIterator>
+bool HashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::bulkInsert(InputIterator first,
+                                                                        InputIterator last,
+                                                                        uint32_t thread_count) {
+  bool inserted = true;
+  if (_count > 0) {
+    for (; first != last; ++first) {
+      inserted &= insert(*first) != end();
+    }
+    return inserted;
+  }
+
+  std::vector<std::pair<Key, T>> entries;
+  for (; first != last; ++first) {
+    entries.emplace_back(*first);
+  }
+  const size_t n = entries.size();
+  if (n == 0) {
+    return true;
+  }
+  std::vector<BulkEntry> items(n);
+  auto hash_chunk = [this, &entries, &items, n](size_t chunk) {
+    const size_t end = std::min(n, (chunk + 1) * bulk_hash_chunk);
+    for (size_t i = chunk * bulk_hash_chunk; i < end; i++) {
+      items[i] = BulkEntry{hash64(entries[i].first, _seed), i};
+    }
+  };
+  const size_t chunk_count = (n + bulk_hash_chunk - 1) / bulk_hash_chunk;
+  if (thread_count > 1) {
+    detail::hamt_parallel_for(thread_count, chunk_count, hash_chunk);
+  } else {
+    for (size_t chunk = 0; chunk < chunk_count; chunk++) {
+      hash_chunk(chunk);
+    }
+  }
+
+  std::vector<BulkEntry> scratch(n);
+  deallocateTries();
+  size_t count;
+  if (buildTrie(&_root,
+                entries,
+                items.data(),
+                scratch.data(),
+                n,
+                0,
+                expectedSize(n),
+                thread_count,
+                count)) {
+    placeEntries(&_root, entries, thread_count);
+    _count = count;
+    return true;
+  }
+
+  // There isn't enough memory to build the tries at once. Nothing was moved out
+  // of entries yet, so they can still be inserted one by one.
+  for (auto &entry : entries) {
+    inserted &= insert_or_assign(std::move(entry.first), std::move(entry.second)).first != end();
+  }
+  return inserted;
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+bool HashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::buildTrie(
+    BitmapTrie *trie,
+    const std::vector<std::pair<Key, T>> &entries,
+    BulkEntry *items,
+    BulkEntry *scratch,
+    size_t n,
+    uint32_t level,
+    size_t expected_hamt_size,
+    uint32_t thread_count,
+    size_t &count) {
+  static_assert(sizeof(BulkEntry) <= sizeof(Node) && alignof(BulkEntry) <= alignof(Node),
+                "The slot of an entry should have room for its item");
+  if (level == detail::hamt_collision_level) {
+    // The keys were deduplicated on the way down. They fill a chain of
+    // collision nodes.
+    assert(n >= 2);
+    BitmapTrie *node = trie;
+    for (size_t begin = 0;;) {
+      const uint32_t m = n - begin < detail::hamt_collision_node_entries
+                             ? n - begin
+                             : detail::hamt_collision_node_entries;
+      const bool overflow = begin + m < n;
+      const uint32_t alloc_size =
+          detail::hamt_trie_allocation_size(m + overflow, expected_hamt_size, level);
+      Node *base =
+          node->allocate(_allocator, alloc_size, (1U << m) - 1, overflow ? 0x1U << 31 : 0);
+      if (base == nullptr) {
+        node->allocate(_allocator, 0);
+        if (node != trie) {
+          deallocateBuiltTrie(trie);
+        }
+        return false;
+      }
+      for (uint32_t i = 0; i < m; i++) {
+        new (&base[i]) BulkEntry(items[begin + i]);
+      }
+      begin += m;
+      if (!overflow) {
+        break;
+      }
+      node = new (&base[m].asTrie()) BitmapTrie();
+    }
+    count = n;
+    return true;
+  }
+
+  // Counting sort of the items into scratch by their slice at this level. The
+  // sort is stable, so the later occurrences of a key stay later.
+  const uint32_t hash_offset = 5 * level;
+  size_t counts[32] = {0};
+  for (size_t i = 0; i < n; i++) {
+    counts[(items[i].hash >> hash_offset) & 0x1f]++;
+  }
+  size_t begins[32];
+  size_t ends[32];
+  size_t begin = 0;
+  for (uint32_t t = 0; t < 32; t++) {
+    begins[t] = ends[t] = begin;
+    begin += counts[t];
+  }
+  for (size_t i = 0; i < n; i++) {
+    scratch[ends[(items[i].hash >> hash_offset) & 0x1f]++] = items[i];
+  }
+
+  // A slot with more than one key becomes a sub-trie unless all its keys are
+  // the same. Equal keys have equal hashes, so they only have to be looked for
+  // among items that would end up in the same collision node.
+  const uint64_t slices_mask = (1ULL << (5 * detail::hamt_levels_per_hash)) - 1;
+  uint32_t datamap = 0;
+  uint32_t nodemap = 0;
+  for (uint32_t t = 0; t < 32; t++) {
+    if (counts[t] == 0) {
+      continue;
+    }
+    BulkEntry *group = scratch + begins[t];
+    if (counts[t] > 1) {
+      size_t i = 1;
+      while (i < counts[t] && ((group[i].hash ^ group[0].hash) & slices_mask) == 0) {
+        i++;
+      }
+      if (i == counts[t]) {
+        counts[t] = dedupeKeys(entries, group, counts[t]);
+      }
+    }
+    if (counts[t] == 1) {
+      datamap |= 0x1U << t;
+    } else {
+      nodemap |= 0x1U << t;
+    }
+  }
+
+  const uint32_t alloc_size = detail::hamt_trie_allocation_size(
+      __builtin_popcount(datamap | nodemap), expected_hamt_size, level);
+  Node *base = trie->allocate(_allocator, alloc_size, datamap, nodemap);
+  if (base == nullptr) {
+    trie->allocate(_allocator, 0);
+    return false;
+  }
+
+  count = 0;
+  for (uint32_t bitmap = datamap; bitmap; bitmap &= bitmap - 1) {
+    const uint32_t t = __builtin_ctz(bitmap);
+    new (&base[trie->entryIndex(t)]) BulkEntry(scratch[begins[t]]);
+    count++;
+  }
+  // Every sub-trie is built from its own part of the buffers and its own
+  // entries, so they can be built in parallel.
+  uint32_t slices[32];
+  size_t sub_trie_sizes[32];
+  bool built[32];
+  uint32_t sub_trie_count = 0;
+  for (uint32_t bitmap = nodemap; bitmap; bitmap &= bitmap - 1) {
+    slices[sub_trie_count++] = __builtin_ctz(bitmap);
+  }
+  auto build_sub_trie = [&](size_t k) {
+    const uint32_t t = slices[k];
+    BitmapTrie *child = new (&base[trie->trieIndex(t)].asTrie()) BitmapTrie();
+    // The halves of the buffers switch roles one level down.
+    built[k] = buildTrie(child,
+                         entries,
+                         scratch + begins[t],
+                         items + begins[t],
+                         counts[t],
+                         level + 1,
+                         expected_hamt_size,
+                         1,
+                         sub_trie_sizes[k]);
+  };
+  if (thread_count > 1) {
+    detail::hamt_parallel_for(thread_count, sub_trie_count, build_sub_trie);
+  } else {
+    for (uint32_t k = 0; k < sub_trie_count; k++) {
+      build_sub_trie(k);
+    }
+  }
+
+  bool all_built = true;
+  for (uint32_t k = 0; k < sub_trie_count; k++) {
+    all_built &= built[k];
+    count += sub_trie_sizes[k];
+  }
+  if (!all_built) {
+    // The sub-tries that failed are already empty.
+    deallocateBuiltTrie(trie);
+    return false;
+  }
+  return true;
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+void HashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::deallocateBuiltTrie(
+    BitmapTrie *trie) {
+  // The tries are copied out of the base arrays of their parents, which may be
+  // deallocated before the tries themselves.
+  std::stack<BitmapTrie> stack;
+  stack.push(std::move(*trie));
+  while (!stack.empty()) {
+    BitmapTrie top = std::move(stack.top());
+    stack.pop();
+    for (uint32_t i = top.entryCount(); i < top.size(); i++) {
+      stack.push(std::move(top.physicalGet(i).asTrie()));
+    }
+    top.deallocate(_allocator);
+  }
+  trie->allocate(_allocator, 0);
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+void HashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::placeEntries(
+    BitmapTrie *trie, std::vector<std::pair<Key, T>> &entries, uint32_t thread_count) {
+  if (thread_count > 1) {
+    // The sub-tries were built from disjoint sets of entries.
+    placeOwnEntries(trie, entries);
+    const uint32_t entry_count = trie->entryCount();
+    detail::hamt_parallel_for(thread_count, trie->trieCount(), [&](size_t k) {
+      placeEntries(&trie->physicalGet(entry_count + k).asTrie(), entries, 1);
+    });
+    return;
+  }
+
+  std::stack<BitmapTrie *> stack;
+  stack.push(trie);
+  while (!stack.empty()) {
+    BitmapTrie *top = stack.top();
+    stack.pop();
+    placeOwnEntries(top, entries);
+    for (uint32_t i = top->entryCount(); i < top->size(); i++) {
+      stack.push(&top->physicalGet(i).asTrie());
+    }
+  }
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+size_t HashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::dedupeKeys(
+    const std::vector<std::pair<Key, T>> &entries, BulkEntry *items, size_t n) {
+  size_t m = 0;
+  for (size_t i = 0; i < n; i++) {
+    const Key &key = entries[items[i].index].first;
+    size_t j = i + 1;
+    while (j < n && !_key_equal(key, entries[items[j].index].first)) {
+      j++;
+    }
+    if (j == n) {
+      items[m++] = items[i];
+    }
+  }
+  return m;
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+template <class K>
+void HashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::findBatchOf(
+    ArrayRef<K> keys, MutableArrayRef<const T *> values) const {
+  assert(keys.size() == values.size());
+  BatchProbe probes[find_batch_width];
+  const size_t n = keys.size();
+  size_t next = 0;
+  uint32_t active = 0;
+  while (active < find_batch_width && next < n) {
+    if (startProbe(probes[active], keys, next++, values)) {
+      active++;
+    }
+  }
+
+  // Round-robin over the lookups in flight. A finished lookup makes room for
+  // the next key or, when there are no keys left, for the last lookup.
+  while (active > 0) {
+    for (uint32_t p = 0; p < active;) {
+      if (advanceProbe(probes[p], keys, values)) {
+        p++;
+        continue;
+      }
+      bool started = false;
+      while (!started && next < n) {
+        started = startProbe(probes[p], keys, next++, values);
+      }
+      if (started) {
+        p++;
+      } else {
+        probes[p] = probes[--active];
+      }
+    }
+  }
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+template <class K>
+bool HashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::startProbe(
+    BatchProbe &probe, ArrayRef<K> keys, size_t i, MutableArrayRef<const T *> values) const {
+  probe.trie = &_root;
+  probe.hash = hash64(keys[i], _seed);
+  probe.hash_offset = 0;
+  probe.index = i;
+  if (!prefetchProbe(probe, &_root)) {
+    values[i] = nullptr;
+    return false;
+  }
+  return true;
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+template <class K>
+bool HashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::advanceProbe(
+    BatchProbe &probe, ArrayRef<K> keys, MutableArrayRef<const T *> values) const {
+  const K &key = keys[probe.index];
+  const T *&value = values[probe.index];
+  if (UNLIKELY(probe.hash_offset > detail::hamt_last_hash_offset)) {
+    const Node *node = findCollidingNode(*probe.trie, key, probe.hash);
+    value = node ? &node->asEntry().second : nullptr;
+    return false;
+  }
+  if (probe.node_is_entry) {
+    const Entry &entry = probe.node->asEntry();
+    const bool found = hashMayMatch(entry, probe.hash) && _key_equal(entry.first, key);
+    value = found ? &entry.second : nullptr;
+    return false;
+  }
+
+  probe.trie = &probe.node->asTrie();
+  probe.hash_offset += 5;
+  if (UNLIKELY(probe.hash_offset > detail::hamt_last_hash_offset)) {
+    probe.node = &probe.trie->physicalGet(0);
+    PREFETCH(probe.node);
+    return true;
+  }
+  if (!prefetchProbe(probe, probe.trie)) {
+    value = nullptr;
+    return false;
+  }
+  return true;
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+bool HashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::operator==(
+    const HashArrayMappedTrie &other) const {
+  if (_count != other._count) {
+    return false;
+  }
+  if (_seed == other._seed) {
+    // Both HAMTs place every key in the same position, so the tries can be
+    // compared node by node without hashing any key.
+    auto entry_equal = [this](const Entry &a, const Entry &b) {
+      return _key_equal(a.first, b.first) && a.second == b.second;
+    };
+    return _root.equalsRecursively(other._root, entry_equal);
+  }
+  for (const auto &entry : *this) {
+    const T *value = other.find(entry.first);
+    if (value == nullptr || !(*value == entry.second)) {
+      return false;
+    }
+  }
+  return true;
+}
+
 // }}} End of HashArrayMappedTrie
 
 }  // namespace foc
@@ -1,4 +1,7 @@
+#include <algorithm>
+#include <atomic>
 #include <queue>
+#include <string>
 #include <vector>
 
 #include <gtest/gtest.h>
@@ -50,11 +53,12 @@ TEST(HashArrayMappedTrieTest, BitmatpTrieInitialization) {
 
 TEST(HashArrayMappedTrieTest, LogicalZeroToPhysicalZeroIndexTranslationTest) {
   HAMT::BitmapTrie trie;
+  trie.nodemap() = 0;
 
   // For any bitmap, the logical index 0 will map to physical index 0.
   // (we test all bitmaps that contain a single bit)
   for (int i = 0; i < 32; i++) {
-    trie.bitmap() = 0x1 << i;
+    trie.datamap() = 0x1U << i;
     EXPECT_EQ(trie.physicalIndex(0), 0);
   }
 }
@@ -68,9 +72,9 @@ TEST(HashArrayMappedTrieTest, FirstEntryTest) {
 
   // Insert two entrie into a trie and check the first
   trie.allocate(allocator, 4);
-  trie.insertEntry(allocator, 2, two, nullptr, 4, 0);
+  trie.insertEntry(allocator, 2, two, 4, 0);
   EXPECT_TRUE(trie.logicalPositionTaken(2));
-  trie.insertEntry(allocator, 3, three, nullptr, 4, 0);
+  trie.insertEntry(allocator, 3, three, 4, 0);
   EXPECT_TRUE(trie.logicalPositionTaken(3));
 
   const HAMT::Node *node = trie.firstEntryNodeRecursively();
@@ -86,63 +90,72 @@ TEST(HashArrayMappedTrieTest, FirstEntryRecursivelyTest) {
 
   // Isert an entry and a trie with an entry to cause recursion
   trie.allocate(allocator, 4);
-  trie.insertEntry(allocator, 3, three, nullptr, 4, 0);
+  trie.insertEntry(allocator, 3, three, 4, 0);
   EXPECT_TRUE(trie.logicalPositionTaken(3));
-  HAMT::Node *child = trie.insertTrie(allocator, nullptr, 0, 1);
+  HAMT::BitmapTrie *child = trie.insertTrie(allocator, 0, 1);
   EXPECT_TRUE(trie.logicalPositionTaken(0));
-  child->asTrie().insertEntry(allocator, 0, two, nullptr, 1, 1);
-  EXPECT_TRUE(child->asTrie().logicalPositionTaken(0));
+  child->insertEntry(allocator, 0, two, 1, 1);
+  EXPECT_TRUE(child->logicalPositionTaken(0));
 
+  // Entries come before the sub-tries
   const HAMT::Node *node = trie.firstEntryNodeRecursively();
+  EXPECT_EQ(node->asEntry().second, 3);
+
+  // Without entries in the root, the first entry is found in the sub-trie
+  trie.eraseEntry(allocator, 3, 4, 0);
+  node = trie.firstEntryNodeRecursively();
   EXPECT_EQ(node->asEntry().second, 2);
+
+  trie.deallocateRecursively(allocator);
 }
 
 TEST(HashArrayMappedTrieTest, LogicalToPhysicalIndexTranslationTest) {
   HAMT::BitmapTrie trie;
+  trie.nodemap() = 0;
 
-  trie.bitmap() = 1;  // 0001
+  trie.datamap() = 1;  // 0001
   EXPECT_EQ(trie.physicalIndex(1), 1);
   EXPECT_EQ(trie.physicalIndex(2), 1);
   EXPECT_EQ(trie.physicalIndex(3), 1);
   EXPECT_EQ(trie.physicalIndex(4), 1);
   EXPECT_EQ(trie.physicalIndex(5), 1);
   EXPECT_EQ(trie.physicalIndex(31), 1);
-  trie.bitmap() = 2;  // 0010
+  trie.datamap() = 2;  // 0010
   EXPECT_EQ(trie.physicalIndex(1), 0);
   EXPECT_EQ(trie.physicalIndex(2), 1);
   EXPECT_EQ(trie.physicalIndex(3), 1);
   EXPECT_EQ(trie.physicalIndex(4), 1);
   EXPECT_EQ(trie.physicalIndex(5), 1);
   EXPECT_EQ(trie.physicalIndex(31), 1);
-  trie.bitmap() = 3;  // 0011
+  trie.datamap() = 3;  // 0011
   EXPECT_EQ(trie.physicalIndex(1), 1);
   EXPECT_EQ(trie.physicalIndex(2), 2);
   EXPECT_EQ(trie.physicalIndex(3), 2);
   EXPECT_EQ(trie.physicalIndex(4), 2);
   EXPECT_EQ(trie.physicalIndex(5), 2);
   EXPECT_EQ(trie.physicalIndex(31), 2);
-  trie.bitmap() = 4;  // 0100
+  trie.datamap() = 4;  // 0100
   EXPECT_EQ(trie.physicalIndex(1), 0);
   EXPECT_EQ(trie.physicalIndex(2), 0);
   EXPECT_EQ(trie.physicalIndex(3), 1);
   EXPECT_EQ(trie.physicalIndex(4), 1);
   EXPECT_EQ(trie.physicalIndex(5), 1);
   EXPECT_EQ(trie.physicalIndex(31), 1);
-  trie.bitmap() = 5;  // 0101
+  trie.datamap() = 5;  // 0101
   EXPECT_EQ(trie.physicalIndex(1), 1);
   EXPECT_EQ(trie.physicalIndex(2), 1);
   EXPECT_EQ(trie.physicalIndex(3), 2);
   EXPECT_EQ(trie.physicalIndex(4), 2);
   EXPECT_EQ(trie.physicalIndex(5), 2);
   EXPECT_EQ(trie.physicalIndex(31), 2);
-  trie.bitmap() = 6;  // 0110
+  trie.datamap() = 6;  // 0110
   EXPECT_EQ(trie.physicalIndex(1), 0);
   EXPECT_EQ(trie.physicalIndex(2), 1);
   EXPECT_EQ(trie.physicalIndex(3), 2);
   EXPECT_EQ(trie.physicalIndex(4), 2);
   EXPECT_EQ(trie.physicalIndex(5), 2);
   EXPECT_EQ(trie.physicalIndex(31), 2);
-  trie.bitmap() = 7;  // 0111
+  trie.datamap() = 7;  // 0111
   EXPECT_EQ(trie.physicalIndex(1), 1);
   EXPECT_EQ(trie.physicalIndex(2), 2);
   EXPECT_EQ(trie.physicalIndex(3), 3);
@@ -157,14 +170,14 @@ TEST(HashArrayMappedTrieTest, BitmapTrieInsertTest) {
   trie.allocate(allocator, 1);
 
   auto e = std::make_pair(40LL, 4LL);
-  trie.insertEntry(allocator, 4, e, nullptr, 2, 0);
+  trie.insertEntry(allocator, 4, e, 2, 0);
   EXPECT_EQ(trie.bitmap(), 16);  // 010000
   EXPECT_EQ(trie.size(), 1);
   EXPECT_EQ(trie.physicalGet(0).asEntry().first, 40);
   EXPECT_EQ(trie.physicalGet(0).asEntry().second, 4);
 
   e = std::make_pair(20L, 2L);
-  trie.insertEntry(allocator, 2, e, nullptr, 2, 0);
+  trie.insertEntry(allocator, 2, e, 2, 0);
   EXPECT_EQ(trie.bitmap(), 20);  // 010100
   EXPECT_EQ(trie.size(), 2);
   EXPECT_EQ(trie.physicalGet(0).asEntry().first, 20);
@@ -173,7 +186,7 @@ TEST(HashArrayMappedTrieTest, BitmapTrieInsertTest) {
   EXPECT_EQ(trie.physicalGet(1).asEntry().second, 4);
 
   e = std::make_pair(30L, 3L);
-  trie.insertEntry(allocator, 3, e, nullptr, 2, 0);
+  trie.insertEntry(allocator, 3, e, 2, 0);
   EXPECT_EQ(trie.bitmap(), 28);  // 011100
   EXPECT_EQ(trie.size(), 3);
   EXPECT_EQ(trie.physicalGet(0).asEntry().first, 20);
@@ -184,7 +197,7 @@ TEST(HashArrayMappedTrieTest, BitmapTrieInsertTest) {
   EXPECT_EQ(trie.physicalGet(2).asEntry().second, 4);
 
   e = std::make_pair(0LL, 0LL);
-  trie.insertEntry(allocator, 0, e, nullptr, 2, 0);
+  trie.insertEntry(allocator, 0, e, 2, 0);
   EXPECT_EQ(trie.bitmap(), 29);  // 011101
   EXPECT_EQ(trie.size(), 4);
   EXPECT_EQ(trie.physicalGet(0).asEntry().first, 0);
@@ -197,7 +210,7 @@ TEST(HashArrayMappedTrieTest, BitmapTrieInsertTest) {
   EXPECT_EQ(trie.physicalGet(3).asEntry().second, 4);
 
   e = std::make_pair(50LL, 5LL);
-  trie.insertEntry(allocator, 5, e, nullptr, 2, 0);
+  trie.insertEntry(allocator, 5, e, 2, 0);
   EXPECT_EQ(trie.bitmap(), 61);  // 111101
   EXPECT_EQ(trie.size(), 5);
   EXPECT_EQ(trie.physicalGet(0).asEntry().first, 0);
@@ -212,7 +225,7 @@ TEST(HashArrayMappedTrieTest, BitmapTrieInsertTest) {
   EXPECT_EQ(trie.physicalGet(4).asEntry().second, 5);
 
   e = std::make_pair(10LL, 1LL);
-  trie.insertEntry(allocator, 1, e, nullptr, 2, 0);
+  trie.insertEntry(allocator, 1, e, 2, 0);
   EXPECT_EQ(trie.bitmap(), 63);  // 111111
   EXPECT_EQ(trie.size(), 6);
   EXPECT_EQ(trie.physicalGet(0).asEntry().first, 0);
@@ -229,7 +242,7 @@ TEST(HashArrayMappedTrieTest, BitmapTrieInsertTest) {
   EXPECT_EQ(trie.physicalGet(5).asEntry().second, 5);
 
   e = std::make_pair(310LL, 31L);
-  trie.insertEntry(allocator, 31, e, nullptr, 2, 0);
+  trie.insertEntry(allocator, 31, e, 2, 0);
   EXPECT_EQ(trie.bitmap(), 63 | (0x1 << 31));
   EXPECT_EQ(trie.size(), 7);
   EXPECT_EQ(trie.physicalGet(6).asEntry().first, 310);
@@ -238,7 +251,6 @@ TEST(HashArrayMappedTrieTest, BitmapTrieInsertTest) {
 
 TEST(HashArrayMappedTrieTest, BitmapTrieInsertTrieTest) {
   HAMT::BitmapTrie trie;
-  HAMT::Node parent(nullptr);
   MallocAllocator allocator;
   std::pair<int64_t, int64_t> entry(2, 4);
 
@@ -247,97 +259,139 @@ TEST(HashArrayMappedTrieTest, BitmapTrieInsertTrieTest) {
   EXPECT_EQ(trie.size(), 0);
 
   // Insert an entry and a trie to the trie
-  trie.insertEntry(allocator, 0, entry, &parent, 0, 0);
+  trie.insertEntry(allocator, 0, entry, 0, 0);
   EXPECT_EQ(trie.size(), 1);
-  trie.insertTrie(allocator, &parent, 1, capacity);
+  trie.insertTrie(allocator, 1, capacity);
   EXPECT_EQ(trie.size(), 2);
 
   // Retrieve the inserted entry
-  HAMT::Node &inserted_entry_node = trie.logicalGet(0);
-  EXPECT_TRUE(inserted_entry_node.isEntry());
-  auto &inserted_entry = inserted_entry_node.asEntry();
+  EXPECT_TRUE(trie.logicalIsEntry(0));
+  auto &inserted_entry = trie.logicalGet(0).asEntry();
   EXPECT_EQ(inserted_entry, entry);
 
   // Retrieve the inserted trie
-  HAMT::Node &child_trie_node = trie.logicalGet(1);
-  EXPECT_FALSE(child_trie_node.isEntry());
-  EXPECT_TRUE(child_trie_node.isTrie());
+  EXPECT_FALSE(trie.logicalIsEntry(1));
+  EXPECT_TRUE(trie.logicalIsTrie(1));
 
   // Insert another trie into the child trie
-  HAMT::BitmapTrie &child_trie = child_trie_node.asTrie();
+  HAMT::BitmapTrie &child_trie = trie.logicalGet(1).asTrie();
   EXPECT_EQ(child_trie.size(), 0);
-  child_trie.insertTrie(allocator, &child_trie_node, 0, 2);
+  child_trie.insertTrie(allocator, 0, 2);
   EXPECT_EQ(child_trie.size(), 1);
 
   // Retrieve the inserted trie
-  HAMT::Node &grand_child_trie_node = child_trie.logicalGet(0);
-  EXPECT_TRUE(grand_child_trie_node.isTrie());
-  EXPECT_EQ(grand_child_trie_node.parent(), &child_trie_node);
-  EXPECT_EQ(child_trie_node.parent(), &parent);
-}
+  EXPECT_TRUE(child_trie.logicalIsTrie(0));
+  EXPECT_EQ(child_trie.logicalGet(0).asTrie().capacity(), 2);
 
-TEST(HashArrayMappedTrieTest, NodeInitializationAsBitmapTrieTest) {
-  HAMT::Node parent(nullptr);
-  EXPECT_EQ(parent.parent(), nullptr);
+  // Erasing the entry moves the trie to the front of the array
+  EXPECT_EQ(trie.datamap(), 1);
+  EXPECT_EQ(trie.nodemap(), 2);
+  trie.eraseEntry(allocator, 0, 1, 0);
+  EXPECT_EQ(trie.datamap(), 0);
+  EXPECT_EQ(trie.nodemap(), 2);
+  EXPECT_TRUE(trie.logicalIsTrie(1));
+  EXPECT_EQ(&trie.logicalGet(1), &trie.physicalGet(0));
 
-  HAMT::Node node(&parent);
-  EXPECT_TRUE(node.isTrie());
-  EXPECT_FALSE(node.isEntry());
-  EXPECT_EQ(node.parent(), &parent);
+  trie.deallocateRecursively(allocator);
+}
 
+TEST(HashArrayMappedTrieTest, BitmapTrieLayoutTest) {
+  HAMT::BitmapTrie trie;
   MallocAllocator allocator;
-  node.BitmapTrie(allocator, &parent, 2);
-  EXPECT_TRUE(node.isTrie());
-  EXPECT_FALSE(node.isEntry());
-  EXPECT_EQ(node.parent(), &parent);
-  auto &trie = node.asTrie();
-  EXPECT_EQ(trie.capacity(), 2);
-  EXPECT_EQ(trie.size(), 0);
+  trie.allocate(allocator, 4);
 
-  HAMT::Node a_node(nullptr);
-  a_node = std::move(node);
-  EXPECT_EQ(a_node.parent(), &parent);
-  auto &a_trie = node.asTrie();
-  EXPECT_EQ(&trie.physicalGet(0), &a_trie.physicalGet(0));
-  EXPECT_EQ(a_trie.capacity(), 2);
-  EXPECT_EQ(a_trie.size(), 0);
+  // Entries are at the front in logical order and tries at the back in
+  // reverse logical order.
+  trie.insertTrie(allocator, 10, 1);
+  EXPECT_EQ(trie.datamap(), 0);
+  EXPECT_EQ(trie.nodemap(), 0x1U << 10);
+  trie.insertEntry(allocator, 20, std::make_pair(20LL, 20LL), 1, 0);
+  trie.insertEntry(allocator, 5, std::make_pair(5LL, 5LL), 1, 0);
+  trie.insertTrie(allocator, 15, 1);
+  EXPECT_EQ(trie.datamap(), (0x1U << 5) | (0x1U << 20));
+  EXPECT_EQ(trie.nodemap(), (0x1U << 10) | (0x1U << 15));
+  EXPECT_EQ(trie.entryCount(), 2);
+  EXPECT_EQ(trie.trieCount(), 2);
+  // [5, 20, 15, 10]
+  EXPECT_EQ(trie.physicalGet(0).asEntry().first, 5);
+  EXPECT_EQ(trie.physicalGet(1).asEntry().first, 20);
+  EXPECT_EQ(&trie.logicalGet(15), &trie.physicalGet(2));
+  EXPECT_EQ(&trie.logicalGet(10), &trie.physicalGet(3));
+  EXPECT_TRUE(trie.physicalIsEntry(1));
+  EXPECT_TRUE(trie.physicalIsTrie(2));
 
-  a_trie.deallocate(allocator);
+  // Turning entries into tries and back
+  trie.entryToTrie(allocator, 5, 1);
+  EXPECT_EQ(trie.datamap(), 0x1U << 20);
+  EXPECT_EQ(trie.nodemap(), (0x1U << 5) | (0x1U << 10) | (0x1U << 15));
+  // [20, 15, 10, 5]
+  EXPECT_EQ(trie.physicalGet(0).asEntry().first, 20);
+  EXPECT_EQ(&trie.logicalGet(15), &trie.physicalGet(1));
+  EXPECT_EQ(&trie.logicalGet(10), &trie.physicalGet(2));
+  EXPECT_EQ(&trie.logicalGet(5), &trie.physicalGet(3));
+  trie.logicalGet(5).asTrie().deallocate(allocator);
+  trie.trieToEntry(5, std::make_pair(5LL, 55LL));
+  // [5, 20, 15, 10]
+  EXPECT_EQ(trie.physicalGet(0).asEntry().second, 55);
+  EXPECT_EQ(trie.physicalGet(1).asEntry().first, 20);
+  EXPECT_EQ(&trie.logicalGet(15), &trie.physicalGet(2));
+  EXPECT_EQ(&trie.logicalGet(10), &trie.physicalGet(3));
+
+  trie.eraseEntry(allocator, 5, 1, 0);
+  EXPECT_EQ(trie.physicalGet(0).asEntry().first, 20);
+  trie.eraseEntry(allocator, 20, 1, 0);
+  EXPECT_EQ(trie.datamap(), 0);
+  EXPECT_EQ(trie.size(), 2);
+  EXPECT_EQ(&trie.logicalGet(15), &trie.physicalGet(0));
+  EXPECT_EQ(&trie.logicalGet(10), &trie.physicalGet(1));
+
+  trie.deallocateRecursively(allocator);
 }
 
-TEST(HashArrayMappedTrieTest, NodeInitializationAsEntryTest) {
-  HAMT::Node parent(nullptr);
+TEST(HashArrayMappedTrieTest, NodeSizeTest) {
+  // Nodes don't carry any information besides the entry or the trie.
+  EXPECT_EQ(sizeof(HAMT::BitmapTrie), 2 * sizeof(uint32_t) + sizeof(void *));
+  EXPECT_EQ(sizeof(HAMT::Node), std::max(sizeof(HAMT::BitmapTrie), sizeof(HAMT::Entry)));
+}
 
-  std::pair<int64_t, int64_t> entry = std::make_pair(2, 4);
-  HAMT::Node node(std::move(entry), &parent);
-  EXPECT_TRUE(node.isEntry());
-  EXPECT_FALSE(node.isTrie());
-  EXPECT_EQ(node.parent(), &parent);
+TEST(HashArrayMappedTrieTest, NodeInitializationAsBitmapTrieTest) {
+  HAMT::BitmapTrie root;
+  MallocAllocator allocator;
+  root.allocate(allocator, 1);
+  HAMT::BitmapTrie *trie = root.insertTrie(allocator, 0, 2);
+  EXPECT_TRUE(root.logicalIsTrie(0));
+  EXPECT_EQ(trie, &root.logicalGet(0).asTrie());
+  EXPECT_EQ(trie->capacity(), 2);
+  EXPECT_EQ(trie->size(), 0);
 
-  HAMT::Node a_node(nullptr);
-  a_node = std::move(entry);
-  EXPECT_TRUE(node.isEntry());
-  EXPECT_FALSE(node.isTrie());
+  root.deallocateRecursively(allocator);
 }
 
-TEST(HashArrayMappedTrieTest, ParentTest) {
+TEST(HashArrayMappedTrieTest, NodeInitializationAsEntryTest) {
+  std::pair<int64_t, int64_t> entry = std::make_pair(2, 4);
+  HAMT::Node node(std::move(entry));
+  EXPECT_EQ(node.asEntry().first, 2);
+  EXPECT_EQ(node.asEntry().second, 4);
+}
+
+TEST(HashArrayMappedTrieTest, InsertTest) {
   using HAMT = foc::HashArrayMappedTrie<int64_t, int64_t>;
-  parent_test<HAMT>(2048);
+  insert_test<HAMT>(2048);
 }
 
-TEST(HashArrayMappedTrieTest, ParentTestWithBadHashFunction) {
+TEST(HashArrayMappedTrieTest, InsertTestWithBadHashFunction) {
   using HAMT = foc::HashArrayMappedTrie<int64_t, int64_t, BadHashFunction>;
-  parent_test<HAMT>(64);
+  insert_test<HAMT>(64);
 }
 
-TEST(HashArrayMappedTrieTest, ParentTestWithIdentityFunction) {
+TEST(HashArrayMappedTrieTest, InsertTestWithIdentityFunction) {
   using HAMT = foc::HashArrayMappedTrie<int64_t, int64_t, IdentityFunction>;
-  parent_test<HAMT>(2048);
+  insert_test<HAMT>(2048);
 }
 
-TEST(HashArrayMappedTrieTest, ParentTestConstantFunction) {
+TEST(HashArrayMappedTrieTest, InsertTestConstantFunction) {
   using HAMT = foc::HashArrayMappedTrie<int64_t, int64_t, ConstantFunction>;
-  parent_test<HAMT>(64);
+  insert_test<HAMT>(64);
 }
 
 TEST(HashArrayMappedTrieTest, TopLevelInsertTest) {
@@ -376,26 +430,1055 @@ TEST(HashArrayMappedTrieTest, TopLevelInsertTest) {
 TEST(HashArrayMappedTrieTest, ConstantHashFunctionTest) {
   using HAMT = foc::HashArrayMappedTrie<int64_t, int64_t, ConstantFunction>;
   HAMT hamt;
-  for (int64_t i = 0; i < 32; i++) {
-    insertKeyAndValue(hamt, i, i);
+  // Keys with the same hash share a collision node at the bottom of the trie.
+  // The keys that don't fit in it go to a chain of overflow nodes.
+  const int64_t n = 100;
+  for (int64_t i = 0; i < n; i++) {
+    EXPECT_TRUE(insertKeyAndValue(hamt, i, i) != hamt.end());
   }
+  check_structure(hamt);
+  check_canonical_form(hamt);
+  EXPECT_EQ(hamt.size(), n);
+  const size_t overflow_nodes = (n - 1) / foc::detail::hamt_collision_node_entries;
+  EXPECT_EQ(hamt.countInnerNodes(hamt.root()),
+            foc::detail::hamt_collision_level + overflow_nodes);
+  EXPECT_EQ((int64_t)std::distance(hamt.begin(), hamt.end()), n);
+
+  // Values of keys in any node of the chain can be replaced.
+  for (int64_t i = 7; i < n; i += 31) {
+    auto it = insertKeyAndValue(hamt, i, 10 * i);
+    EXPECT_EQ(it->first, i);
+    EXPECT_EQ(it->second, 10 * i);
+  }
+  EXPECT_EQ(hamt.size(), n);
+
+  // The same keys inserted in a different order land in different positions
+  // of the chain.
+  HAMT other;
+  other._seed = hamt._seed;
+  for (int64_t i = n - 1; i >= 0; i--) {
+    insertKeyAndValue(other, i, i % 31 == 7 ? 10 * i : i);
+  }
+  EXPECT_TRUE(hamt == other);
+  insertKeyAndValue(other, 7, 7);
+  EXPECT_FALSE(hamt == other);
+  EXPECT_EQ(other.erase(7), 1);
+  EXPECT_FALSE(hamt == other);
+  EXPECT_FALSE(other == hamt);
+
+  HAMT copy(hamt);
+  EXPECT_TRUE(copy == hamt);
+  check_canonical_form(copy);
+
+  // Erasing from the middle of the chain moves the last entry into the hole.
+  for (int64_t i = 0; i < n - 1; i++) {
+    EXPECT_EQ(hamt.erase(i), 1);
+    EXPECT_EQ(hamt.find(i), nullptr);
+    EXPECT_EQ(*hamt.find(n - 1), n - 1);
+    EXPECT_EQ(hamt.size(), n - 1 - i);
+    check_canonical_form(hamt);
+  }
+  // The last entry was collapsed all the way up to the root.
+  EXPECT_EQ(hamt.root().size(), 1);
+  EXPECT_TRUE(hamt.root().physicalIsEntry(0));
+
+  // Erasing from the end of the chain unchains the emptied nodes.
+  for (int64_t i = n - 1; i >= 1; i--) {
+    EXPECT_EQ(copy.erase(i), 1);
+    check_canonical_form(copy);
+    for (int64_t j = 0; j < i; j++) {
+      EXPECT_EQ(*copy.find(j), j % 31 == 7 ? 10 * j : j);
+    }
+  }
+  EXPECT_EQ(copy.size(), 1);
 }
 
 TEST(HashArrayMappedTrieTest, PhysicalIndexOfNodeInTrie) {
   using HAMT = foc::HashArrayMappedTrie<int64_t, int64_t, IdentityFunction>;
   HAMT hamt;
-  hamt._seed = 0;
-  HAMT::Node *root = &hamt._root;
-  for (int64_t i = 31; i >= 0; i--) {
-    insertKeyAndValue(hamt, i, i);
+  HAMT::BitmapTrie *root = &hamt._root;
+  // keys[i] goes to the logical position i of the root.
+  int64_t keys[32];
+  uint32_t found = 0;
+  for (int64_t key = 0; found != 0xffffffffU; key++) {
+    uint32_t slice = hamt.hash64(key, hamt._seed) & 0x1f;
+    if (!(found & (1U << slice))) {
+      found |= 1U << slice;
+      keys[slice] = key;
+    }
+  }
+  for (int i = 31; i >= 0; i--) {
+    insertKeyAndValue(hamt, keys[i], keys[i]);
   }
   for (uint32_t i = 0; i < 32; i++) {
-    EXPECT_EQ(root->asTrie().physicalIndex(i), i);
-    HAMT::Node *logical_node = &root->asTrie().logicalGet(i);
-    HAMT::Node *physical_node = &root->asTrie().physicalGet(i);
-    EXPECT_EQ(logical_node->asEntry().first, i);
+    EXPECT_EQ(root->physicalIndex(i), i);
+    HAMT::Node *logical_node = &root->logicalGet(i);
+    HAMT::Node *physical_node = &root->physicalGet(i);
+    EXPECT_TRUE(root->logicalIsEntry(i));
+    EXPECT_EQ(logical_node->asEntry().first, keys[i]);
     EXPECT_EQ(logical_node, physical_node);
-    EXPECT_EQ(logical_node->parent(), root);
-    EXPECT_EQ(root->asTrie().physicalIndexOf(logical_node), i);
+    EXPECT_EQ(root->physicalIndexOf(logical_node), i);
+  }
+}
+
+TEST(HashArrayMappedTrieTest, EraseTest) {
+  using HAMT = foc::HashArrayMappedTrie<int64_t, int64_t>;
+  erase_test<HAMT>(4096);
+}
+
+TEST(HashArrayMappedTrieTest, EraseTestWithBadHashFunction) {
+  using HAMT = foc::HashArrayMappedTrie<int64_t, int64_t, BadHashFunction>;
+  erase_test<HAMT>(64);
+}
+
+TEST(HashArrayMappedTrieTest, EraseTestWithIdentityFunction) {
+  using HAMT = foc::HashArrayMappedTrie<int64_t, int64_t, IdentityFunction>;
+  erase_test<HAMT>(4096);
+}
+
+TEST(HashArrayMappedTrieTest, EraseTestConstantFunction) {
+  using HAMT = foc::HashArrayMappedTrie<int64_t, int64_t, ConstantFunction>;
+  erase_test<HAMT>(64);
+}
+
+TEST(HashArrayMappedTrieTest, EraseShrinksBaseArrays) {
+  HAMT::BitmapTrie trie;
+  MallocAllocator allocator;
+  trie.allocate(allocator, 0);
+
+  for (int64_t i = 0; i < 32; i++) {
+    trie.insertEntry(allocator, i, std::make_pair(i, i), 1, 1);
+  }
+  EXPECT_EQ(trie.size(), 32);
+  EXPECT_EQ(trie.capacity(), 32);
+
+  for (int64_t i = 31; i >= 1; i--) {
+    trie.eraseEntry(allocator, i, 1, 1);
+    EXPECT_EQ(trie.size(), i);
+    EXPECT_GE(trie.capacity(), trie.size());
+    // The array never keeps more than one size class of slack.
+    EXPECT_LE(trie.capacity(), foc::detail::hamt_trie_allocation_size(i + 1, 1, 1));
+    for (int64_t j = 0; j < i; j++) {
+      EXPECT_EQ(trie.logicalGet(j).asEntry().first, j);
+    }
+  }
+  EXPECT_EQ(trie.capacity(), 2);
+
+  trie.eraseEntry(allocator, 0, 1, 1);
+  EXPECT_EQ(trie.size(), 0);
+  EXPECT_EQ(trie.capacity(), 0);
+}
+
+TEST(HashArrayMappedTrieTest, EraseCollapsesSubTries) {
+  using HAMT = foc::HashArrayMappedTrie<int64_t, int64_t, IdentityFunction>;
+  HAMT hamt;
+
+  // a, b and c share the first slice and b and c share the second one.
+  auto slices = [&hamt](int64_t key) { return hamt.hash64(key, hamt._seed) & 0x3ff; };
+  const int64_t a = 0;
+  int64_t b = 1;
+  while ((slices(b) & 0x1f) != (slices(a) & 0x1f) || slices(b) == slices(a)) {
+    b++;
+  }
+  int64_t c = b + 1;
+  while (slices(c) != slices(b)) {
+    c++;
+  }
+  const uint32_t t = slices(a) & 0x1f;
+  insertKeyAndValue(hamt, a, a);
+  insertKeyAndValue(hamt, b, b);
+  insertKeyAndValue(hamt, c, c);
+  EXPECT_TRUE(hamt.root().logicalIsTrie(t));
+
+  EXPECT_EQ(hamt.erase(b), 1);
+  check_canonical_form(hamt);
+  EXPECT_TRUE(hamt.root().logicalIsTrie(t));
+  EXPECT_EQ(*hamt.find(a), a);
+  EXPECT_EQ(*hamt.find(c), c);
+
+  EXPECT_EQ(hamt.erase(a), 1);
+  check_canonical_form(hamt);
+  EXPECT_TRUE(hamt.root().logicalIsEntry(t));
+  EXPECT_EQ(*hamt.find(c), c);
+}
+
+TEST(HashArrayMappedTrieTest, IterationTest) {
+  using HAMT = foc::HashArrayMappedTrie<int64_t, int64_t>;
+  iteration_test<HAMT>(8192);
+}
+
+TEST(HashArrayMappedTrieTest, IterationTestWithBadHashFunction) {
+  using HAMT = foc::HashArrayMappedTrie<int64_t, int64_t, BadHashFunction>;
+  iteration_test<HAMT>(64);
+}
+
+TEST(HashArrayMappedTrieTest, IterationTestWithIdentityFunction) {
+  using HAMT = foc::HashArrayMappedTrie<int64_t, int64_t, IdentityFunction>;
+  iteration_test<HAMT>(8192);
+}
+
+TEST(HashArrayMappedTrieTest, IterationTestConstantFunction) {
+  using HAMT = foc::HashArrayMappedTrie<int64_t, int64_t, ConstantFunction>;
+  iteration_test<HAMT>(64);
+}
+
+TEST(HashArrayMappedTrieTest, EqualityTest) {
+  using HAMT = foc::HashArrayMappedTrie<int64_t, int64_t>;
+  HAMT a;
+  HAMT b;
+  b._seed = a._seed;
+  EXPECT_TRUE(a == b);
+
+  // The same keys inserted in a different order (and with erased keys in
+  // between) produce equal HAMTs.
+  for (int64_t i = 0; i < 1000; i++) {
+    insertKeyAndValue(a, i, i);
+  }
+  for (int64_t i = 1999; i >= 0; i--) {
+    insertKeyAndValue(b, i, i);
+  }
+  EXPECT_TRUE(a != b);
+  for (int64_t i = 1000; i < 2000; i++) {
+    b.erase(i);
+  }
+  EXPECT_TRUE(a == b);
+
+  // Values are compared too.
+  b.erase(500);
+  insertKeyAndValue(b, 500, 0);
+  EXPECT_FALSE(a == b);
+
+  // HAMTs with different seeds are compared with lookups.
+  HAMT c;
+  c._seed = a._seed + 1;
+  for (int64_t i = 0; i < 1000; i++) {
+    insertKeyAndValue(c, i, i);
+  }
+  EXPECT_TRUE(a == c);
+  EXPECT_FALSE(b == c);
+}
+
+TEST(HashArrayMappedTrieTest, CopyConstructorTest) {
+  HAMT hamt;
+  for (int64_t i = 0; i < 1000; i++) {
+    insertKeyAndValue(hamt, i, i);
+  }
+  HAMT copy(hamt);
+  EXPECT_TRUE(copy == hamt);
+  check_structure(copy);
+
+  // The copy doesn't share any trie with the original.
+  for (int64_t i = 0; i < 1000; i += 2) {
+    EXPECT_EQ(copy.erase(i), 1);
+  }
+  EXPECT_EQ(copy.size(), 500);
+  EXPECT_EQ(hamt.size(), 1000);
+  check_lookups(hamt, 1000);
+}
+
+TEST(HashArrayMappedTrieTest, FindBatchTest) {
+  find_batch_test<HAMT>(8192);
+  find_batch_test<foc::HashArrayMappedTrie<int64_t, int64_t, BadHashFunction>>(64);
+  find_batch_test<foc::HashArrayMappedTrie<int64_t, int64_t, IdentityFunction>>(8192);
+  find_batch_test<foc::HashArrayMappedTrie<int64_t, int64_t, ConstantFunction>>(64);
+
+  HAMT empty;
+  std::vector<int64_t> keys = {1, 2, 3};
+  std::vector<const int64_t *> values(keys.size(), &keys[0]);
+  empty.findBatch(keys, values);
+  for (auto value : values) {
+    EXPECT_EQ(value, nullptr);
+  }
+  empty.findBatch(foc::ArrayRef<int64_t>(), foc::MutableArrayRef<const int64_t *>());
+}
+
+TEST(HashArrayMappedTrieTest, BulkInsertTest) {
+  bulk_insert_test<HAMT>(10000);
+  bulk_insert_test<foc::HashArrayMappedTrie<int64_t, int64_t, BadHashFunction>>(2048);
+  bulk_insert_test<foc::HashArrayMappedTrie<int64_t, int64_t, IdentityFunction>>(10000);
+  bulk_insert_test<foc::HashArrayMappedTrie<int64_t, int64_t, ConstantFunction>>(100);
+  bulk_insert_test<HAMT>(1);
+
+  // Keys that don't fit in a collision node go to a chain of overflow nodes.
+  using ConstantHAMT = foc::HashArrayMappedTrie<int64_t, int64_t, ConstantFunction>;
+  std::vector<std::pair<int64_t, int64_t>> entries;
+  for (int64_t i = 0; i < 40; i++) {
+    entries.push_back(std::make_pair(i, i));
+  }
+  ConstantHAMT constant(entries.begin(), entries.end());
+  EXPECT_EQ(constant.size(), 40);
+  check_lookups(constant, 40);
+  check_canonical_form(constant);
+
+  // Inserting into a HAMT that isn't empty.
+  HAMT hamt;
+  insertKeyAndValue(hamt, 0, 1);
+  hamt.insert(entries.begin(), entries.end());
+  EXPECT_EQ(hamt.size(), 40);
+  check_lookups(hamt, 40);
+
+  // The range constructor.
+  HAMT built(entries.begin(), entries.end());
+  EXPECT_EQ(built.size(), 40);
+  check_lookups(built, 40);
+  HAMT empty(entries.begin(), entries.begin());
+  EXPECT_EQ(empty.size(), 0);
+  EXPECT_TRUE(empty.begin() == empty.end());
+}
+
+TEST(HashArrayMappedTrieTest, BuildParallelTest) {
+  bulk_insert_test<HAMT>(200000, 4);
+  bulk_insert_test<HAMT>(10000, 0);
+  bulk_insert_test<HAMT>(10000, 64);
+  bulk_insert_test<foc::HashArrayMappedTrie<int64_t, int64_t, BadHashFunction>>(2048, 4);
+  bulk_insert_test<foc::HashArrayMappedTrie<int64_t, int64_t, ConstantFunction>>(100, 4);
+  bulk_insert_test<HAMT>(1, 4);
+
+  std::vector<std::pair<int64_t, int64_t>> entries;
+  for (int64_t i = 0; i < 40; i++) {
+    entries.push_back(std::make_pair(i, i));
+  }
+  // Inserting into a HAMT that isn't empty.
+  HAMT hamt;
+  insertKeyAndValue(hamt, 0, 1);
+  hamt.build_parallel(entries.begin(), entries.end(), 4);
+  EXPECT_EQ(hamt.size(), 40);
+  check_lookups(hamt, 40);
+
+  HAMT empty;
+  empty.build_parallel(entries.begin(), entries.begin(), 4);
+  EXPECT_EQ(empty.size(), 0);
+  EXPECT_TRUE(empty.begin() == empty.end());
+}
+
+// Fails every allocation once remaining reaches zero.
+struct FailingAllocator {
+  static int remaining;
+
+  void *allocate(size_t size, size_t) { return remaining-- > 0 ? malloc(size) : nullptr; }
+  void deallocate(void *ptr, size_t) { free(ptr); }
+};
+
+int FailingAllocator::remaining = 0;
+
+TEST(HashArrayMappedTrieTest, FailedInsertUndoesSplitsTest) {
+  using HAMT = HashArrayMappedTrie<int64_t,
+                                   int64_t,
+                                   ConstantFunction,
+                                   std::equal_to<int64_t>,
+                                   FailingAllocator>;
+  // Inserting the second key splits the slot of the first one at every level
+  // down to the collision node. Run out of memory at each of these levels.
+  for (int allocations = 0; allocations < (int)foc::detail::hamt_collision_level; allocations++) {
+    FailingAllocator::remaining = 1000;
+    HAMT hamt;
+    insertKeyAndValue(hamt, 1, 1);
+    FailingAllocator::remaining = allocations;
+    EXPECT_TRUE(insertKeyAndValue(hamt, 2, 2) == hamt.end());
+    EXPECT_EQ(hamt.size(), 1);
+    EXPECT_EQ(hamt.find(2), nullptr);
+    EXPECT_EQ(*hamt.find(1), 1);
+    EXPECT_EQ(hamt.root().size(), 1);
+    EXPECT_TRUE(hamt.root().physicalIsEntry(0));
+
+    FailingAllocator::remaining = 1000;
+    EXPECT_TRUE(insertKeyAndValue(hamt, 2, 2) != hamt.end());
+    EXPECT_EQ(hamt.size(), 2);
+    EXPECT_EQ(*hamt.find(1), 1);
+    EXPECT_EQ(*hamt.find(2), 2);
+  }
+}
+
+TEST(HashArrayMappedTrieTest, FailedOverflowNodeTest) {
+  using HAMT = HashArrayMappedTrie<int64_t,
+                                   int64_t,
+                                   ConstantFunction,
+                                   std::equal_to<int64_t>,
+                                   FailingAllocator>;
+  FailingAllocator::remaining = 1000;
+  HAMT hamt;
+  const int64_t n = foc::detail::hamt_collision_node_entries;
+  for (int64_t i = 0; i < n; i++) {
+    insertKeyAndValue(hamt, i, i);
+  }
+  // The collision node is full and a new node can't be chained to it.
+  FailingAllocator::remaining = 0;
+  EXPECT_TRUE(insertKeyAndValue(hamt, n, n) == hamt.end());
+  FailingAllocator::remaining = 1000;
+  EXPECT_EQ(hamt.size(), n);
+  EXPECT_EQ(hamt.find(n), nullptr);
+  check_canonical_form(hamt);
+
+  EXPECT_TRUE(insertKeyAndValue(hamt, n, n) != hamt.end());
+  EXPECT_EQ(hamt.size(), n + 1);
+  check_lookups(hamt, n + 1);
+}
+
+// Fails the allocation that comes when countdown reaches zero, and only that
+// one. Safe to use from several threads.
+struct FailOnceAllocator {
+  static std::atomic<int> countdown;
+
+  void *allocate(size_t size, size_t) { return countdown-- == 0 ? nullptr : malloc(size); }
+  void deallocate(void *ptr, size_t) { free(ptr); }
+};
+
+std::atomic<int> FailOnceAllocator::countdown(-1);
+
+TEST(HashArrayMappedTrieTest, FailedBulkInsertTest) {
+  const int64_t n = 5000;
+  std::vector<std::pair<int64_t, int64_t>> entries;
+  for (int64_t i = 0; i < n; i++) {
+    entries.push_back(std::make_pair(i, -i));
+  }
+  for (int64_t i = 0; i < n; i++) {
+    entries.push_back(std::make_pair(i, i));
+  }
+
+  // The tries can't be built at once, so the entries are inserted one by one.
+  using FailOnceHAMT = HashArrayMappedTrie<int64_t,
+                                           int64_t,
+                                           std::hash<int64_t>,
+                                           std::equal_to<int64_t>,
+                                           FailOnceAllocator>;
+  for (int countdown : {0, 1, 10, 100}) {
+    for (uint32_t thread_count : {1, 4}) {
+      FailOnceAllocator::countdown = 1000000;
+      FailOnceHAMT hamt;
+      FailOnceAllocator::countdown = countdown;
+      EXPECT_TRUE(hamt.build_parallel(entries.begin(), entries.end(), thread_count));
+      EXPECT_EQ(hamt.size(), n);
+      check_structure(hamt);
+      check_canonical_form(hamt);
+    }
+  }
+
+  // Running out of memory in the middle of a chain of collision nodes.
+  using ConstantHAMT = HashArrayMappedTrie<int64_t,
+                                           int64_t,
+                                           ConstantFunction,
+                                           std::equal_to<int64_t>,
+                                           FailOnceAllocator>;
+  std::vector<std::pair<int64_t, int64_t>> colliding(entries.begin(), entries.begin() + 100);
+  for (int countdown : {12, 13, 14, 15}) {
+    FailOnceAllocator::countdown = 1000000;
+    ConstantHAMT hamt;
+    FailOnceAllocator::countdown = countdown;
+    EXPECT_TRUE(hamt.insert(colliding.begin(), colliding.end()));
+    EXPECT_EQ(hamt.size(), 100);
+    check_canonical_form(hamt);
+    for (int64_t i = 0; i < 100; i++) {
+      EXPECT_EQ(*hamt.find(i), -i);
+    }
+  }
+
+  // Out of memory for good. The entries that made it are in a valid HAMT.
+  using FailingHAMT = HashArrayMappedTrie<int64_t,
+                                          int64_t,
+                                          std::hash<int64_t>,
+                                          std::equal_to<int64_t>,
+                                          FailingAllocator>;
+  for (int remaining : {0, 50, 300}) {
+    FailingAllocator::remaining = 1000000;
+    FailingHAMT hamt;
+    FailingAllocator::remaining = remaining;
+    EXPECT_FALSE(hamt.insert(entries.begin(), entries.end()));
+    check_canonical_form(hamt);
+    size_t found_count = 0;
+    for (int64_t i = 0; i < n; i++) {
+      auto found = hamt.find(i);
+      if (found) {
+        EXPECT_EQ(*found, i);
+        found_count++;
+      }
+    }
+    EXPECT_EQ(hamt.size(), found_count);
+
+    FailingAllocator::remaining = 1000000;
+    EXPECT_TRUE(hamt.insert(entries.begin(), entries.end()));
+    EXPECT_EQ(hamt.size(), n);
+    check_structure(hamt);
+  }
+}
+
+// Counts the allocations and the bytes in use.
+struct CountingAllocator {
+  static size_t allocations;
+  static size_t bytes;
+
+  void *allocate(size_t size, size_t) {
+    allocations++;
+    bytes += size;
+    return malloc(size);
+  }
+  void deallocate(void *ptr, size_t size) {
+    bytes -= size;
+    free(ptr);
+  }
+};
+
+size_t CountingAllocator::allocations = 0;
+size_t CountingAllocator::bytes = 0;
+
+TEST(HashArrayMappedTrieTest, ReserveTest) {
+  using HAMT = HashArrayMappedTrie<int64_t,
+                                   int64_t,
+                                   std::hash<int64_t>,
+                                   std::equal_to<int64_t>,
+                                   CountingAllocator>;
+  const int64_t n = 100000;
+
+  CountingAllocator::allocations = 0;
+  HAMT growing;
+  for (int64_t i = 0; i < n; i++) {
+    insertKeyAndValue(growing, i, i);
+  }
+  const size_t growing_allocations = CountingAllocator::allocations;
+
+  CountingAllocator::allocations = 0;
+  HAMT reserved;
+  reserved._seed = growing._seed;
+  reserved.reserve(n);
+  EXPECT_EQ(reserved._root.capacity(), 32);
+  for (int64_t i = 0; i < n; i++) {
+    insertKeyAndValue(reserved, i, i);
+  }
+  // The tries of the first levels get their final capacity right away.
+  EXPECT_LT(CountingAllocator::allocations, growing_allocations * 3 / 4);
+  check_structure(reserved);
+  check_canonical_form(reserved);
+  EXPECT_TRUE(reserved == growing);
+
+  // Erases don't shrink the reserved tries.
+  for (int64_t i = 0; i < n - 1; i++) {
+    EXPECT_EQ(reserved.erase(i), 1);
+  }
+  EXPECT_EQ(reserved._root.capacity(), 32);
+  EXPECT_EQ(reserved.find(0), nullptr);
+  EXPECT_EQ(*reserved.find(n - 1), n - 1);
+
+  // The constructor reserves too.
+  CountingAllocator::allocations = 0;
+  HAMT constructed(n);
+  EXPECT_EQ(constructed._root.capacity(), 32);
+  for (int64_t i = 0; i < n; i++) {
+    insertKeyAndValue(constructed, i, i);
+  }
+  EXPECT_LT(CountingAllocator::allocations, growing_allocations * 3 / 4);
+  check_lookups(constructed, n);
+
+  // Reserving in a HAMT that isn't empty grows the root.
+  HAMT small;
+  for (int64_t i = 0; i < 4; i++) {
+    insertKeyAndValue(small, i, i);
+  }
+  EXPECT_LT(small._root.capacity(), 32);
+  small.reserve(n);
+  EXPECT_EQ(small._root.capacity(), 32);
+  check_structure(small);
+  check_lookups(small, 4);
+}
+
+template <class BitmapTrie>
+static void expect_tries_fit(const BitmapTrie &trie) {
+  EXPECT_EQ(trie.capacity(), trie.size());
+  for (uint32_t i = trie.entryCount(); i < trie.size(); i++) {
+    expect_tries_fit(trie.physicalGet(i).asTrie());
+  }
+}
+
+TEST(HashArrayMappedTrieTest, ShrinkToFitTest) {
+  using HAMT = HashArrayMappedTrie<int64_t,
+                                   int64_t,
+                                   std::hash<int64_t>,
+                                   std::equal_to<int64_t>,
+                                   CountingAllocator>;
+  const int64_t n = 100000;
+  std::vector<std::pair<int64_t, int64_t>> entries;
+  for (int64_t i = 0; i < n; i++) {
+    entries.push_back(std::make_pair(i, i));
+  }
+
+  CountingAllocator::bytes = 0;
+  HAMT hamt(entries.begin(), entries.end());
+  const size_t loaded_bytes = CountingAllocator::bytes;
+  hamt.shrink_to_fit();
+  expect_tries_fit(hamt._root);
+  EXPECT_LT(CountingAllocator::bytes, loaded_bytes);
+  check_structure(hamt);
+  check_canonical_form(hamt);
+  HAMT incremental;
+  incremental._seed = hamt._seed;
+  for (const auto &entry : entries) {
+    insertKeyAndValue(incremental, entry.first, entry.second);
+  }
+  EXPECT_TRUE(hamt == incremental);
+
+  // Inserts and erases grow and shrink the arrays as usual.
+  for (int64_t i = 0; i < n; i += 2) {
+    EXPECT_EQ(hamt.erase(i), 1);
+  }
+  for (int64_t i = n; i < n + 1000; i++) {
+    insertKeyAndValue(hamt, i, i);
+  }
+  check_canonical_form(hamt);
+  for (int64_t i = 0; i < n + 1000; i++) {
+    auto found = hamt.find(i);
+    if (i < n && i % 2 == 0) {
+      EXPECT_EQ(found, nullptr);
+    } else {
+      ASSERT_NE(found, nullptr);
+      EXPECT_EQ(*found, i);
+    }
+  }
+
+  // An empty HAMT gives back the array of the root.
+  HAMT empty;
+  empty.shrink_to_fit();
+  EXPECT_EQ(empty._root.capacity(), 0);
+  insertKeyAndValue(empty, 1, 1);
+  EXPECT_EQ(*empty.find(1), 1);
+
+  // Arenas can't take the arrays back.
+  using ArenaHAMT = HashArrayMappedTrie<int64_t,
+                                        int64_t,
+                                        std::hash<int64_t>,
+                                        std::equal_to<int64_t>,
+                                        BumpArenaAllocator>;
+  ArenaHAMT arena_hamt(entries.begin(), entries.end());
+  const size_t arena_bytes = arena_hamt.get_allocator().allocatedBytes();
+  arena_hamt.shrink_to_fit();
+  EXPECT_EQ(arena_hamt.get_allocator().allocatedBytes(), arena_bytes);
+  check_lookups(arena_hamt, n);
+}
+
+TEST(HashArrayMappedTrieTest, FreezeTest) {
+  using HAMT = HashArrayMappedTrie<int64_t,
+                                   int64_t,
+                                   std::hash<int64_t>,
+                                   std::equal_to<int64_t>,
+                                   CountingAllocator>;
+  const int64_t n = 100000;
+  CountingAllocator::bytes = 0;
+  {
+    HAMT hamt;
+    for (int64_t i = 0; i < n; i++) {
+      insertKeyAndValue(hamt, i, i);
+    }
+    HAMT copy(hamt);
+    copy.shrink_to_fit();
+
+    CountingAllocator::allocations = 0;
+    hamt.freeze();
+    EXPECT_TRUE(hamt.frozen());
+    EXPECT_EQ(CountingAllocator::allocations, 1);
+    EXPECT_EQ(hamt._image_size, hamt._root.fittedSizeRecursively());
+    expect_tries_fit(hamt._root);
+    // The root comes first, then the tries of the next level.
+    EXPECT_EQ(reinterpret_cast<char *>(&hamt._root.physicalGet(0)) - hamt._image,
+              HAMT::BitmapTrie::allocationSize(0));
+    EXPECT_EQ(reinterpret_cast<char *>(&hamt._root.physicalGet(0).asTrie().physicalGet(0)),
+              hamt._image + HAMT::BitmapTrie::allocationSize(32) +
+                  HAMT::BitmapTrie::allocationSize(0));
+    check_structure(hamt);
+    check_canonical_form(hamt);
+    std::vector<int64_t> keys = {n - 1, n, 0, 7};
+    std::vector<const int64_t *> values(keys.size(), nullptr);
+    hamt.findBatch(keys, values);
+    for (size_t i = 0; i < keys.size(); i++) {
+      EXPECT_EQ(values[i], hamt.find(keys[i]));
+    }
+    EXPECT_TRUE(hamt == copy);
+    hamt.freeze();
+    EXPECT_EQ(CountingAllocator::allocations, 1);
+
+    // Copies and moves.
+    HAMT frozen_copy(hamt);
+    EXPECT_FALSE(frozen_copy.frozen());
+    EXPECT_TRUE(frozen_copy == hamt);
+    HAMT moved(std::move(hamt));
+    EXPECT_TRUE(moved.frozen());
+    EXPECT_FALSE(hamt.frozen());
+    EXPECT_TRUE(moved == copy);
+    hamt.swap(moved);
+    EXPECT_TRUE(hamt.frozen());
+    EXPECT_FALSE(moved.frozen());
+    frozen_copy.freeze();
+    frozen_copy = hamt;
+    EXPECT_FALSE(frozen_copy.frozen());
+    frozen_copy.freeze();
+    moved.freeze();
+    moved = std::move(frozen_copy);
+    EXPECT_TRUE(moved.frozen());
+    EXPECT_TRUE(moved == copy);
+
+    // Changes thaw the HAMT first.
+    for (int64_t i = 0; i < n; i += 2) {
+      EXPECT_EQ(hamt.erase(i), 1);
+      EXPECT_EQ(copy.erase(i), 1);
+    }
+    EXPECT_FALSE(hamt.frozen());
+    hamt.freeze();
+    for (int64_t i = n; i < n + 1000; i++) {
+      insertKeyAndValue(hamt, i, i);
+      insertKeyAndValue(copy, i, i);
+    }
+    EXPECT_FALSE(hamt.frozen());
+    check_canonical_form(hamt);
+    EXPECT_TRUE(hamt == copy);
+    hamt.freeze();
+    hamt.reserve(2 * n);
+    EXPECT_FALSE(hamt.frozen());
+    EXPECT_TRUE(hamt == copy);
+
+    moved.clear();
+    EXPECT_FALSE(moved.frozen());
+    EXPECT_TRUE(moved.empty());
+    moved.freeze();
+    EXPECT_FALSE(moved.frozen());
+    std::vector<std::pair<int64_t, int64_t>> entries = {{1, 1}, {2, 2}};
+    moved.insert(entries.begin(), entries.end());
+    moved.freeze();
+    EXPECT_TRUE(moved.frozen());
+    check_lookups(moved, 0);
+    EXPECT_EQ(*moved.find(2), 2);
+  }
+  // The frozen HAMTs give their images back.
+  EXPECT_EQ(CountingAllocator::bytes, 0);
+}
+
+TEST(HashArrayMappedTrieTest, FreezeTestConstantFunction) {
+  using HAMT = HashArrayMappedTrie<int64_t,
+                                   int64_t,
+                                   ConstantFunction,
+                                   std::equal_to<int64_t>,
+                                   CountingAllocator>;
+  const int64_t n = 100;
+  CountingAllocator::bytes = 0;
+  {
+    // The chain of collision nodes is carved out of the image too.
+    HAMT hamt;
+    for (int64_t i = 0; i < n; i++) {
+      insertKeyAndValue(hamt, i, i);
+    }
+    hamt.freeze();
+    EXPECT_TRUE(hamt.frozen());
+    expect_tries_fit(hamt._root);
+    check_lookups(hamt, n);
+    check_canonical_form(hamt);
+
+    HAMT thawed(hamt);
+    thawed.freeze();
+    EXPECT_EQ(thawed.erase(0), 1);
+    EXPECT_FALSE(thawed.frozen());
+    check_canonical_form(thawed);
+    EXPECT_EQ(thawed.size(), n - 1);
+  }
+  EXPECT_EQ(CountingAllocator::bytes, 0);
+}
+
+TEST(HashArrayMappedTrieTest, FailedThawTest) {
+  using HAMT = HashArrayMappedTrie<int64_t,
+                                   int64_t,
+                                   std::hash<int64_t>,
+                                   std::equal_to<int64_t>,
+                                   FailingAllocator>;
+  const int64_t n = 10000;
+  FailingAllocator::remaining = 1000000;
+  HAMT hamt;
+  for (int64_t i = 0; i < n; i++) {
+    insertKeyAndValue(hamt, i, i);
+  }
+  hamt.freeze();
+  ASSERT_TRUE(hamt.frozen());
+
+  // Run out of memory halfway through thawing. The HAMT stays frozen and
+  // unchanged.
+  FailingAllocator::remaining = 100;
+  EXPECT_TRUE(insertKeyAndValue(hamt, n, n) == hamt.end());
+  EXPECT_EQ(hamt.erase(0), 0);
+  hamt.reserve(2 * n);
+  EXPECT_TRUE(hamt.frozen());
+  EXPECT_EQ(hamt.size(), n);
+  check_lookups(hamt, n);
+  EXPECT_EQ(hamt.find(n), nullptr);
+
+  FailingAllocator::remaining = 1000000;
+  EXPECT_TRUE(insertKeyAndValue(hamt, n, n) != hamt.end());
+  EXPECT_FALSE(hamt.frozen());
+  EXPECT_EQ(hamt.erase(0), 1);
+  check_canonical_form(hamt);
+  EXPECT_EQ(*hamt.find(n), n);
+}
+
+// Counts the copies of its instances.
+struct CopyCounter {
+  static int copies;
+  static int moves;
+  std::vector<int> data;
+
+  CopyCounter() {}
+  explicit CopyCounter(int n) : data(n, n) {}
+  CopyCounter(const CopyCounter &other) : data(other.data) { copies++; }
+  CopyCounter(CopyCounter &&other) : data(std::move(other.data)) { moves++; }
+  CopyCounter &operator=(const CopyCounter &other) {
+    data = other.data;
+    copies++;
+    return *this;
+  }
+  CopyCounter &operator=(CopyCounter &&other) = default;
+};
+
+int CopyCounter::copies = 0;
+int CopyCounter::moves = 0;
+
+TEST(HashArrayMappedTrieTest, EmplaceTest) {
+  HashArrayMappedTrie<int64_t, CopyCounter> hamt;
+  CopyCounter::copies = 0;
+  for (int64_t i = 0; i < 1000; i++) {
+    auto result = hamt.emplace(i, CopyCounter(i % 10));
+    EXPECT_TRUE(result.second);
+    EXPECT_EQ(result.first->first, i);
+    EXPECT_EQ(result.first->second.data.size(), i % 10);
+  }
+  EXPECT_EQ(hamt.size(), 1000);
+  EXPECT_EQ(CopyCounter::copies, 0);
+
+  // A key and a value, or a pair of them, are moved straight into the slot,
+  // even if the key has to be converted first. (The first entry of a HAMT
+  // isn't moved by inserts that grow the root.)
+  {
+    HashArrayMappedTrie<int64_t, CopyCounter> single;
+    CopyCounter::moves = 0;
+    single.emplace(int64_t(1), CopyCounter(1));
+    EXPECT_EQ(CopyCounter::moves, 1);
+  }
+  {
+    HashArrayMappedTrie<int64_t, CopyCounter> single;
+    CopyCounter::moves = 0;
+    single.emplace(1, CopyCounter(1));
+    EXPECT_EQ(CopyCounter::moves, 1);
+  }
+  {
+    HashArrayMappedTrie<int64_t, CopyCounter> single;
+    std::pair<int64_t, CopyCounter> entry(1, CopyCounter(1));
+    CopyCounter::moves = 0;
+    single.emplace(std::move(entry));
+    EXPECT_EQ(CopyCounter::moves, 1);
+    EXPECT_EQ(single.find(1)->data.size(), 1);
+  }
+  {
+    HashArrayMappedTrie<int64_t, CopyCounter> single;
+    std::pair<int64_t, CopyCounter> entry(1, CopyCounter(1));
+    CopyCounter::moves = 0;
+    single.emplace(entry);
+    EXPECT_EQ(CopyCounter::moves, 0);
+    EXPECT_EQ(CopyCounter::copies, 1);
+    EXPECT_EQ(entry.second.data.size(), 1);
+    CopyCounter::copies = 0;
+  }
+  // Other args construct an entry that is then moved.
+  auto piecewise =
+      hamt.emplace(std::piecewise_construct, std::forward_as_tuple(2000), std::forward_as_tuple(3));
+  EXPECT_TRUE(piecewise.second);
+  EXPECT_EQ(hamt.find(2000)->data.size(), 3);
+  EXPECT_EQ(hamt.erase(2000), 1);
+
+  // emplace and try_emplace leave existing keys alone.
+  auto result = hamt.emplace(3, CopyCounter(1));
+  EXPECT_FALSE(result.second);
+  EXPECT_EQ(result.first->second.data.size(), 3);
+  result = hamt.try_emplace(4, 1);
+  EXPECT_FALSE(result.second);
+  EXPECT_EQ(hamt.find(4)->data.size(), 4);
+  CopyCounter moved_from(8);
+  result = hamt.try_emplace(5, std::move(moved_from));
+  EXPECT_FALSE(result.second);
+  EXPECT_EQ(moved_from.data.size(), 8);
+
+  result = hamt.try_emplace(1000, 2);
+  EXPECT_TRUE(result.second);
+  EXPECT_EQ(result.first->first, 1000);
+  EXPECT_EQ(hamt.find(1000)->data.size(), 2);
+
+  // insert_or_assign replaces the values of existing keys.
+  result = hamt.insert_or_assign(6, CopyCounter(1));
+  EXPECT_FALSE(result.second);
+  EXPECT_EQ(hamt.find(6)->data.size(), 1);
+  result = hamt.insert_or_assign(1001, CopyCounter(1));
+  EXPECT_TRUE(result.second);
+  EXPECT_EQ(hamt.size(), 1002);
+
+  // As does insert, which moves rvalues.
+  auto it = hamt.insert(std::make_pair(7, CopyCounter(2)));
+  EXPECT_EQ(it->second.data.size(), 2);
+  hamt.insert(std::make_pair(1002, CopyCounter(2)));
+  EXPECT_EQ(hamt.size(), 1003);
+  EXPECT_EQ(CopyCounter::copies, 0);
+
+  std::pair<const int64_t, CopyCounter> entry(1003, CopyCounter(3));
+  hamt.insert(entry);
+  EXPECT_EQ(CopyCounter::copies, 1);
+}
+
+TEST(HashArrayMappedTrieTest, InsertIteratorTest) {
+  // The iterator returned by insert continues the traversal from the new entry
+  // even when inserting it split a slot into a sub-trie.
+  HAMT hamt;
+  for (int64_t i = 0; i < 512; i++) {
+    auto it = insertKeyAndValue(hamt, i, i);
+    std::vector<int64_t> keys;
+    for (const auto &entry : hamt) {
+      keys.push_back(entry.first);
+    }
+    size_t position = std::find(keys.begin(), keys.end(), i) - keys.begin();
+    size_t remaining = 0;
+    for (; it != hamt.end(); ++it) {
+      ASSERT_LT(position + remaining, keys.size());
+      EXPECT_EQ(it->first, keys[position + remaining]);
+      remaining++;
+    }
+    EXPECT_EQ(position + remaining, keys.size());
+  }
+}
+
+// Hashes std::string keys and views of characters alike.
+struct TransparentStringHash {
+  typedef void is_transparent;
+
+  size_t operator()(foc::ArrayRef<char> s) const {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (char c : s) {
+      hash = (hash ^ (unsigned char)c) * 0x100000001b3ULL;
+    }
+    return hash;
+  }
+  size_t operator()(const std::string &s) const {
+    return (*this)(foc::ArrayRef<char>(s.data(), s.size()));
+  }
+};
+
+struct TransparentStringEqual {
+  typedef void is_transparent;
+
+  bool operator()(const std::string &a, const std::string &b) const { return a == b; }
+  bool operator()(const std::string &a, foc::ArrayRef<char> b) const {
+    return a.size() == b.size() && std::equal(b.begin(), b.end(), a.begin());
+  }
+};
+
+TEST(HashArrayMappedTrieTest, TransparentLookupTest) {
+  HashArrayMappedTrie<std::string, int, TransparentStringHash, TransparentStringEqual> hamt;
+  for (int i = 0; i < 1000; i++) {
+    hamt.insert(std::make_pair("key" + std::to_string(i), i));
+  }
+
+  // Lookups by views of a buffer holding many keys.
+  std::string buffer;
+  std::vector<foc::ArrayRef<char>> views;
+  for (int i = 0; i < 2000; i++) {
+    buffer += "key" + std::to_string(i);
+  }
+  for (size_t begin = 0, i = 0; i < 2000; i++) {
+    size_t length = 3 + std::to_string(i).size();
+    views.push_back(foc::ArrayRef<char>(buffer.data() + begin, length));
+    begin += length;
+  }
+  for (int i = 0; i < 2000; i++) {
+    const int *value = hamt.find(views[i]);
+    if (i < 1000) {
+      ASSERT_TRUE(value != nullptr);
+      EXPECT_EQ(*value, i);
+    } else {
+      EXPECT_EQ(value, nullptr);
+    }
+  }
+
+  std::vector<const int *> values(views.size(), nullptr);
+  hamt.findBatch(foc::ArrayRef<foc::ArrayRef<char>>(views), values);
+  for (int i = 0; i < 2000; i++) {
+    EXPECT_EQ(values[i], hamt.find("key" + std::to_string(i)));
+  }
+
+  for (int i = 0; i < 2000; i += 2) {
+    EXPECT_EQ(hamt.erase(views[i]), i < 1000 ? 1 : 0);
+  }
+  EXPECT_EQ(hamt.size(), 500);
+  EXPECT_EQ(hamt.find(views[2]), nullptr);
+  EXPECT_EQ(*hamt.find(views[3]), 3);
+}
+
+struct CachedBadHashFunction : BadHashFunction {};
+struct CachedConstantFunction : ConstantFunction {};
+
+// Counts the strings it hashes.
+struct CountingStringHash {
+  static size_t calls;
+  size_t operator()(const std::string &key) const {
+    calls++;
+    return std::hash<std::string>()(key);
+  }
+};
+
+size_t CountingStringHash::calls = 0;
+
+struct CachedCountingStringHash : CountingStringHash {};
+
+namespace foc {
+template <>
+struct hamt_cache_hash<CachedBadHashFunction> : std::true_type {};
+template <>
+struct hamt_cache_hash<CachedConstantFunction> : std::true_type {};
+template <>
+struct hamt_cache_hash<CachedCountingStringHash> : std::true_type {};
+}  // namespace foc
+
+TEST(HashArrayMappedTrieTest, CachedHashTest) {
+  using CachedHAMT = HashArrayMappedTrie<int64_t, int64_t, CachedBadHashFunction>;
+  insert_test<CachedHAMT>(64);
+  erase_test<CachedHAMT>(64);
+  iteration_test<CachedHAMT>(64);
+  using ConstantHAMT = HashArrayMappedTrie<int64_t, int64_t, CachedConstantFunction>;
+  insert_test<ConstantHAMT>(64);
+  erase_test<ConstantHAMT>(64);
+  find_batch_test<ConstantHAMT>(64);
+  bulk_insert_test<CachedHAMT>(2048);
+  bulk_insert_test<ConstantHAMT>(32);
+}
+
+TEST(HashArrayMappedTrieTest, CachedHashSkipsRehashingTest) {
+  std::vector<std::string> keys;
+  for (int i = 0; i < 10000; i++) {
+    keys.push_back("https://example.com/" + std::to_string(i));
+  }
+
+  // Without the cache, the keys already in a slot are hashed again when a
+  // new key collides with them.
+  HashArrayMappedTrie<std::string, int, CountingStringHash> hamt;
+  CountingStringHash::calls = 0;
+  for (int i = 0; i < 10000; i++) {
+    hamt.insert(std::make_pair(keys[i], i));
+  }
+  EXPECT_GT(CountingStringHash::calls, keys.size());
+
+  HashArrayMappedTrie<std::string, int, CachedCountingStringHash> cached;
+  CountingStringHash::calls = 0;
+  for (int i = 0; i < 10000; i++) {
+    cached.insert(std::make_pair(keys[i], i));
+  }
+  EXPECT_EQ(CountingStringHash::calls, keys.size());
+
+  for (int i = 0; i < 10000; i++) {
+    ASSERT_TRUE(cached.find(keys[i]) != nullptr);
+    EXPECT_EQ(*cached.find(keys[i]), i);
+    EXPECT_EQ(cached.find(keys[i] + "/"), nullptr);
+  }
+  for (int i = 0; i < 10000; i += 2) {
+    EXPECT_EQ(cached.erase(keys[i]), 1);
+  }
+  EXPECT_EQ(cached.size(), 5000);
+  for (const auto &entry : cached) {
+    EXPECT_EQ(entry.second % 2, 1);
+    EXPECT_EQ(entry.first, keys[entry.second]);
   }
 }
@@ -1,4 +1,5 @@
 #include <queue>
+#include <set>
 #include <vector>
 
 using foc::HashArrayMappedTrie;
@@ -13,7 +14,7 @@ static void print_bitmap_indexed_node(typename HAMT::BitmapTrie &trie, std::stri
   for (int i = 0; i < 32; i++) {
     if (trie.logicalPositionTaken(i)) {
       auto &node = trie.logicalGet(i);
-      if (node.isEntry()) {
+      if (trie.logicalIsEntry(i)) {
         printf("%3lld ", node.asEntry().second);
       } else {
         printf("[ ] ");
@@ -32,7 +33,7 @@ static void print_bitmap_indexed_node(typename HAMT::BitmapTrie &trie, std::stri
 
 template <class HAMT>
 static void print_hamt(HAMT &hamt) {
-  print_bitmap_indexed_node<HAMT>(hamt.root().asTrie(), "");
+  print_bitmap_indexed_node<HAMT>(hamt.root(), "");
   putchar('\n');
 }
 
@@ -43,7 +44,7 @@ static void print_stats(HAMT &hamt) {
   int stats[33];
   memset(stats, 0, sizeof(stats));
 
-  q.push(&hamt.root().asTrie());
+  q.push(&hamt.root());
   while (!q.empty()) {
     auto trie = q.front();
     q.pop();
@@ -52,9 +53,8 @@ static void print_stats(HAMT &hamt) {
 
     for (int i = 0; i < 32; i++) {
       if (trie->logicalPositionTaken(i)) {
-        auto &node = trie->logicalGet(i);
-        if (node.isTrie()) {
-          q.push(&node.asTrie());
+        if (trie->logicalIsTrie(i)) {
+          q.push(&trie->logicalGet(i).asTrie());
         }
       }
     }
@@ -88,42 +88,32 @@ typename HAMT::iterator insertKeyAndValue(HAMT &hamt,
 // Property checking helpers
 
 template <class HAMT>
-static void check_parent_pointers(HAMT &hamt) {
-  // From each trie node, check if its children point to the trie node.
-  EXPECT_EQ(hamt._root.parent(), nullptr);
-  std::queue<typename HAMT::Node *> q;
-  q.push(&hamt._root);
+static void check_structure(HAMT &hamt) {
+  // Count the entries reachable from the root and make sure no logical
+  // position is both an entry and a trie.
+  std::queue<typename HAMT::BitmapTrie *> q;
+  q.push(&hamt.root());
   size_t bfs_count = 0;
   while (!q.empty()) {
-    auto *node = q.front();
+    auto *trie = q.front();
     q.pop();
-    if (node->isTrie()) {
-      auto *trie = &node->asTrie();
-      for (uint32_t i = 0; i < trie->size(); i++) {
-        auto *child_node = &trie->physicalGet(i);
-        EXPECT_EQ(child_node->parent(), node);
-        if (child_node->isTrie()) {
-          q.push(child_node);
-        } else {
-          bfs_count++;
-        }
+    EXPECT_EQ(trie->datamap() & trie->nodemap(), 0);
+    for (uint32_t i = 0; i < trie->size(); i++) {
+      if (trie->physicalIsTrie(i)) {
+        q.push(&trie->physicalGet(i).asTrie());
+      } else {
+        bfs_count++;
       }
     }
   }
   EXPECT_EQ(bfs_count, hamt.size());
 
-  // For each entry node (leave), make sure the root is reachable through the _parent
-  // pointers.
-  for (int64_t i = 0; i < hamt.size(); i++) {
+  // Every inserted entry can be found.
+  for (int64_t i = 0; i < (int64_t)hamt.size(); i++) {
     const typename HAMT::Node *node = hamt.findNode(i);
     EXPECT_TRUE(node != nullptr);
     EXPECT_TRUE(node->asEntry().first == i);
     EXPECT_TRUE(node->asEntry().second == i);
-
-    do {
-      // Make sure you can find the root from the node
-      node = node->parent();
-    } while (node != &hamt.root());
   }
 }
 
@@ -136,6 +126,40 @@ static void check_lookups(HAMT &hamt, int64_t n) {
   }
 }
 
+template <class HAMT>
+static void check_canonical_form(HAMT &hamt) {
+  // A sub-trie should never be left with a single entry because it would have
+  // been collapsed into its parent by erase. Only the last node of a chain of
+  // collision nodes can have room left.
+  std::queue<std::pair<typename HAMT::BitmapTrie *, uint32_t>> q;
+  q.push(std::make_pair(&hamt.root(), 0));
+  size_t entry_count = 0;
+  while (!q.empty()) {
+    auto trie = q.front().first;
+    uint32_t level = q.front().second;
+    q.pop();
+    if (level > foc::detail::hamt_collision_level) {
+      EXPECT_GE(trie->entryCount(), 1);
+    } else if (trie != &hamt.root()) {
+      EXPECT_GE(trie->size(), 1);
+      EXPECT_FALSE(trie->size() == 1 && trie->physicalIsEntry(0));
+    }
+    if (level >= foc::detail::hamt_collision_level && trie->trieCount() > 0) {
+      EXPECT_EQ(trie->entryCount(), foc::detail::hamt_collision_node_entries);
+      EXPECT_TRUE(trie->logicalIsTrie(31));
+    }
+    EXPECT_GE(trie->capacity(), trie->size());
+    for (uint32_t i = 0; i < trie->size(); i++) {
+      if (trie->physicalIsTrie(i)) {
+        q.push(std::make_pair(&trie->physicalGet(i).asTrie(), level + 1));
+      } else {
+        entry_count++;
+      }
+    }
+  }
+  EXPECT_EQ(entry_count, hamt.size());
+}
+
 // Custom hash functions used in tests
 
 struct BadHashFunction {
@@ -153,11 +177,11 @@ struct ConstantFunction {
 // Parameterized test functions
 
 template <class HAMT>
-static void parent_test(int64_t n) {
+static void insert_test(int64_t n) {
   HAMT hamt;
 
   // Insert many items into the HAMT and check
-  // the parent pointers after every insertion.
+  // the structure after every insertion.
   for (int64_t i = 0; i < n; i++) {
     auto it = insertKeyAndValue(hamt, i, i);
     if (it == nullptr) {
@@ -169,6 +193,165 @@ static void parent_test(int64_t n) {
       EXPECT_TRUE(found != nullptr);
       EXPECT_EQ(*found, i);
     }
-    check_parent_pointers(hamt);
+    check_structure(hamt);
+  }
+}
+
+template <class HAMT>
+static void erase_test(int64_t n) {
+  HAMT hamt;
+  for (int64_t i = 0; i < n; i++) {
+    insertKeyAndValue(hamt, i, i);
+  }
+  size_t inserted = hamt.size();
+
+  // Erase the odd keys and make sure the even ones can still be found.
+  for (int64_t i = 1; i < n; i += 2) {
+    bool was_inserted = hamt.find(i) != nullptr;
+    EXPECT_EQ(hamt.erase(i), was_inserted ? 1 : 0);
+    EXPECT_EQ(hamt.find(i), nullptr);
+    EXPECT_EQ(hamt.erase(i), 0);
+    if (was_inserted) {
+      inserted--;
+    }
+    EXPECT_EQ(hamt.size(), inserted);
+  }
+  check_canonical_form(hamt);
+  for (int64_t i = 0; i < n; i += 2) {
+    auto found = hamt.find(i);
+    if (found) {
+      EXPECT_EQ(*found, i);
+    }
+  }
+
+  // Erase everything else.
+  for (int64_t i = 0; i < n; i += 2) {
+    hamt.erase(i);
+    EXPECT_EQ(hamt.find(i), nullptr);
+  }
+  EXPECT_EQ(hamt.size(), 0);
+  EXPECT_EQ(hamt.root().size(), 0);
+
+  // The HAMT is still usable after being emptied by erase.
+  for (int64_t i = 0; i < n; i++) {
+    insertKeyAndValue(hamt, i, i);
+  }
+  check_canonical_form(hamt);
+}
+
+template <class HAMT>
+static void iteration_test(int64_t n) {
+  HAMT hamt;
+  EXPECT_TRUE(hamt.begin() == hamt.end());
+
+  std::set<int64_t> inserted;
+  for (int64_t i = 0; i < n; i++) {
+    auto it = insertKeyAndValue(hamt, i, i);
+    if (it != nullptr) {
+      EXPECT_EQ(it->first, i);
+      inserted.insert(i);
+    }
+  }
+
+  // Every entry is visited exactly once.
+  std::set<int64_t> visited;
+  for (const auto &entry : hamt) {
+    EXPECT_EQ(entry.first, entry.second);
+    EXPECT_TRUE(visited.insert(entry.first).second);
+  }
+  EXPECT_EQ(visited, inserted);
+  EXPECT_EQ(visited.size(), hamt.size());
+
+  // The iterator returned by insert can be used to continue the traversal.
+  for (int64_t i = 0; i < n; i += 7) {
+    auto it = insertKeyAndValue(hamt, i, i);
+    if (it == nullptr) {
+      continue;
+    }
+    size_t remaining = 0;
+    for (; it != hamt.end(); it++) {
+      EXPECT_EQ(inserted.count(it->first), 1);
+      remaining++;
+    }
+    EXPECT_LE(remaining, hamt.size());
+  }
+
+  // Iteration after erasing half of the keys.
+  for (int64_t i = 0; i < n; i += 2) {
+    if (hamt.erase(i)) {
+      inserted.erase(i);
+    }
+  }
+  visited.clear();
+  for (auto it = hamt.cbegin(); it != hamt.cend(); ++it) {
+    EXPECT_TRUE(visited.insert((*it).first).second);
+  }
+  EXPECT_EQ(visited, inserted);
+}
+
+template <class HAMT>
+static void find_batch_test(int64_t n) {
+  HAMT hamt;
+  for (int64_t i = 0; i < n; i += 2) {
+    insertKeyAndValue(hamt, i, i);
+  }
+
+  // Half of the keys are missing.
+  std::vector<int64_t> keys;
+  for (int64_t i = 0; i < n; i++) {
+    keys.push_back(i);
+  }
+  std::vector<const int64_t *> values(keys.size(), nullptr);
+  hamt.findBatch(keys, values);
+  for (size_t i = 0; i < keys.size(); i++) {
+    EXPECT_EQ(values[i], hamt.find(keys[i]));
+  }
+
+  // Batches smaller than the number of lookups in flight.
+  std::vector<int64_t> few_keys = {n - 2, 1, 0};
+  std::vector<const int64_t *> few_values(few_keys.size(), nullptr);
+  hamt.findBatch(few_keys, few_values);
+  for (size_t i = 0; i < few_keys.size(); i++) {
+    EXPECT_EQ(few_values[i], hamt.find(few_keys[i]));
+  }
+}
+
+// Builds the HAMT with build_parallel() if thread_count isn't 1.
+template <class HAMT>
+static void bulk_insert_test(int64_t n, uint32_t thread_count = 1) {
+  // Every key appears twice and the last value wins.
+  std::vector<std::pair<int64_t, int64_t>> entries;
+  for (int64_t i = 0; i < n; i++) {
+    entries.push_back(std::make_pair(i, -i));
+  }
+  for (int64_t i = n - 1; i >= 0; i--) {
+    entries.push_back(std::make_pair(i, i));
+  }
+
+  HAMT incremental;
+  for (const auto &entry : entries) {
+    insertKeyAndValue(incremental, entry.first, entry.second);
+  }
+  HAMT bulk;
+  bulk._seed = incremental._seed;
+  if (thread_count == 1) {
+    bulk.insert(entries.begin(), entries.end());
+  } else {
+    bulk.build_parallel(entries.begin(), entries.end(), thread_count);
+  }
+  check_structure(bulk);
+  check_canonical_form(bulk);
+  EXPECT_EQ(bulk.size(), incremental.size());
+  EXPECT_TRUE(bulk == incremental);
+
+  // The HAMT keeps working as usual.
+  for (int64_t i = 0; i < n; i += 2) {
+    EXPECT_EQ(bulk.erase(i), incremental.erase(i));
+  }
+  for (int64_t i = n; i < n + 16; i++) {
+    insertKeyAndValue(bulk, i, i);
+    insertKeyAndValue(incremental, i, i);
   }
+  check_canonical_form(bulk);
+  EXPECT_TRUE(bulk == incremental);
 }
@@ -0,0 +1,560 @@
+// Persistent Hash Array Mapped Trie
+//
+// An immutable HAMT: insert() and erase() leave the map untouched and return a
+// new version of it. The versions share every trie that is not in the path
+// from the root to the modified entry, so a new version costs O(log32 n) time
+// and memory, and so does taking a snapshot (a copy).
+//
+// Base arrays are reference counted with atomic counters: a version can be read
+// and destroyed in any thread while other threads keep their own versions.
+// Publishing a new version to other threads needs the usual synchronization.
+//
+// Many updates in a row are better done through a Transient (see transient()),
+// which copies each trie at most once and modifies it in place afterwards.
+#pragma once
+
+#include "hash_array_mapped_trie.h"
+
+namespace foc {
+
+template <class Key,
+          class T,
+          class Hash = std::hash<Key>,
+          class KeyEqual = std::equal_to<Key>,
+          class Allocator = MallocAllocator>
+class PersistentHashArrayMappedTrie {
+  // clang-format off
+ PUBLIC_IN_GTEST:
+  using Entry = std::pair<Key, T>;
+  // clang-format on
+  using BitmapTrie = detail::BitmapTrieTemplate<Entry, Allocator>;
+  using Node = detail::NodeTemplate<Entry, Allocator>;
+
+ public:
+  // clang-format off
+  typedef Key                                               key_type;
+  typedef T                                                 mapped_type;
+  typedef Hash                                              hasher;
+  typedef KeyEqual                                          key_equal;
+  typedef Allocator                                         allocator_type;
+  typedef std::pair<const Key, T>                           value_type;
+  typedef size_t                                            size_type;
+  typedef HAMTConstForwardIterator<Entry, Allocator>        iterator;
+  typedef HAMTConstForwardIterator<Entry, Allocator>        const_iterator;
+  // clang-format on
+
+ PUBLIC_IN_GTEST:
+  size_type _count;
+  BitmapTrie _root;
+  uint64_t _seed;
+  Hash _hasher;
+  KeyEqual _key_equal;
+  // Every version derived from a map shares its tries and has to use the same
+  // allocator (or a copy of it that can free what the original allocated).
+  Allocator _allocator;
+
+ public:
+  explicit PersistentHashArrayMappedTrie(const hasher &hf = hasher(),
+                                         const key_equal &eql = key_equal(),
+                                         const allocator_type &a = allocator_type())
+      : _count(0), _hasher(hf), _key_equal(eql), _allocator(a) {
+    _seed = FOC_GET_HASH_SEED;
+    _root.allocate(_allocator, 0);
+  }
+
+  // O(1) snapshot: the copy shares all the tries with other.
+  PersistentHashArrayMappedTrie(const PersistentHashArrayMappedTrie &other)
+      : _count(other._count),
+        _seed(other._seed),
+        _hasher(other._hasher),
+        _key_equal(other._key_equal),
+        _allocator(other._allocator) {
+    _root.share(other._root);
+  }
+
+  PersistentHashArrayMappedTrie(PersistentHashArrayMappedTrie &&other)
+      : _count(other._count),
+        _root(std::move(other._root)),
+        _seed(other._seed),
+        _hasher(std::move(other._hasher)),
+        _key_equal(std::move(other._key_equal)),
+        _allocator(std::move(other._allocator)) {
+    other._count = 0;
+    other._root.allocate(other._allocator, 0);
+  }
+
+  ~PersistentHashArrayMappedTrie() { _root.releaseRecursively(_allocator); }
+
+  PersistentHashArrayMappedTrie &operator=(const PersistentHashArrayMappedTrie &other) {
+    PersistentHashArrayMappedTrie copy(other);
+    swap(copy);
+    return *this;
+  }
+
+  PersistentHashArrayMappedTrie &operator=(PersistentHashArrayMappedTrie &&other) {
+    PersistentHashArrayMappedTrie copy(std::move(other));
+    swap(copy);
+    return *this;
+  }
+
+  allocator_type get_allocator() const { return _allocator; }
+
+  const_iterator begin() const { return const_iterator(_root); }
+  const_iterator end() const { return const_iterator(); }
+  const_iterator cbegin() const { return begin(); }
+  const_iterator cend() const { return end(); }
+
+  bool empty() const { return _count == 0; }
+  size_type size() const { return _count; }
+
+  // Returns a version of the map containing entry. The value of an existing key
+  // is replaced. If the entry can't be inserted because memory ran out, the
+  // returned version is equal to this one and *succeeded (if given) is set to
+  // false.
+  PersistentHashArrayMappedTrie insert(const value_type &entry, bool *succeeded = nullptr) const;
+
+  // Returns a version of the map without key. If the key can't be erased
+  // because memory ran out, the returned version is equal to this one and
+  // *succeeded (if given) is set to false.
+  PersistentHashArrayMappedTrie erase(const Key &key, bool *succeeded = nullptr) const;
+
+  class Transient;
+
+  // Returns a mutable copy of the map for batches of updates.
+  Transient transient() const { return Transient(*this); }
+
+  void swap(PersistentHashArrayMappedTrie &other) {
+    std::swap(_count, other._count);
+    std::swap(_seed, other._seed);
+    std::swap(_hasher, other._hasher);
+    std::swap(_key_equal, other._key_equal);
+    std::swap(_allocator, other._allocator);
+    _root.swap(other._root);
+  }
+
+  bool operator==(const PersistentHashArrayMappedTrie &other) const;
+  bool operator!=(const PersistentHashArrayMappedTrie &other) const { return !(*this == other); }
+
+  const Node *findNode(const Key &key) const {
+    const BitmapTrie *trie = &_root;
+    uint64_t hash = hash64(key, _seed);
+    uint32_t hash_offset = 0;
+    uint32_t t = hash & 0x1f;
+
+    while (trie->logicalPositionTaken(t)) {
+      if (trie->logicalIsEntry(t)) {
+        const Node *node = &trie->physicalGet(trie->entryIndex(t));
+        if (_key_equal(node->asEntry().first, key)) {
+          return node;
+        }
+        return nullptr;
+      }
+
+      trie = &trie->physicalGet(trie->trieIndex(t)).asTrie();
+      if (UNLIKELY(hash_offset == detail::hamt_last_hash_offset)) {
+        return findCollidingNode(*trie, key);
+      }
+      hash_offset += 5;
+      t = (hash >> hash_offset) & 0x1f;
+    }
+
+    return nullptr;
+  }
+
+  const T *find(const Key &key) const {
+    const Node *node = findNode(key);
+    if (node) {
+      return &node->asEntry().second;
+    }
+    return nullptr;
+  }
+
+ private:
+  // Inserts (or replaces) entry modifying this version in place.
+  bool insertInPlace(const Entry &entry);
+  // Erases key modifying this version in place.
+  bool eraseInPlace(const Key &key);
+
+  // Makes sure the base array of trie is not shared with other versions so it
+  // can be modified in place. Tries that were copied for this version already
+  // have their own base array and are left untouched.
+  bool makePrivate(BitmapTrie *trie) {
+    // A base array with a single reference belongs to this version (or to the
+    // transient being updated) and nobody else can observe it being modified.
+    if (!trie->baseIsShared()) {
+      return true;
+    }
+    BitmapTrie copy;
+    if (!copy.copyShallow(_allocator, *trie, trie->capacity())) {
+      return false;
+    }
+    trie->releaseRecursively(_allocator);
+    *trie = std::move(copy);
+    return true;
+  }
+
+  // Inserts new_entry in the trie at depth level. The trie should already be
+  // private to this version. The sub-tries in the path are copied on the way
+  // down and everything else keeps being shared.
+  Node *insertEntry(BitmapTrie *trie,
+                    const Entry &new_entry,
+                    uint64_t hash,
+                    uint32_t hash_offset,
+                    uint32_t level,
+                    bool &replaced);
+
+  // Erases key, which should be in the trie, from the trie at depth level.
+  bool eraseEntry(BitmapTrie *trie,
+                  const Key &key,
+                  uint64_t hash,
+                  uint32_t hash_offset,
+                  uint32_t level,
+                  size_t expected_hamt_size);
+
+  // Collision nodes {{{
+  //
+  // Keys whose hashes share all the slices are kept in chains of collision
+  // nodes, as in HashArrayMappedTrie (see detail::hamt_collision_node_entries).
+  // The nodes of a chain are copied for a new version up to the last one that
+  // is modified.
+
+  const Node *findCollidingNode(const BitmapTrie &trie, const Key &key) const {
+    for (const BitmapTrie *node = &trie; node; node = node->overflowNode()) {
+      const uint32_t entry_count = node->entryCount();
+      for (uint32_t i = 0; i < entry_count; i++) {
+        if (_key_equal(node->physicalGet(i).asEntry().first, key)) {
+          return &node->physicalGet(i);
+        }
+      }
+    }
+    return nullptr;
+  }
+
+  // Does insertEntry() in the chain of collision nodes that starts at trie.
+  Node *insertCollidingEntry(BitmapTrie *trie,
+                             const Entry &new_entry,
+                             uint32_t level,
+                             bool &replaced);
+
+  // Does eraseEntry() in the chain of collision nodes that starts at trie.
+  bool eraseCollidingEntry(BitmapTrie *trie,
+                           const Key &key,
+                           uint32_t level,
+                           size_t expected_hamt_size);
+
+  // }}}
+
+  // Replaces the trie at logical_index, which contains a single entry, with the
+  // entry itself. Both tries should be private to this version.
+  void collapseSingleEntryTrie(BitmapTrie *trie, uint32_t logical_index) {
+    BitmapTrie *child = &trie->logicalGet(logical_index).asTrie();
+    assert(child->size() == 1 && child->physicalIsEntry(0));
+    Entry entry(std::move(child->physicalGet(0).asEntry()));
+    child->physicalGet(0).asEntry().~Entry();
+    child->deallocate(_allocator);
+    trie->trieToEntry(logical_index, std::move(entry));
+  }
+
+  uint64_t hash64(const Key &key, uint64_t seed) const {
+    return detail::hamt_mix_hash(seed ^ static_cast<uint64_t>(_hasher(key)));
+  }
+
+#ifdef GTEST
+  // clang-format off
+ PUBLIC_IN_GTEST:
+  const BitmapTrie &root() const { return _root; }
+  // clang-format on
+#endif  // GTEST
+};
+
+// PersistentHashArrayMappedTrie {{{
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+PersistentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>
+PersistentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::insert(
+    const value_type &entry, bool *succeeded) const {
+  if (succeeded) {
+    *succeeded = false;
+  }
+  PersistentHashArrayMappedTrie version(*this);
+  if (!version.insertInPlace(entry)) {
+    return *this;
+  }
+  if (succeeded) {
+    *succeeded = true;
+  }
+  return version;
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+PersistentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>
+PersistentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::erase(const Key &key,
+                                                                        bool *succeeded) const {
+  if (succeeded) {
+    *succeeded = true;
+  }
+  // Don't copy any trie if there is nothing to erase.
+  if (findNode(key) == nullptr) {
+    return *this;
+  }
+  if (succeeded) {
+    *succeeded = false;
+  }
+  PersistentHashArrayMappedTrie version(*this);
+  if (!version.eraseInPlace(key)) {
+    return *this;
+  }
+  if (succeeded) {
+    *succeeded = true;
+  }
+  return version;
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+bool PersistentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::insertInPlace(
+    const Entry &entry) {
+  if (!makePrivate(&_root)) {
+    return false;
+  }
+  uint64_t hash = hash64(entry.first, _seed);
+  bool replaced = false;
+  Node *node = insertEntry(&_root, entry, hash, 0, 0, replaced);
+  if (node == nullptr) {
+    return false;
+  }
+  if (!replaced) {
+    _count++;
+  }
+  return true;
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+bool PersistentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::eraseInPlace(
+    const Key &key) {
+  if (findNode(key) == nullptr || !makePrivate(&_root)) {
+    return false;
+  }
+  uint64_t hash = hash64(key, _seed);
+  size_t expected_hamt_size = _count > 1 ? _count - 1 : 1;
+  if (!eraseEntry(&_root, key, hash, 0, 0, expected_hamt_size)) {
+    return false;
+  }
+  _count--;
+  return true;
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+typename PersistentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::Node *
+PersistentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::insertEntry(
+    BitmapTrie *trie,
+    const Entry &new_entry,
+    uint64_t hash,
+    uint32_t hash_offset,
+    uint32_t level,
+    bool &replaced) {
+  if (UNLIKELY(level == detail::hamt_collision_level)) {
+    return insertCollidingEntry(trie, new_entry, level, replaced);
+  }
+
+  uint32_t hash_slice = (hash >> hash_offset) & 0x1f;
+  if (!trie->logicalPositionTaken(hash_slice)) {
+    return trie->insertEntry(_allocator, hash_slice, new_entry, _count + 1, level);
+  }
+
+  if (trie->logicalIsTrie(hash_slice)) {
+    BitmapTrie *child = &trie->physicalGet(trie->trieIndex(hash_slice)).asTrie();
+    if (!makePrivate(child)) {
+      return nullptr;
+    }
+    return insertEntry(child, new_entry, hash, hash_offset + 5, level + 1, replaced);
+  }
+
+  Node *node = &trie->physicalGet(trie->entryIndex(hash_slice));
+  Entry *old_entry = &node->asEntry();
+  if (_key_equal(old_entry->first, new_entry.first)) {
+    // The entry is a copy owned by this version.
+    old_entry->second = new_entry.second;
+    replaced = true;
+    return node;
+  }
+
+  // Has to replace the entry with a trie. Entries whose hashes share all the
+  // slices meet again in a collision node.
+  uint64_t old_entry_hash = hash64(old_entry->first, _seed);
+
+  // The new trie is private to this version.
+  Entry replaced_entry(std::move(*old_entry));
+  BitmapTrie *child = trie->entryToTrie(_allocator, hash_slice, 2);
+
+  auto replaced_node =
+      insertEntry(child, replaced_entry, old_entry_hash, hash_offset + 5, level + 1, replaced);
+  if (replaced_node == nullptr) {
+    child->deallocate(_allocator);
+    trie->trieToEntry(hash_slice, std::move(replaced_entry));
+    return nullptr;
+  }
+  Node *new_node = insertEntry(child, new_entry, hash, hash_offset + 5, level + 1, replaced);
+  if (UNLIKELY(new_node == nullptr)) {
+    collapseSingleEntryTrie(trie, hash_slice);
+  }
+  return new_node;
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+bool PersistentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::eraseEntry(
+    BitmapTrie *trie,
+    const Key &key,
+    uint64_t hash,
+    uint32_t hash_offset,
+    uint32_t level,
+    size_t expected_hamt_size) {
+  if (UNLIKELY(level == detail::hamt_collision_level)) {
+    return eraseCollidingEntry(trie, key, level, expected_hamt_size);
+  }
+
+  uint32_t hash_slice = (hash >> hash_offset) & 0x1f;
+  assert(trie->logicalPositionTaken(hash_slice));
+  if (trie->logicalIsEntry(hash_slice)) {
+    assert(_key_equal(trie->logicalGet(hash_slice).asEntry().first, key));
+    trie->eraseEntry(_allocator, hash_slice, expected_hamt_size, level);
+    return true;
+  }
+
+  BitmapTrie *child = &trie->physicalGet(trie->trieIndex(hash_slice)).asTrie();
+  if (!makePrivate(child) ||
+      !eraseEntry(child, key, hash, hash_offset + 5, level + 1, expected_hamt_size)) {
+    return false;
+  }
+
+  // Keep the HAMT canonical (see HashArrayMappedTrie::eraseEntry).
+  if (child->size() == 1 && child->physicalIsEntry(0)) {
+    collapseSingleEntryTrie(trie, hash_slice);
+  }
+  return true;
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+typename PersistentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::Node *
+PersistentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::insertCollidingEntry(
+    BitmapTrie *trie, const Entry &new_entry, uint32_t level, bool &replaced) {
+  BitmapTrie *node = trie;
+  for (;;) {
+    const uint32_t entry_count = node->entryCount();
+    for (uint32_t i = 0; i < entry_count; i++) {
+      Entry *old_entry = &node->physicalGet(i).asEntry();
+      if (_key_equal(old_entry->first, new_entry.first)) {
+        old_entry->second = new_entry.second;
+        replaced = true;
+        return &node->physicalGet(i);
+      }
+    }
+    BitmapTrie *next = node->overflowNode();
+    if (next == nullptr) {
+      break;
+    }
+    if (!makePrivate(next)) {
+      return nullptr;
+    }
+    node = next;
+  }
+
+  // The key goes to the last node, or to a new node chained to it if it's full.
+  if (node->entryCount() == detail::hamt_collision_node_entries) {
+    node = node->appendOverflowNode(_allocator, 1);
+    if (node == nullptr) {
+      return nullptr;
+    }
+  }
+  const uint32_t logical_index = __builtin_ctz(~node->bitmap());
+  return node->insertEntry(_allocator, logical_index, new_entry, _count + 1, level);
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+bool PersistentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::eraseCollidingEntry(
+    BitmapTrie *trie, const Key &key, uint32_t level, size_t expected_hamt_size) {
+  // The last entry of the chain is moved into the place of the erased one, so
+  // the whole chain is copied for this version.
+  BitmapTrie *found = nullptr;
+  uint32_t found_index = 0;
+  for (BitmapTrie *node = trie; node; node = node->overflowNode()) {
+    if (node != trie && !makePrivate(node)) {
+      return false;
+    }
+    const uint32_t entry_count = node->entryCount();
+    for (uint32_t i = 0; found == nullptr && i < entry_count; i++) {
+      if (_key_equal(node->physicalGet(i).asEntry().first, key)) {
+        found = node;
+        found_index = i;
+      }
+    }
+  }
+  assert(found);
+  trie->eraseCollidingEntry(_allocator, found, found_index, expected_hamt_size, level);
+  return true;
+}
+
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+bool PersistentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::operator==(
+    const PersistentHashArrayMappedTrie &other) const {
+  if (_count != other._count) {
+    return false;
+  }
+  if (_seed == other._seed) {
+    // Versions derived from the same map share most of their tries, and shared
+    // tries are not visited.
+    auto entry_equal = [this](const Entry &a, const Entry &b) {
+      return _key_equal(a.first, b.first) && a.second == b.second;
+    };
+    return _root.equalsRecursively(other._root, entry_equal);
+  }
+  for (const auto &entry : *this) {
+    const T *value = other.find(entry.first);
+    if (value == nullptr || !(*value == entry.second)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// }}} End of PersistentHashArrayMappedTrie
+
+// A mutable map built from a PersistentHashArrayMappedTrie.
+//
+// The first update of a trie copies it (like insert() and erase() do), and from
+// then on the copy belongs to the transient and is modified in place, growing
+// its base array like HashArrayMappedTrie does. Ownership is given by the
+// reference counts: a trie whose base array has a single reference can't be
+// seen by any other version.
+//
+// persistent() turns the transient into an immutable map in O(1) and leaves the
+// transient empty.
+template <class Key, class T, class Hash, class KeyEqual, class Allocator>
+class PersistentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>::Transient {
+ private:
+  using Map = PersistentHashArrayMappedTrie<Key, T, Hash, KeyEqual, Allocator>;
+
+  Map _map;
+
+ public:
+  explicit Transient(const Map &map) : _map(map) {}
+  Transient(Transient &&other) = default;
+  Transient &operator=(Transient &&other) = default;
+
+  Transient(const Transient &) = delete;
+  Transient &operator=(const Transient &) = delete;
+
+  bool empty() const { return _map.empty(); }
+  size_type size() const { return _map.size(); }
+
+  const T *find(const Key &key) const { return _map.find(key); }
+
+  // Returns false if the entry couldn't be inserted.
+  bool insert(const value_type &entry) { return _map.insertInPlace(entry); }
+
+  // Returns the number of erased entries.
+  size_type erase(const Key &key) { return _map.eraseInPlace(key) ? 1 : 0; }
+
+  Map persistent() { return std::move(_map); }
+};
+
+}  // namespace foc
@@ -0,0 +1,306 @@
+#include <map>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#define GTEST
+#define HAMT_IMPLEMENTATION
+#include "persistent_hash_array_mapped_trie.h"
+
+using foc::PersistentHashArrayMappedTrie;
+
+using PHAMT = PersistentHashArrayMappedTrie<int64_t, int64_t>;
+
+struct IdentityFunction {
+  size_t operator()(int64_t key) const { return key; }
+};
+
+struct ConstantFunction {
+  size_t operator()(int64_t) const { return 1; }
+};
+
+template <class PHAMT>
+static void check_version(const PHAMT &version, const std::map<int64_t, int64_t> &expected) {
+  EXPECT_EQ(version.size(), expected.size());
+  size_t visited = 0;
+  for (const auto &entry : version) {
+    auto it = expected.find(entry.first);
+    ASSERT_TRUE(it != expected.end());
+    EXPECT_EQ(entry.second, it->second);
+    visited++;
+  }
+  EXPECT_EQ(visited, expected.size());
+  for (const auto &pair : expected) {
+    const int64_t *value = version.find(pair.first);
+    ASSERT_TRUE(value != nullptr);
+    EXPECT_EQ(*value, pair.second);
+  }
+}
+
+template <class PHAMT>
+static void versions_test(int64_t n) {
+  // Keep every version and what it should contain.
+  std::vector<PHAMT> versions;
+  std::vector<std::map<int64_t, int64_t>> expected;
+  versions.push_back(PHAMT());
+  expected.push_back({});
+
+  for (int64_t i = 0; i < n; i++) {
+    bool succeeded = false;
+    versions.push_back(versions.back().insert(std::make_pair(i, i), &succeeded));
+    EXPECT_TRUE(succeeded);
+    expected.push_back(expected.back());
+    expected.back()[i] = i;
+  }
+  // Replace values
+  for (int64_t i = 0; i < n; i += 3) {
+    versions.push_back(versions.back().insert(std::make_pair(i, -i)));
+    expected.push_back(expected.back());
+    expected.back()[i] = -i;
+  }
+  // Erase keys
+  for (int64_t i = 0; i < n; i += 2) {
+    versions.push_back(versions.back().erase(i));
+    expected.push_back(expected.back());
+    expected.back().erase(i);
+  }
+
+  for (size_t v = 0; v < versions.size(); v++) {
+    check_version(versions[v], expected[v]);
+  }
+}
+
+TEST(PersistentHashArrayMappedTrieTest, VersionsTest) {
+  versions_test<PHAMT>(300);
+}
+
+TEST(PersistentHashArrayMappedTrieTest, VersionsTestWithIdentityFunction) {
+  versions_test<PersistentHashArrayMappedTrie<int64_t, int64_t, IdentityFunction>>(300);
+}
+
+TEST(PersistentHashArrayMappedTrieTest, VersionsTestWithConstantFunction) {
+  // The keys are kept in a chain of collision nodes.
+  versions_test<PersistentHashArrayMappedTrie<int64_t, int64_t, ConstantFunction>>(100);
+}
+
+// Fails every allocation once remaining reaches zero.
+struct FailingAllocator {
+  static int remaining;
+
+  void *allocate(size_t size, size_t) { return remaining-- > 0 ? malloc(size) : nullptr; }
+  void deallocate(void *ptr, size_t) { free(ptr); }
+};
+
+int FailingAllocator::remaining = 0;
+
+TEST(PersistentHashArrayMappedTrieTest, FailedInsertTest) {
+  using FailingPHAMT = PersistentHashArrayMappedTrie<int64_t,
+                                                     int64_t,
+                                                     std::hash<int64_t>,
+                                                     std::equal_to<int64_t>,
+                                                     FailingAllocator>;
+  FailingAllocator::remaining = 1000;
+  FailingPHAMT map = FailingPHAMT().insert(std::make_pair(1, 1));
+
+  FailingAllocator::remaining = 0;
+  bool succeeded = true;
+  FailingPHAMT same = map.insert(std::make_pair(2, 2), &succeeded);
+  EXPECT_FALSE(succeeded);
+  EXPECT_TRUE(same == map);
+  EXPECT_EQ(same.find(2), nullptr);
+
+  FailingAllocator::remaining = 1000;
+  FailingPHAMT next = map.insert(std::make_pair(2, 2), &succeeded);
+  EXPECT_TRUE(succeeded);
+  EXPECT_EQ(*next.find(2), 2);
+}
+
+TEST(PersistentHashArrayMappedTrieTest, FailedEraseTest) {
+  using FailingPHAMT = PersistentHashArrayMappedTrie<int64_t,
+                                                     int64_t,
+                                                     std::hash<int64_t>,
+                                                     std::equal_to<int64_t>,
+                                                     FailingAllocator>;
+  FailingAllocator::remaining = 1000;
+  FailingPHAMT map;
+  for (int64_t i = 0; i < 100; i++) {
+    map = map.insert(std::make_pair(i, i));
+  }
+
+  // Erasing copies the path to the key, which fails without memory.
+  FailingAllocator::remaining = 0;
+  bool succeeded = true;
+  FailingPHAMT same = map.erase(1, &succeeded);
+  EXPECT_FALSE(succeeded);
+  EXPECT_TRUE(same == map);
+  EXPECT_EQ(*same.find(1), 1);
+
+  // There is nothing to copy when the key isn't in the map.
+  same = map.erase(100, &succeeded);
+  EXPECT_TRUE(succeeded);
+  EXPECT_TRUE(same == map);
+
+  FailingAllocator::remaining = 1000;
+  FailingPHAMT next = map.erase(1, &succeeded);
+  EXPECT_TRUE(succeeded);
+  EXPECT_EQ(next.find(1), nullptr);
+  EXPECT_EQ(next.size(), 99);
+}
+
+TEST(PersistentHashArrayMappedTrieTest, CollisionNodeSharingTest) {
+  using ConstantPHAMT = PersistentHashArrayMappedTrie<int64_t, int64_t, ConstantFunction>;
+  ConstantPHAMT map;
+  const int64_t n = 3 * foc::detail::hamt_collision_node_entries;
+  for (int64_t i = 0; i < n; i++) {
+    map = map.insert(std::make_pair(i, i));
+  }
+  const ConstantPHAMT::BitmapTrie *head = &map.root();
+  for (uint32_t level = 0; level < foc::detail::hamt_collision_level; level++) {
+    head = &head->physicalGet(0).asTrie();
+  }
+  EXPECT_EQ(head->entryCount(), foc::detail::hamt_collision_node_entries);
+  ASSERT_TRUE(head->overflowNode() != nullptr);
+
+  // Replacing a value in the first node of the chain shares the others.
+  ConstantPHAMT next = map.insert(std::make_pair(0, -1));
+  const ConstantPHAMT::BitmapTrie *next_head = &next.root();
+  for (uint32_t level = 0; level < foc::detail::hamt_collision_level; level++) {
+    next_head = &next_head->physicalGet(0).asTrie();
+  }
+  EXPECT_NE(&next_head->physicalGet(0), &head->physicalGet(0));
+  EXPECT_EQ(&next_head->overflowNode()->physicalGet(0), &head->overflowNode()->physicalGet(0));
+  EXPECT_EQ(*next.find(0), -1);
+  EXPECT_EQ(*map.find(0), 0);
+  EXPECT_TRUE(next != map);
+
+  // Erasing every key but one collapses the chain.
+  for (int64_t i = 1; i < n; i++) {
+    next = next.erase(i);
+    EXPECT_EQ(next.find(i), nullptr);
+    EXPECT_EQ(*next.find(0), -1);
+  }
+  EXPECT_EQ(next.size(), 1);
+  EXPECT_EQ(next.root().size(), 1);
+  EXPECT_TRUE(next.root().physicalIsEntry(0));
+  EXPECT_EQ(map.size(), n);
+  for (int64_t i = 0; i < n; i++) {
+    EXPECT_EQ(*map.find(i), i);
+  }
+}
+
+TEST(PersistentHashArrayMappedTrieTest, SnapshotTest) {
+  PHAMT map;
+  for (int64_t i = 0; i < 10000; i++) {
+    map = map.insert(std::make_pair(i, i));
+  }
+
+  // Snapshots share the root trie.
+  PHAMT snapshot(map);
+  EXPECT_EQ(&snapshot.root().physicalGet(0), &map.root().physicalGet(0));
+  EXPECT_TRUE(snapshot == map);
+
+  map = map.insert(std::make_pair(10000, 10000));
+  map = map.erase(0);
+  EXPECT_EQ(snapshot.size(), 10000);
+  EXPECT_EQ(*snapshot.find(0), 0);
+  EXPECT_EQ(snapshot.find(10000), nullptr);
+  EXPECT_EQ(map.size(), 10000);
+  EXPECT_EQ(map.find(0), nullptr);
+  EXPECT_EQ(*map.find(10000), 10000);
+  EXPECT_TRUE(snapshot != map);
+
+  // Only the path to the modified entry was copied.
+  PHAMT next = map.insert(std::make_pair(1, 100));
+  size_t shared = 0;
+  const auto &root = map.root();
+  for (uint32_t i = root.entryCount(); i < root.size(); i++) {
+    if (&root.physicalGet(i).asTrie().physicalGet(0) ==
+        &next.root().physicalGet(i).asTrie().physicalGet(0)) {
+      shared++;
+    }
+  }
+  EXPECT_EQ(shared, root.trieCount() - 1);
+
+  // Erasing a missing key doesn't copy anything.
+  PHAMT same = map.erase(123456);
+  EXPECT_EQ(&same.root().physicalGet(0), &map.root().physicalGet(0));
+}
+
+TEST(PersistentHashArrayMappedTrieTest, StringKeysTest) {
+  using StringPHAMT = PersistentHashArrayMappedTrie<std::string, std::string>;
+  StringPHAMT map;
+  for (int i = 0; i < 1000; i++) {
+    map = map.insert(std::make_pair(std::to_string(i), std::to_string(i)));
+  }
+  StringPHAMT old = map;
+  for (int i = 0; i < 1000; i += 2) {
+    map = map.erase(std::to_string(i));
+  }
+  EXPECT_EQ(map.size(), 500);
+  EXPECT_EQ(old.size(), 1000);
+  for (int i = 0; i < 1000; i++) {
+    EXPECT_EQ(*old.find(std::to_string(i)), std::to_string(i));
+    EXPECT_EQ(map.find(std::to_string(i)) != nullptr, i % 2 == 1);
+  }
+}
+
+TEST(PersistentHashArrayMappedTrieTest, TransientTest) {
+  PHAMT map;
+  for (int64_t i = 0; i < 1000; i++) {
+    map = map.insert(std::make_pair(i, i));
+  }
+
+  // Batch of updates on top of map
+  PHAMT::Transient transient = map.transient();
+  for (int64_t i = 1000; i < 10000; i++) {
+    EXPECT_TRUE(transient.insert(std::make_pair(i, i)));
+  }
+  for (int64_t i = 0; i < 10000; i += 2) {
+    EXPECT_EQ(transient.erase(i), 1);
+  }
+  EXPECT_EQ(transient.erase(0), 0);
+  EXPECT_TRUE(transient.insert(std::make_pair(1, -1)));
+  EXPECT_EQ(transient.size(), 5000);
+  EXPECT_EQ(*transient.find(1), -1);
+
+  // The map used as the starting point is untouched.
+  std::map<int64_t, int64_t> expected;
+  for (int64_t i = 0; i < 1000; i++) {
+    expected[i] = i;
+  }
+  check_version(map, expected);
+
+  PHAMT updated = transient.persistent();
+  EXPECT_TRUE(transient.empty());
+  expected.clear();
+  for (int64_t i = 1; i < 10000; i += 2) {
+    expected[i] = i;
+  }
+  expected[1] = -1;
+  check_version(updated, expected);
+
+  // Same result as one update at a time
+  PHAMT one_by_one = map;
+  for (int64_t i = 1000; i < 10000; i++) {
+    one_by_one = one_by_one.insert(std::make_pair(i, i));
+  }
+  for (int64_t i = 0; i < 10000; i += 2) {
+    one_by_one = one_by_one.erase(i);
+  }
+  one_by_one = one_by_one.insert(std::make_pair(1, -1));
+  EXPECT_TRUE(one_by_one == updated);
+}
+
+TEST(PersistentHashArrayMappedTrieTest, TransientUpdatesInPlaceTest) {
+  PHAMT map = PHAMT().insert(std::make_pair(1, 1));
+  PHAMT::Transient transient = map.transient();
+
+  // The first update copies the root, the following ones reuse the copy.
+  transient.insert(std::make_pair(1, 2));
+  const int64_t *value = transient.find(1);
+  transient.insert(std::make_pair(1, 3));
+  EXPECT_EQ(transient.find(1), value);
+  EXPECT_EQ(*value, 3);
+  EXPECT_EQ(*map.find(1), 1);
+}
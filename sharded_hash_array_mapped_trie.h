@@ -0,0 +1,312 @@
+// Sharded Hash Array Mapped Trie
+//
+// A concurrent map made of N independent HashArrayMappedTries. Keys are routed
+// to a shard by the top bits of their hash and every shard is protected by its
+// own reader-writer lock, so updates to different shards never contend and
+// write throughput grows with the number of shards until they stop being the
+// bottleneck.
+//
+// This is a simpler alternative to ConcurrentHashArrayMappedTrie: lookups take
+// a shared lock instead of being lock-free and there are no snapshots, but
+// every shard is a plain HashArrayMappedTrie with its compact memory layout.
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "allocator.h"
+#include "hash_array_mapped_trie.h"
+#include "support.h"
+
+#ifndef PUBLIC_IN_GTEST
+#ifdef GTEST
+#define PUBLIC_IN_GTEST public
+#else
+#define PUBLIC_IN_GTEST private
+#endif
+#endif
+
+namespace foc {
+
+namespace detail {
+
+constexpr size_t cache_line_size = 64;
+
+// clear() only starts another thread for every this many entries. Starting a
+// thread costs more than clearing a small trie.
+constexpr size_t sharded_hamt_clear_entries_per_thread = 1 << 16;
+
+// Readers-writer spinlock. A writer that is waiting for the readers to leave
+// keeps new readers out, so writers aren't starved by a stream of readers.
+class RWSpinLock {
+ private:
+  static const uint32_t writer = 1U << 31;
+
+  // Number of readers holding the lock | writer
+  std::atomic<uint32_t> _state;
+
+ public:
+  RWSpinLock() : _state(0) {}
+
+  RWSpinLock(const RWSpinLock &) = delete;
+  RWSpinLock &operator=(const RWSpinLock &) = delete;
+
+  void lock() {
+    uint32_t state = _state.load(std::memory_order_relaxed);
+    while ((state & writer) || !_state.compare_exchange_weak(
+                                   state, state | writer, std::memory_order_acquire)) {
+      std::this_thread::yield();
+      state = _state.load(std::memory_order_relaxed);
+    }
+    while (_state.load(std::memory_order_acquire) != writer) {
+      std::this_thread::yield();
+    }
+  }
+
+  void unlock() { _state.store(0, std::memory_order_release); }
+
+  void lock_shared() {
+    uint32_t state = _state.load(std::memory_order_relaxed);
+    while ((state & writer) ||
+           !_state.compare_exchange_weak(state, state + 1, std::memory_order_acquire)) {
+      std::this_thread::yield();
+      state = _state.load(std::memory_order_relaxed);
+    }
+  }
+
+  void unlock_shared() { _state.fetch_sub(1, std::memory_order_release); }
+};
+
+// Forwards to Allocator and keeps track of the bytes allocated through it. The
+// counter is part of the allocator value, so every HashArrayMappedTrie using a
+// copy of it has its own counter.
+template <class Allocator>
+class CountingAllocator {
+ private:
+  Allocator _allocator;
+  size_t _allocated_bytes;
+
+ public:
+  explicit CountingAllocator(const Allocator &a = Allocator())
+      : _allocator(a), _allocated_bytes(0) {}
+
+  void *allocate(size_t size, size_t alignment) {
+    void *ptr = _allocator.allocate(size, alignment);
+    if (ptr) {
+      _allocated_bytes += size;
+    }
+    return ptr;
+  }
+
+  void deallocate(void *ptr, size_t size) {
+    _allocator.deallocate(ptr, size);
+    _allocated_bytes -= size;
+  }
+
+  size_t allocatedBytes() const { return _allocated_bytes; }
+};
+
+}  // namespace detail
+
+template <class Key,
+          class T,
+          size_t N,
+          class Hash = std::hash<Key>,
+          class KeyEqual = std::equal_to<Key>,
+          class Allocator = MallocAllocator>
+class ShardedHashArrayMappedTrie {
+  static_assert(is_power_of2_64(N), "The number of shards should be a power of two");
+
+  // clang-format off
+ PUBLIC_IN_GTEST:
+  // clang-format on
+  using HAMT =
+      HashArrayMappedTrie<Key, T, Hash, KeyEqual, detail::CountingAllocator<Allocator>>;
+
+  // Every shard starts on its own cache line so that taking the lock of a shard
+  // doesn't invalidate the lines of its neighbours. Objects of this class should
+  // be allocated with the alignment of Shard (e.g. on the stack or statically)
+  // before C++17.
+  struct alignas(detail::cache_line_size) Shard {
+    mutable detail::RWSpinLock lock;
+    // Copy of hamt.size() that can be read without taking the lock.
+    std::atomic<size_t> count;
+    HAMT hamt;
+
+    Shard() : count(0) {}
+  };
+
+  static constexpr uint32_t shard_bits = __builtin_ctzll(N);
+
+  Shard _shards[N];
+  Hash _hasher;
+
+ public:
+  // clang-format off
+  typedef Key                                               key_type;
+  typedef T                                                 mapped_type;
+  typedef Hash                                              hasher;
+  typedef KeyEqual                                          key_equal;
+  typedef Allocator                                         allocator_type;
+  typedef std::pair<const Key, T>                           value_type;
+  typedef size_t                                            size_type;
+  // clang-format on
+
+  // Memory used by a shard.
+  struct ShardStats {
+    size_type size;
+    size_t allocated_bytes;
+  };
+
+  explicit ShardedHashArrayMappedTrie(const hasher &hf = hasher(),
+                                      const key_equal &eql = key_equal(),
+                                      const allocator_type &a = allocator_type());
+
+  ShardedHashArrayMappedTrie(const ShardedHashArrayMappedTrie &) = delete;
+  ShardedHashArrayMappedTrie &operator=(const ShardedHashArrayMappedTrie &) = delete;
+
+  static constexpr size_t shardCount() { return N; }
+
+  // Shard that stores key.
+  size_t shardIndex(const Key &key) const {
+    // Fibonacci hashing makes the top bits depend on every bit of the hash. The
+    // shards use the low bits of the same hash to index their tries.
+    uint64_t hash = static_cast<uint64_t>(_hasher(key)) * 0x9e3779b97f4a7c15ULL;
+    // Shifted in two steps so that a single shard doesn't shift by 64.
+    return static_cast<size_t>((hash >> 1) >> (63 - shard_bits));
+  }
+
+  // Sum of the sizes of the shards without taking their locks. Exact if no
+  // thread is updating the map.
+  size_type size() const;
+  bool empty() const { return size() == 0; }
+
+  // Copies the value of key into *value.
+  bool find(const Key &key, T *value) const;
+
+  // Inserts entry or replaces the value of an existing key. Returns false if the
+  // entry can't be inserted (allocation failures).
+  bool insert(const value_type &entry);
+
+  // Returns the number of erased entries.
+  size_type erase(const Key &key);
+
+  // Clears the shards, in parallel if the map is large enough. Other threads can
+  // keep using the map while it's cleared.
+  void clear();
+
+  ShardStats shardStats(size_t shard) const;
+};
+
+// ShardedHashArrayMappedTrie {{{
+
+template <class Key, class T, size_t N, class Hash, class KeyEqual, class Allocator>
+ShardedHashArrayMappedTrie<Key, T, N, Hash, KeyEqual, Allocator>::ShardedHashArrayMappedTrie(
+    const hasher &hf, const key_equal &eql, const allocator_type &a)
+    : _hasher(hf) {
+  for (size_t i = 0; i < N; i++) {
+    _shards[i].hamt = HAMT(1, hf, eql, detail::CountingAllocator<Allocator>(a));
+  }
+}
+
+template <class Key, class T, size_t N, class Hash, class KeyEqual, class Allocator>
+typename ShardedHashArrayMappedTrie<Key, T, N, Hash, KeyEqual, Allocator>::size_type
+ShardedHashArrayMappedTrie<Key, T, N, Hash, KeyEqual, Allocator>::size() const {
+  size_type count = 0;
+  for (size_t i = 0; i < N; i++) {
+    count += _shards[i].count.load(std::memory_order_relaxed);
+  }
+  return count;
+}
+
+template <class Key, class T, size_t N, class Hash, class KeyEqual, class Allocator>
+bool ShardedHashArrayMappedTrie<Key, T, N, Hash, KeyEqual, Allocator>::find(const Key &key,
+                                                                            T *value) const {
+  const Shard &shard = _shards[shardIndex(key)];
+  shard.lock.lock_shared();
+  const T *found = shard.hamt.find(key);
+  if (found) {
+    *value = *found;
+  }
+  shard.lock.unlock_shared();
+  return found != nullptr;
+}
+
+template <class Key, class T, size_t N, class Hash, class KeyEqual, class Allocator>
+bool ShardedHashArrayMappedTrie<Key, T, N, Hash, KeyEqual, Allocator>::insert(
+    const value_type &entry) {
+  Shard &shard = _shards[shardIndex(entry.first)];
+  shard.lock.lock();
+  bool inserted = shard.hamt.insert(entry) != shard.hamt.end();
+  shard.count.store(shard.hamt.size(), std::memory_order_relaxed);
+  shard.lock.unlock();
+  return inserted;
+}
+
+template <class Key, class T, size_t N, class Hash, class KeyEqual, class Allocator>
+typename ShardedHashArrayMappedTrie<Key, T, N, Hash, KeyEqual, Allocator>::size_type
+ShardedHashArrayMappedTrie<Key, T, N, Hash, KeyEqual, Allocator>::erase(const Key &key) {
+  Shard &shard = _shards[shardIndex(key)];
+  shard.lock.lock();
+  size_type erased = shard.hamt.erase(key);
+  shard.count.store(shard.hamt.size(), std::memory_order_relaxed);
+  shard.lock.unlock();
+  return erased;
+}
+
+template <class Key, class T, size_t N, class Hash, class KeyEqual, class Allocator>
+void ShardedHashArrayMappedTrie<Key, T, N, Hash, KeyEqual, Allocator>::clear() {
+  size_t thread_count = std::thread::hardware_concurrency();
+  if (thread_count == 0 || thread_count > N) {
+    thread_count = N;
+  }
+  // Small maps are cleared by the calling thread alone.
+  const size_t max_threads = size() / detail::sharded_hamt_clear_entries_per_thread;
+  if (thread_count > max_threads) {
+    thread_count = max_threads > 0 ? max_threads : 1;
+  }
+
+  // Thread t clears the shards t, t + thread_count, t + 2 * thread_count...
+  auto clear_shards = [this, thread_count](size_t t) {
+    for (size_t i = t; i < N; i += thread_count) {
+      Shard &shard = _shards[i];
+      shard.lock.lock();
+      shard.hamt.clear();
+      shard.count.store(0, std::memory_order_relaxed);
+      shard.lock.unlock();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  threads.reserve(thread_count - 1);
+  for (size_t t = 1; t < thread_count; t++) {
+    threads.emplace_back(clear_shards, t);
+  }
+  clear_shards(0);
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+template <class Key, class T, size_t N, class Hash, class KeyEqual, class Allocator>
+typename ShardedHashArrayMappedTrie<Key, T, N, Hash, KeyEqual, Allocator>::ShardStats
+ShardedHashArrayMappedTrie<Key, T, N, Hash, KeyEqual, Allocator>::shardStats(size_t i) const {
+  assert(i < N);
+  const Shard &shard = _shards[i];
+  shard.lock.lock_shared();
+  ShardStats stats;
+  stats.size = shard.hamt.size();
+  stats.allocated_bytes = shard.hamt.get_allocator().allocatedBytes();
+  shard.lock.unlock_shared();
+  return stats;
+}
+
+// }}} End of ShardedHashArrayMappedTrie
+
+}  // namespace foc
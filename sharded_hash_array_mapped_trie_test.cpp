@@ -0,0 +1,160 @@
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#define GTEST
+#define HAMT_IMPLEMENTATION
+#include "sharded_hash_array_mapped_trie.h"
+
+using foc::ShardedHashArrayMappedTrie;
+
+using ShardedHAMT = ShardedHashArrayMappedTrie<int64_t, int64_t, 16>;
+
+struct IdentityFunction {
+  size_t operator()(int64_t key) const { return key; }
+};
+
+template <class Map>
+static void single_thread_test(int64_t n) {
+  Map map;
+  for (int64_t i = 0; i < n; i++) {
+    EXPECT_TRUE(map.insert(std::make_pair(i, i)));
+  }
+  EXPECT_EQ(map.size(), n);
+  for (int64_t i = 0; i < n; i += 2) {
+    EXPECT_TRUE(map.insert(std::make_pair(i, -i)));
+  }
+  EXPECT_EQ(map.size(), n);
+  for (int64_t i = 0; i < n; i += 3) {
+    EXPECT_EQ(map.erase(i), 1);
+  }
+  EXPECT_EQ(map.erase(-1), 0);
+
+  for (int64_t i = 0; i < n; i++) {
+    int64_t value;
+    if (i % 3 == 0) {
+      EXPECT_FALSE(map.find(i, &value));
+    } else {
+      ASSERT_TRUE(map.find(i, &value));
+      EXPECT_EQ(value, i % 2 == 0 ? -i : i);
+    }
+  }
+  EXPECT_EQ(map.size(), n - (n + 2) / 3);
+}
+
+TEST(ShardedHashArrayMappedTrieTest, SingleThreadTest) {
+  single_thread_test<ShardedHAMT>(10000);
+}
+
+TEST(ShardedHashArrayMappedTrieTest, SingleThreadTestWithIdentityFunction) {
+  single_thread_test<ShardedHashArrayMappedTrie<int64_t, int64_t, 16, IdentityFunction>>(10000);
+}
+
+TEST(ShardedHashArrayMappedTrieTest, SingleShardTest) {
+  single_thread_test<ShardedHashArrayMappedTrie<int64_t, int64_t, 1>>(1000);
+}
+
+TEST(ShardedHashArrayMappedTrieTest, ShardsTest) {
+  // Sequential keys with an identity hash end up in every shard.
+  ShardedHashArrayMappedTrie<int64_t, int64_t, 16, IdentityFunction> map;
+  EXPECT_EQ(alignof(decltype(map)::Shard), foc::detail::cache_line_size);
+  for (int64_t i = 0; i < 1000; i++) {
+    map.insert(std::make_pair(i, i));
+  }
+
+  size_t total = 0;
+  for (size_t i = 0; i < map.shardCount(); i++) {
+    auto stats = map.shardStats(i);
+    EXPECT_GT(stats.size, 0);
+    EXPECT_GT(stats.allocated_bytes, 0);
+    total += stats.size;
+  }
+  EXPECT_EQ(total, 1000);
+  for (int64_t i = 0; i < 1000; i++) {
+    EXPECT_EQ(map._shards[map.shardIndex(i)].hamt.find(i) != nullptr, true);
+  }
+
+  size_t allocated_before_clear = map.shardStats(0).allocated_bytes;
+  map.clear();
+  EXPECT_TRUE(map.empty());
+  EXPECT_LT(map.shardStats(0).allocated_bytes, allocated_before_clear);
+  for (size_t i = 0; i < map.shardCount(); i++) {
+    EXPECT_EQ(map.shardStats(i).size, 0);
+  }
+}
+
+TEST(ShardedHashArrayMappedTrieTest, StringKeysTest) {
+  ShardedHashArrayMappedTrie<std::string, std::string, 4> map;
+  for (int i = 0; i < 1000; i++) {
+    map.insert(std::make_pair(std::to_string(i), std::to_string(i)));
+  }
+  for (int i = 0; i < 1000; i += 2) {
+    map.erase(std::to_string(i));
+  }
+  EXPECT_EQ(map.size(), 500);
+  for (int i = 0; i < 1000; i++) {
+    std::string value;
+    EXPECT_EQ(map.find(std::to_string(i), &value), i % 2 == 1);
+    if (i % 2 == 1) {
+      EXPECT_EQ(value, std::to_string(i));
+    }
+  }
+}
+
+TEST(ShardedHashArrayMappedTrieTest, ConcurrentTest) {
+  static ShardedHAMT map;
+  const int64_t thread_count = 4;
+  const int64_t n = 5000;
+
+  // Writers own disjoint ranges of keys while readers check that a key is
+  // either missing or maps to one of the values written for it.
+  std::vector<std::thread> threads;
+  for (int64_t t = 0; t < thread_count; t++) {
+    threads.emplace_back([t, n]() {
+      for (int64_t i = t * n; i < (t + 1) * n; i++) {
+        EXPECT_TRUE(map.insert(std::make_pair(i, i)));
+      }
+      for (int64_t i = t * n; i < (t + 1) * n; i += 2) {
+        EXPECT_EQ(map.erase(i), 1);
+      }
+    });
+    threads.emplace_back([n]() {
+      for (int64_t i = 0; i < thread_count * n; i++) {
+        int64_t value;
+        if (map.find(i, &value)) {
+          EXPECT_EQ(value, i);
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  EXPECT_EQ(map.size(), thread_count * n / 2);
+  for (int64_t i = 0; i < thread_count * n; i++) {
+    int64_t value;
+    EXPECT_EQ(map.find(i, &value), i % 2 == 1);
+  }
+  map.clear();
+  EXPECT_TRUE(map.empty());
+}
+
+TEST(ShardedHashArrayMappedTrieTest, ParallelClearTest) {
+  static ShardedHAMT map;
+  // Large enough for clear() to start more threads.
+  const int64_t n = 4 * foc::detail::sharded_hamt_clear_entries_per_thread;
+  for (int64_t i = 0; i < n; i++) {
+    EXPECT_TRUE(map.insert(std::make_pair(i, i)));
+  }
+  EXPECT_EQ(map.size(), n);
+  map.clear();
+  EXPECT_TRUE(map.empty());
+  for (size_t i = 0; i < map.shardCount(); i++) {
+    EXPECT_EQ(map.shardStats(i).size, 0);
+  }
+  int64_t value;
+  EXPECT_FALSE(map.find(0, &value));
+}
@@ -113,6 +113,13 @@
 # define UNLIKELY(EXPR) (EXPR)
 #endif
 
+// PREFETCH(ADDR) - Hint that the cache line at ADDR will be read soon.
+#if __has_builtin(__builtin_prefetch) || GNUC_PREREQ(4, 0, 0)
+# define PREFETCH(ADDR) __builtin_prefetch(ADDR)
+#else
+# define PREFETCH(ADDR)
+#endif
+
 // MEMORY_SANITIZER_BUILD
 // If built with MemorySanitizer instrumentation.
 #if __has_feature(memory_sanitizer)